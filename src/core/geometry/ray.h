@@ -23,6 +23,17 @@
 //* fwd
 class Medium;
 
+//*   The cone around a ray covering the footprint of a pixel, from "Texture
+//* level of detail strategies for real-time ray tracing" (Akenine-Moller et
+//* al. 2019). The width is taken at the origin, the spread is the full angle
+//* of the cone. The rays without a footprint have zero width and spread
+struct RayCone {
+  float width = 0, spread = 0;
+
+  //* The width at distance t, negative once a focusing cone passed its apex
+  float widthAt(float t) const { return width + spread * t; }
+};
+
 template <typename T>
 struct TRay3 {
  public:
@@ -59,6 +70,9 @@ struct TRay3 {
       false;  // set to true when camera generate ray-differential
   Vector3f direction_dx, direction_dy;
 
+  //* The footprint carried through the bounces
+  RayCone cone;
+
   RTCRay toRTC() const {
     RTCRay rtcRay;
     rtcRay.org_x = ori.x;
@@ -2,11 +2,20 @@
 #include <core/geometry/common.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <iostream>
 
 inline int sign(float t) { return t > 0 ? 1 : -1; }
 
+//* Lock free accumulation of a float shared by threads
+inline void atomicAdd(std::atomic<float> &target, float value) {
+  float current = target.load(std::memory_order_relaxed);
+  while (!target.compare_exchange_weak(current, current + value,
+                                       std::memory_order_relaxed))
+    ;
+}
+
 inline float powerHeuristic(float fpdf, float gpdf) {
   if (fpdf == FINF)
     return 1;
@@ -15,6 +24,17 @@ inline float powerHeuristic(float fpdf, float gpdf) {
   return fpdf / (fpdf + gpdf);
 }
 
+//* The power heuristic of f among three strategies
+inline float powerHeuristic(float fpdf, float gpdf, float hpdf) {
+  if (fpdf == FINF)
+    return 1;
+  fpdf *= fpdf;
+  gpdf *= gpdf;
+  hpdf *= hpdf;
+  float sum = fpdf + gpdf + hpdf;
+  return sum > 0 ? fpdf / sum : 0;
+}
+
 inline float fresnelDielectric(float cosThetaI, float eta, float &cosThetaT) {
   // schlick approximation
   // TODO replace the schlick approximation
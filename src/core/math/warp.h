@@ -89,4 +89,79 @@ class Warp {
 
     return azimuthal * longitudinal;
   }
+
+  /// Solid angle subtended by the spherical triangle with vertices a, b, c
+  /// (normalized directions)
+  static float sphericalTriangleArea(const Vector3f &a, const Vector3f &b,
+                                     const Vector3f &c) {
+    return std::abs(2 * std::atan2(dot(a, cross(b, c)),
+                                   1 + dot(a, b) + dot(a, c) + dot(b, c)));
+  }
+
+  /// Uniformly sample the solid angle subtended at p by the triangle v0v1v2
+  /// (Arvo 1995), return the barycentric coordinates of the sampled point on
+  /// the triangle, pdf is set to zero for degenerate triangles
+  static Vector3f squareToSphericalTriangle(const Point2f &sample,
+                                            const Point3f v[3], Point3f p,
+                                            float *pdf) {
+    auto safeASin = [](float x) { return std::asin(std::clamp(x, -1.f, 1.f)); };
+    auto angleBetween = [&](const Vector3f &v1, const Vector3f &v2) {
+      if (dot(v1, v2) < 0)
+        return float(M_PI) - 2 * safeASin((v1 + v2).length() / 2);
+      return 2 * safeASin((v2 - v1).length() / 2);
+    };
+    auto gramSchmidt = [](const Vector3f &v, const Vector3f &w) {
+      return v - w * dot(v, w);
+    };
+
+    *pdf = 0;
+    Vector3f a = normalize(v[0] - p), b = normalize(v[1] - p),
+             c = normalize(v[2] - p);
+    Vector3f nab = cross(a, b), nbc = cross(b, c), nca = cross(c, a);
+    if (nab.length2() == 0 || nbc.length2() == 0 || nca.length2() == 0)
+      return Vector3f{1.f / 3};
+    nab = normalize(nab), nbc = normalize(nbc), nca = normalize(nca);
+
+    //* Interior angles of the spherical triangle
+    float alpha = angleBetween(nab, -nca), beta = angleBetween(nbc, -nab),
+          gamma = angleBetween(nca, -nbc);
+
+    //* Sample the sub-triangle area A'
+    float areaPi = alpha + beta + gamma,
+          subAreaPi = (1 - sample[0]) * float(M_PI) + sample[0] * areaPi;
+    float area = areaPi - float(M_PI);
+    *pdf = area <= 0 ? 0 : 1 / area;
+
+    //* Find cos(beta') for the point along b for the sampled area
+    float cosAlpha = std::cos(alpha), sinAlpha = std::sin(alpha),
+          sinPhi = std::sin(subAreaPi) * cosAlpha -
+                   std::cos(subAreaPi) * sinAlpha,
+          cosPhi = std::cos(subAreaPi) * cosAlpha +
+                   std::sin(subAreaPi) * sinAlpha,
+          k1 = cosPhi + cosAlpha, k2 = sinPhi - sinAlpha * dot(a, b),
+          cosBp = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) /
+                  ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+    cosBp = std::clamp(cosBp, -1.f, 1.f);
+
+    //* Sample c' along the arc between b' and a, then the direction w
+    float sinBp = std::sqrt(std::max(.0f, 1 - cosBp * cosBp));
+    Vector3f cp = a * cosBp + normalize(gramSchmidt(c, a)) * sinBp;
+    float cosTheta = 1 - sample[1] * (1 - dot(cp, b)),
+          sinTheta = std::sqrt(std::max(.0f, 1 - cosTheta * cosTheta));
+    Vector3f w = b * cosTheta + normalize(gramSchmidt(cp, b)) * sinTheta;
+
+    //* Barycentric coordinates of the point where w hits the triangle
+    Vector3f e1 = v[1] - v[0], e2 = v[2] - v[0], s1 = cross(w, e2);
+    float divisor = dot(s1, e1);
+    if (divisor == 0)
+      return Vector3f{1.f / 3};
+    Vector3f s = p - v[0];
+    float b1 = std::clamp(dot(s, s1) / divisor, .0f, 1.f),
+          b2 = std::clamp(dot(w, cross(s, e1)) / divisor, .0f, 1.f);
+    if (b1 + b2 > 1) {
+      float sum = b1 + b2;
+      b1 /= sum, b2 /= sum;
+    }
+    return Vector3f{1 - b1 - b2, b1, b2};
+  }
 };
\ No newline at end of file
@@ -0,0 +1,16 @@
+#include "assetcache.h"
+
+AssetCache &AssetCache::instance() {
+  static AssetCache cache;
+  return cache;
+}
+
+int AssetCache::uniqueAssets() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return assets.size();
+}
+
+int AssetCache::requestCount() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return requests;
+}
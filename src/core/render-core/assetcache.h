@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+
+#include <tbb/task_arena.h>
+
+#include "core/utils/fileidentity.h"
+
+//*   Process-wide cache of the assets decoded from files, so all textures
+//* referring to the same image share one copy, whatever their names in the
+//* scene. An asset is keyed by its type, the decode options and the identity
+//* of the file (its canonical path, size and time of modification), so a
+//* file changed on disk never hits a stale entry, and nothing but the
+//* metadata of the file is read before the asset is loaded.
+//*   Concurrent requests of the same asset wait for the first one to load it
+class AssetCache {
+ public:
+  static AssetCache &instance();
+
+  //* The asset of the file decoded with options, built by load() only on the
+  //* first request
+  template <typename T>
+  std::shared_ptr<const T> get(const std::string &filepath,
+                               const std::string &options,
+                               const std::function<T()> &load) {
+    std::string key = std::string(typeid(T).name()) + "|" + options + "|" +
+                      FileIdentity::of(filepath).key();
+    std::promise<std::shared_ptr<const void>> promise;
+    std::shared_future<std::shared_ptr<const void>> future;
+    bool loader = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++requests;
+      auto itr = assets.find(key);
+      if (itr != assets.end()) {
+        future = itr->second;
+      } else {
+        future = promise.get_future().share();
+        assets.emplace(key, future);
+        loader = true;
+      }
+    }
+    //* Isolated so the parallel loops of load() don't pick up a request
+    //* waiting for this very asset
+    if (loader)
+      tbb::this_task_arena::isolate([&] {
+        promise.set_value(std::make_shared<const T>(load()));
+      });
+    return std::static_pointer_cast<const T>(future.get());
+  }
+
+  int uniqueAssets() const;
+
+  int requestCount() const;
+
+ private:
+  AssetCache() = default;
+
+  mutable std::mutex mutex;
+  std::unordered_map<std::string,
+                     std::shared_future<std::shared_ptr<const void>>>
+      assets;
+  int requests = 0;
+};
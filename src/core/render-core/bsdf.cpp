@@ -1,6 +1,7 @@
 #include "bsdf.h"
 
 #include <core/render-core/info.h>
+#include <core/render-core/lobes.h>
 
 void BSDF::bumpComputeShadingNormal(RayIntersectionRec *i_rec) const {
   if (m_bumpmap == nullptr)
@@ -62,6 +63,53 @@ void BSDF::computeShadingFrame(SurfaceIntersectionInfo *its) const {
   its->shadingFrame = Frame{shadingN, newT, newB};
 }
 
+//*   The closed form lobes are called inline, the other BSDFs go through the
+//* virtual methods
+SpectrumRGB BSDF::dispatchSample(const MaterialClosure &closure,
+                                 BSDFQueryRecord &bRec, Point2f sample,
+                                 float &pdf, ScatterSampleType *type) const {
+#ifdef XLIGHT_STATIC_DISPATCH
+  switch (closure.lobe) {
+  case MaterialClosure::Lobe::Lambertian:
+    return LambertianLobe::sample(closure.albedo, bRec, sample, pdf, type);
+  case MaterialClosure::Lobe::Mirror:
+    return MirrorLobe::sample(bRec, pdf, type);
+  case MaterialClosure::Lobe::Dielectric:
+    return DielectricLobe::sample(closure.eta, bRec, sample, pdf, type);
+  default:
+    break;
+  }
+#endif
+  return this->sample(bRec, sample, pdf, type);
+}
+
+float BSDF::dispatchPdf(const MaterialClosure &closure,
+                        const BSDFQueryRecord &bRec) const {
+#ifdef XLIGHT_STATIC_DISPATCH
+  switch (closure.lobe) {
+  case MaterialClosure::Lobe::Lambertian:
+    return LambertianLobe::pdf(bRec);
+  case MaterialClosure::Lobe::Mirror:
+  case MaterialClosure::Lobe::Dielectric:
+    return .0f;
+  default:
+    break;
+  }
+#endif
+  return pdf(bRec);
+}
+
+MaterialClosure BSDF::resolve(const SurfaceIntersectionInfo &info) const {
+  MaterialClosure closure;
+  if (m_texture) {
+    Vector2f duvdx{info.dudx, info.dvdx}, duvdy{info.dudy, info.dvdy};
+    closure.albedo = m_texture->evaluate(info.uv, duvdx, duvdy);
+    closure.resolved = true;
+  }
+  resolveLobe(&closure);
+  return closure;
+}
+
 SpectrumRGB BSDF::evaluate(const SurfaceIntersectionInfo &info,
                            Vector3f _wo) const {
   Vector3f wi = info.toLocal(info.wi), wo = info.toLocal(_wo);
@@ -71,8 +119,21 @@ SpectrumRGB BSDF::evaluate(const SurfaceIntersectionInfo &info,
   bRec.wo = wo;
   bRec.du = std::max(std::abs(info.dudx), std::abs(info.dudy));
   bRec.dv = std::max(std::abs(info.dvdx), std::abs(info.dvdy));
-  // TODO fixme
-  bRec.du = bRec.dv = .0f;
+  bRec.duvdx = Vector2f{info.dudx, info.dvdx};
+  bRec.duvdy = Vector2f{info.dudy, info.dvdy};
+  const MaterialClosure &closure = info.getClosure();
+  bRec.closure = &closure;
+#ifdef XLIGHT_STATIC_DISPATCH
+  switch (closure.lobe) {
+  case MaterialClosure::Lobe::Lambertian:
+    return LambertianLobe::evaluate(closure.albedo, bRec);
+  case MaterialClosure::Lobe::Mirror:
+  case MaterialClosure::Lobe::Dielectric:
+    return SpectrumRGB{.0f};
+  default:
+    break;
+  }
+#endif
   return evaluate(bRec);
 }
 
@@ -85,9 +146,12 @@ ScatterInfo BSDF::sample(const SurfaceIntersectionInfo &info,
   bRec.wi = wi;
   bRec.du = std::max(std::abs(info.dudx), std::abs(info.dudy));
   bRec.dv = std::max(std::abs(info.dvdx), std::abs(info.dvdy));
-  // TODO fixme
-  bRec.du = bRec.dv = .0f;
-  scatterInfo.weight = sample(bRec, uv, scatterInfo.pdf, &scatterInfo.type);
+  bRec.duvdx = Vector2f{info.dudx, info.dvdx};
+  bRec.duvdy = Vector2f{info.dudy, info.dvdy};
+  const MaterialClosure &closure = info.getClosure();
+  bRec.closure = &closure;
+  scatterInfo.weight =
+      dispatchSample(closure, bRec, uv, scatterInfo.pdf, &scatterInfo.type);
   scatterInfo.wo = info.toWorld(bRec.wo);
 
   return scatterInfo;
@@ -100,7 +164,9 @@ float BSDF::pdf(const SurfaceIntersectionInfo &info, Vector3f _wo) const {
   bRec.wi = wi;
   bRec.wo = wo;
   bRec.du = bRec.dv = .0f;
-  return pdf(bRec);
+  const MaterialClosure &closure = info.getClosure();
+  bRec.closure = &closure;
+  return dispatchPdf(closure, bRec);
 }
 
 float BSDF::pdf(const SurfaceIntersectionInfo &info, Vector3f wi,
@@ -111,7 +177,9 @@ float BSDF::pdf(const SurfaceIntersectionInfo &info, Vector3f wi,
   bRec.wi = wi;
   bRec.wo = wo;
   bRec.du = bRec.dv = .0f;
-  return pdf(bRec);
+  const MaterialClosure &closure = info.getClosure();
+  bRec.closure = &closure;
+  return dispatchPdf(closure, bRec);
 }
 
 SpectrumRGB BlackHole::sample(BSDFQueryRecord &bRec, const Point2f &sample,
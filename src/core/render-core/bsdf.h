@@ -8,12 +8,31 @@ struct SurfaceIntersectionInfo;
 struct ScatterInfo;
 enum class ScatterSampleType;
 
+//*   The textured parameters of a BSDF resolved at a hitpoint. The texture is
+//* filtered once when the surface is hit, and the evaluations, samplings and
+//* pdfs of the next event estimation and the MIS all read this copy
+struct MaterialClosure {
+  SpectrumRGB albedo{.0f};
+  bool resolved = false;
+  //* The closed form lobe of the BSDF, the Generic ones are only reached
+  //* through the virtual methods
+  enum class Lobe { Generic = 0, Lambertian, Mirror, Dielectric };
+  Lobe lobe = Lobe::Generic;
+  //* The relative index of refraction of the Dielectric lobe
+  float eta = 1;
+};
+
 struct BSDFQueryRecord {
   // ! both point from the origin in local
   Vector3f wi, wo;
   Point2f uv;
   float du, dv;
+  //* The uv differentials along the x and y of the screen
+  Vector2f duvdx{.0f}, duvdy{.0f};
   bool isDelta = false;
+  //* The resolved parameters of the hitpoint, the textures are looked up
+  //* when it's null
+  const MaterialClosure *closure = nullptr;
 
   BSDFQueryRecord() = default;
   BSDFQueryRecord(const Vector3f &_wi) : wi(_wi) {}
@@ -91,6 +110,16 @@ class BSDF : public Configurable {
 
   void setNormalmap(std::shared_ptr<Texture> texture) { m_normalmap = texture; }
 
+  //* The texture filtered over the footprint of the query
+  SpectrumRGB evaluateTexture(const BSDFQueryRecord &bRec) const {
+    if (bRec.closure && bRec.closure->resolved)
+      return bRec.closure->albedo;
+    return m_texture->evaluate(bRec.uv, bRec.duvdx, bRec.duvdy);
+  }
+
+  //* Filter the textures once over the footprint of the hitpoint
+  MaterialClosure resolve(const SurfaceIntersectionInfo &info) const;
+
   virtual void initialize() {
     // do nothing
   }
@@ -137,6 +166,22 @@ class BSDF : public Configurable {
 
   virtual bool isDiffuse() const = 0;
 
+ protected:
+  //* Tag the closure with the closed form lobe of the BSDF, if any
+  virtual void resolveLobe(MaterialClosure *closure) const {}
+
+  SpectrumRGB dispatchSample(const MaterialClosure &closure,
+                             BSDFQueryRecord &bRec, Point2f sample, float &pdf,
+                             ScatterSampleType *type) const;
+
+  float dispatchPdf(const MaterialClosure &closure,
+                    const BSDFQueryRecord &bRec) const;
+
+ public:
+  //* Whether all scattering is a Dirac delta distribution, so the surface
+  //* can't be connected to
+  virtual bool isDelta() const { return false; }
+
   enum class EBSDFType {
     EUnknown = 0,
     EEmpty,
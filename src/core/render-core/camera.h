@@ -99,6 +99,11 @@ public:
   }
 
 protected:
+  //* The angle a pixel subtends at the center of the film
+  float pixelSpread(const Point2i &resolution) const {
+    return std::atan(2 * std::tan(vertFov * .5f * PI / 180.f) / resolution.y);
+  }
+
   Point3f pos;
 
   float aspectRatio, vertFov, distToFilm;
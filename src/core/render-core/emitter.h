@@ -14,6 +14,8 @@ struct PointQueryRecord {
   Point3f p;
   Normal3f normal;
   float pdf;
+  //* The primitive where p lies on
+  int primID = -1;
   // TODO delete this
   const Mesh *mesh;
   const Emitter *emitter;
@@ -48,6 +50,24 @@ struct DirectIlluminationRecord {
   bool isDelta = false;
 };
 
+//* Spatial and directional bounds of an emitter, used by the light BVH
+struct LightBounds {
+  AABB3f bounds;
+  //* Cone of emission normals : axis w and the cosine of its half angle
+  Vector3f w{0, 1, 0};
+  float cosThetaO = -1;
+  //* Emission falloff beyond the normal cone, PI / 2 for diffuse emitters
+  float cosThetaE = 0;
+  float phi = 0;
+  bool twoSided = false;
+
+  //* Conservative estimate of the contribution to a reference point
+  //* n can be zero (e.g. a medium vertex), then the cosine term is skipped
+  float importance(Point3f p, Vector3f n) const;
+
+  static LightBounds merge(const LightBounds &a, const LightBounds &b);
+};
+
 struct EmitterHitInfo {
   float dist;
   Point3f hitpoint;
@@ -88,5 +108,8 @@ public:
   virtual void pdf_le(Ray3f ray, Normal3f light_normal, float *pdf_pos,
                       float *pdf_dir) const = 0;
 
+  //* Return nothing for emitters at infinity
+  virtual std::optional<LightBounds> bounds() const { return std::nullopt; }
+
   std::weak_ptr<ShapeInterface> shape;
 };
\ No newline at end of file
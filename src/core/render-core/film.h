@@ -6,6 +6,7 @@
 #include <core/render-core/spectrum.h>
 
 #include <mutex>
+#include <vector>
 
 /**
  * @brief This class response for tile abstruction etc.
@@ -68,6 +69,20 @@ public:
     splat_pixel.write_lock.unlock();
   }
 
+  //* Accumulate a splat buffer covering the whole film, e.g. the buffer
+  //* filled by a single thread
+  void add_splats(const std::vector<SpectrumRGB> &values, float _weight) const {
+    for (int offset = 0; offset < film_size.x * film_size.y; ++offset) {
+      if (values[offset].isZero())
+        continue;
+      auto &splat_pixel = splat_pixels[offset];
+      splat_pixel.write_lock.lock();
+      splat_pixel.value += values[offset] * _weight;
+      splat_pixel.weight += _weight;
+      splat_pixel.write_lock.unlock();
+    }
+  }
+
   void add_sample(Point2i pixel_location, SpectrumRGB _value,
                   float _weight) const {
     auto [x, y] = pixel_location;
@@ -3,6 +3,159 @@
 #include <openvdb/openvdb.h>
 
 #include "core/render-core/medium.h"
+#include "core/utils/mappedfile.h"
+
+class BrickVolume;
+
+//*   Coarse grid of the local maximum and minimum density, in the index space
+//* of the density grid. Each cell covers CELL_SIZE^3 voxels and bounds all
+//* lookups inside it (including the interpolated ones), so the free flights
+//* can sample with a tight majorant and skip the empty cells, while the
+//* minimum serves as the control density of residual ratio tracking
+class MajorantGrid {
+ public:
+  static constexpr int CELL_SIZE = 16;
+
+  MajorantGrid() = default;
+
+  MajorantGrid(const openvdb::FloatGrid &grid, const BrickVolume &volume);
+
+  void write(SnapshotWriter &out) const;
+
+  //* The cells stay in the mapping, false if the snapshot is invalid
+  bool read(SnapshotReader &in);
+
+  //*   Walk the cells crossed by o + t * d with t in [tmin, tmax] by 3D-DDA,
+  //* func(t0, t1, majorant, minimum) is called for each piece in order and
+  //* returns false to stop. The pieces outside the grid are skipped
+  template <typename Func>
+  void traverse(Point3f o, Vector3f d, float tmin, float tmax,
+                Func &&func) const {
+    if (values.empty()) return;
+    //* Clip against the grid bounds
+    for (int axis = 0; axis < 3; ++axis) {
+      float upper = lower[axis] + resolution[axis] * CELL_SIZE;
+      if (d[axis] == 0) {
+        if (o[axis] < lower[axis] || o[axis] > upper) return;
+        continue;
+      }
+      float inv_d = 1.f / d[axis], t0 = (lower[axis] - o[axis]) * inv_d,
+            t1 = (upper - o[axis]) * inv_d;
+      if (t0 > t1) std::swap(t0, t1);
+      tmin = std::max(tmin, t0);
+      tmax = std::min(tmax, t1);
+    }
+    if (tmin >= tmax) return;
+
+    Point3f p = o + tmin * d;
+    int cell[3], step[3];
+    float next[3], delta[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      float local = (p[axis] - lower[axis]) / CELL_SIZE;
+      cell[axis] =
+          std::clamp(int(std::floor(local)), 0, resolution[axis] - 1);
+      if (d[axis] == 0) {
+        step[axis] = 0;
+        next[axis] = delta[axis] = FINF;
+        continue;
+      }
+      int boundary = cell[axis] + (d[axis] > 0 ? 1 : 0);
+      next[axis] =
+          tmin + (lower[axis] + boundary * CELL_SIZE - p[axis]) / d[axis];
+      delta[axis] = CELL_SIZE / std::abs(d[axis]);
+      step[axis] = d[axis] > 0 ? 1 : -1;
+    }
+
+    float t = tmin;
+    while (true) {
+      int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                                   : (next[1] < next[2] ? 1 : 2);
+      float t1 = std::min(next[axis], tmax);
+      int index = cell[0] + resolution[0] * (cell[1] + resolution[1] * cell[2]);
+      if (t1 > t && !func(t, t1, values[index], minimums[index])) return;
+      if (t1 >= tmax) return;
+      t = t1;
+      cell[axis] += step[axis];
+      if (cell[axis] < 0 || cell[axis] >= resolution[axis]) return;
+      next[axis] += delta[axis];
+    }
+  }
+
+ private:
+  Point3f lower;
+  int resolution[3] = {0, 0, 0};
+  MappedArray<float> values, minimums;
+};
+
+//*   Read-only copy of a density grid flattened for rendering. The voxels are
+//* kept in BRICK_SIZE^3 bricks (the size of the VDB leaves) stored one after
+//* another in a single pool, and a dense table over the bounding box maps each
+//* brick coordinate to its offset in the pool, or -1 for the background. A
+//* lookup is one table read and one pool read, without any tree walk. Both
+//* arrays hold plain offsets, so they are used in place from a snapshot
+class BrickVolume {
+ public:
+  static constexpr int BRICK_LOG2 = 3, BRICK_SIZE = 1 << BRICK_LOG2,
+                       BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+  BrickVolume() = default;
+
+  BrickVolume(const openvdb::FloatGrid &grid);
+
+  void write(SnapshotWriter &out) const;
+
+  //* The bricks stay in the mapping, false if the snapshot is invalid
+  bool read(SnapshotReader &in);
+
+  //* The voxel at integer index coordinates
+  float at(int x, int y, int z) const {
+    x -= lower[0];
+    y -= lower[1];
+    z -= lower[2];
+    int bx = x >> BRICK_LOG2, by = y >> BRICK_LOG2, bz = z >> BRICK_LOG2;
+    //* The negative coordinates wrap to large unsigned ones
+    if ((unsigned)bx >= (unsigned)n_bricks[0] ||
+        (unsigned)by >= (unsigned)n_bricks[1] ||
+        (unsigned)bz >= (unsigned)n_bricks[2])
+      return background;
+    int brick = table[bx + n_bricks[0] * (by + n_bricks[1] * bz)];
+    if (brick < 0) return background;
+    //* The voxels of a brick are in the order of the VDB leaves, z fastest
+    constexpr int mask = BRICK_SIZE - 1;
+    return pool[brick + (((x & mask) << BRICK_LOG2 | (y & mask))
+                         << BRICK_LOG2 |
+                         (z & mask))];
+  }
+
+  //* The voxel nearest to p in the index space, the centers are on integers
+  float nearest(Point3f p) const {
+    return at(int(std::floor(p.x + .5f)), int(std::floor(p.y + .5f)),
+              int(std::floor(p.z + .5f)));
+  }
+
+  //* Trilinear interpolation between the 8 voxels around p
+  float trilinear(Point3f p) const {
+    float fx = std::floor(p.x), fy = std::floor(p.y), fz = std::floor(p.z);
+    int x = int(fx), y = int(fy), z = int(fz);
+    float dx = p.x - fx, dy = p.y - fy, dz = p.z - fz;
+    auto lerp = [](float t, float a, float b) { return a + t * (b - a); };
+    return lerp(
+        dz,
+        lerp(dy, lerp(dx, at(x, y, z), at(x + 1, y, z)),
+             lerp(dx, at(x, y + 1, z), at(x + 1, y + 1, z))),
+        lerp(dy, lerp(dx, at(x, y, z + 1), at(x + 1, y, z + 1)),
+             lerp(dx, at(x, y + 1, z + 1), at(x + 1, y + 1, z + 1))));
+  }
+
+ private:
+  //* The first voxel of the first brick, aligned to BRICK_SIZE
+  int lower[3] = {0, 0, 0};
+  int n_bricks[3] = {0, 0, 0};
+  float background = .0f;
+  //* Offset of each brick in the pool
+  MappedArray<int> table;
+  MappedArray<float> pool;
+};
 
 class Hetergeneous : public Medium {
  public:
@@ -13,7 +166,17 @@ class Hetergeneous : public Medium {
     // mPhase = std::make_shared<IsotropicPhase>();
   }
 
-  Hetergeneous(openvdb::FloatGrid::Ptr _density, float scale);
+  //* With trilinear, the density is interpolated between the voxels instead
+  //* of taken from the nearest one
+  Hetergeneous(openvdb::FloatGrid::Ptr _density, float scale,
+               bool _trilinear = false);
+
+  //* The flattened density, its transform and majorants
+  void write(SnapshotWriter &out) const;
+
+  //* Nullptr if the snapshot is invalid
+  static std::shared_ptr<Hetergeneous> read(SnapshotReader &in,
+                                            bool trilinear);
 
   virtual SpectrumRGB evaluateTr(Point3f start, Point3f end) const override;
 
@@ -33,10 +196,26 @@ class Hetergeneous : public Medium {
   virtual SpectrumRGB sigmaS(Point3f) const override;
 
  protected:
-  openvdb::FloatGrid::Ptr density;
+  //* Maps the world space to the index space of the volume
+  openvdb::math::Transform::Ptr transform;
+
+  BrickVolume volume;
 
   SpectrumRGB sigmaTMax{.0f};
 
+  MajorantGrid majorants;
+
+  //* The ray in the index space of the density grid, where t still measures
+  //* the world distance
+  std::pair<Point3f, Vector3f> toIndexSpace(Point3f o, Vector3f d) const;
+
+  //* The density at p in the index space
+  float lookup(Point3f p) const {
+    return trilinear ? volume.trilinear(p) : volume.nearest(p);
+  }
+
+  bool trilinear = false;
+
   float scale;
 
   float step = 0.1;  // delete
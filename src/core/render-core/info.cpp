@@ -28,9 +28,20 @@ Ray3f SurfaceIntersectionInfo::scatterRay(const Scene &scene,
   bool outwards = dot(ray.dir, geometryNormal) > 0;
   auto medium = outwards ? scene.getEnvMedium() : shape->getInsideMedium();
   ray.medium = medium ? medium.get() : nullptr;
+  //* Across the footprint the normal turns by curvature x width, which
+  //* spreads the reflected directions twice as much
+  ray.cone = RayCone{cone.width, cone.spread + 2 * curvature * cone.width};
   return ray;
 }
 
+const MaterialClosure &SurfaceIntersectionInfo::getClosure() const {
+  if (!closureResolved) {
+    closure = shape ? shape->getBSDF()->resolve(*this) : MaterialClosure{};
+    closureResolved = true;
+  }
+  return closure;
+}
+
 SpectrumRGB SurfaceIntersectionInfo::evaluateScatter(Vector3f wo) const {
   assert(shape);
   return shape->getBSDF()->evaluate(*this, wo);
@@ -68,49 +79,66 @@ void SurfaceIntersectionInfo::computeShadingFrame() {
     this->shape->getBSDF()->computeShadingFrame(this);
 }
 
-void SurfaceIntersectionInfo::computeDifferential(const Ray3f &ray) {
-  if (!ray.is_ray_differential)
-    return;
-  //* Compute dudx, dudy, dvdx and dvdy
-  float d = dot(geometryNormal, Vector3f{position.x, position.y, position.z});
-  float tx = -(dot(geometryNormal, Vector3f{ray.ori.x, ray.ori.y, ray.ori.z}) -
-               d) /
-             dot(geometryNormal, ray.direction_dx),
-        ty = -(dot(geometryNormal, Vector3f{ray.ori.x, ray.ori.y, ray.ori.z}) -
-               d) /
-             dot(geometryNormal, ray.direction_dy);
-
-  if (std::isinf(tx) || std::isnan(tx) || std::isinf(ty) || std::isnan(ty)) {
-    std::cout << "NaN or inf in computeDifferential\n";
-    std::exit(1);
-  }
-
-  Point3f px = ray.at(tx), py = ray.at(ty);
-
-  Vector3f dpdx = px - position, dpdy = py - position;
-
+//* The uv offset of the offset dp in the tangent plane, false if the uv
+//* parameterization is degenerate
+static bool uvOffset(const SurfaceIntersectionInfo &info, Vector3f dp,
+                     float *du, float *dv) {
+  //* Solve dp = dpdu du + dpdv dv in the two axes the normal is the least
+  //* aligned with
+  Normal3f n = info.geometryNormal;
   int dim[2];
-  if (std::abs(geometryNormal.x) > std::abs(geometryNormal.y) &&
-      std::abs(geometryNormal.x) > std::abs(geometryNormal.z)) {
+  if (std::abs(n.x) > std::abs(n.y) && std::abs(n.x) > std::abs(n.z)) {
     dim[0] = 1;
     dim[1] = 2;
-  } else if (std::abs(geometryNormal.y) > std::abs(geometryNormal.z)) {
+  } else if (std::abs(n.y) > std::abs(n.z)) {
     dim[0] = 0;
     dim[1] = 2;
   } else {
     dim[0] = 0;
     dim[1] = 1;
   }
-  // Initialize _A_, _Bx_, and _By_ matrices for offset computation
-  float A[2][2] = {{dpdu[dim[0]], dpdv[dim[0]]}, {dpdu[dim[1]], dpdv[dim[1]]}};
-  float Bx[2] = {px[dim[0]] - position[dim[0]], px[dim[1]] - position[dim[1]]};
-  float By[2] = {py[dim[0]] - position[dim[0]], py[dim[1]] - position[dim[1]]};
-  if (!solveLinearSys2X2(A, Bx, &dudx, &dvdx)) {
-    dudx = dvdx = 0;
-  }
-  if (!solveLinearSys2X2(A, By, &dudy, &dvdy)) {
-    dudy = dvdy = 0;
+  float A[2][2] = {{info.dpdu[dim[0]], info.dpdv[dim[0]]},
+                   {info.dpdu[dim[1]], info.dpdv[dim[1]]}};
+  float B[2] = {dp[dim[0]], dp[dim[1]]};
+  if (!solveLinearSys2X2(A, B, du, dv) || !std::isfinite(*du) ||
+      !std::isfinite(*dv)) {
+    *du = *dv = 0;
+    return false;
   }
+  return true;
+}
+
+void SurfaceIntersectionInfo::computeDifferential(const Ray3f &ray) {
+  //* The info is reused along the path, clear the last footprint
+  dudx = dudy = dvdx = dvdy = 0;
+  cone = RayCone{ray.cone.widthAt(distance), ray.cone.spread};
+  curvature = 0;
+  if (!shape)
+    return;
+  //* The curvature as seen by the ray, a convex surface hit from the inside
+  //* focuses the cone
+  Vector3f n = geometryNormal;
+  float cosTheta = dot(n, ray.dir);
+  curvature = shape->curvature(primID) * (cosTheta > 0 ? -1 : 1);
+
+  float width = std::abs(cone.width);
+  if (width == 0)
+    return;
+  //*   The footprint is the ellipse the cone cuts from the tangent plane, the
+  //* minor axis is across the ray and the major one is stretched by the
+  //* obliquity. The grazing hits are bounded, the texture filters clamp the
+  //* anisotropy anyway
+  Vector3f major = ray.dir - n * cosTheta;
+  //* Any tangent is an axis of the circle of a head-on hit
+  if (major.length2() < 1e-8f)
+    major = cross(n, std::abs(n.x) > .9f ? Vector3f{0, 1, 0}
+                                         : Vector3f{1, 0, 0});
+  major = normalize(major);
+  Vector3f minor = cross(n, major);
+  major *= width / std::max(std::abs(cosTheta), 1e-2f);
+  minor *= width;
+  uvOffset(*this, major, &dudx, &dvdx);
+  uvOffset(*this, minor, &dudy, &dvdy);
 }
 
 //* MediumIntersectionInfo
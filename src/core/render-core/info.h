@@ -75,13 +75,26 @@ struct SurfaceIntersectionInfo : public IntersectionInfo {
   std::shared_ptr<Emitter> light;
   //* Geometry normal of the hitpoint
   Normal3f geometryNormal;
+  //* The primitive (triangle) of the hitpoint
+  int primID = -1;
   //* The uv coordinate of the hitpoint
   Point2f uv;
   //* position differentials
   Vector3f dpdu;
   Vector3f dpdv;
-  //* uv differentials
-  float dudx, dudy, dvdx, dvdy;
+  //*   uv differentials over the footprint of the ray cone, x along its
+  //* major axis and y along its minor one. Zero without a footprint
+  float dudx = 0, dudy = 0, dvdx = 0, dvdy = 0;
+  //* The ray cone at the hitpoint and the curvature widening it on scatter
+  RayCone cone;
+  float curvature = 0;
+  //*   The textured parameters of the BSDF at the hitpoint, resolved by the
+  //* first query of the BSDF. The hits only tested for visibility or never
+  //* shaded don't look up the textures
+  mutable MaterialClosure closure;
+  mutable bool closureResolved = false;
+
+  const MaterialClosure &getClosure() const;
 
   virtual Ray3f scatterRay(const Scene &scene,
                            Point3f destination) const override;
@@ -158,11 +171,16 @@ struct LightSourceInfo {
   Point3f position;
   //* Optional, normal at the lumin point
   Normal3f normal;
+  //* Optional, the primitive where the lumin point lies on
+  int primID = -1;
   //* Direction, from path vertex to luminous point
   Vector3f direction;
   //* The pdf of the sampling result
   //* If pdf == inf, it represents sampling a Dirac delta distribution
   float pdf;
+  //* The probability of choosing the light source, kept apart for the delta
+  //* lights whose pdf is inf
+  float pdfChoice = 1;
   //* Le
   SpectrumRGB Le;
 };
@@ -4,6 +4,7 @@
 #include "bsdf.h"
 #include "bssrdf.h"
 #include "camera.h"
+#include "core/math/math.h"
 #include "core/scene/scene.h"
 #include "core/utils/configurable.h"
 #include "emitter.h"
@@ -38,6 +39,8 @@ public:
   virtual void render(std::shared_ptr<RenderTask> task) const = 0;
 };
 
+class Film;
+
 class PixelIntegrator : public Integrator {
 public:
   PixelIntegrator() = default;
@@ -46,6 +49,13 @@ public:
   virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
                             Sampler *sampler) const override = 0;
   virtual void render(std::shared_ptr<RenderTask> task) const override final;
+
+protected:
+  //* Called before the final pass, e.g. for the training passes
+  virtual void preprocess(std::shared_ptr<RenderTask> task) const {}
+
+  //* Render spp samples for each pixel into the film
+  void renderPass(std::shared_ptr<RenderTask> task, Film &film, int spp) const;
 };
 
 //* structs used for bidir methods
@@ -67,17 +77,23 @@ struct PathVertex {
    *
    */
   SpectrumRGB beta;
-  VertexType type;
+  VertexType type = VertexType::SurfaceVertex;
   //* Declare the sampling properties of current node
   bool delta = false;
   float pdf_fwd = 0, pdf_rev = 0;
+  //* Cached sum of the MIS ratios of the strategies ending at this vertex,
+  //* filled once the whole subpath is generated
+  float mis_sum = 0;
   //* Used to compute the pdf for connection
-  std::shared_ptr<IntersectionInfo> info = nullptr;
-  std::shared_ptr<Camera> camera = nullptr;
-  std::shared_ptr<Emitter> light = nullptr;
+  //* Non-owning, the surface info lives in the path buffer of the integrator
+  const SurfaceIntersectionInfo *info = nullptr;
+  const Camera *camera = nullptr;
+  const Emitter *light = nullptr;
   //* Vertex geometry property
   Vector3f normal; //! All non-surface vertex should init this to zero
   Point3f position;
+  //* The primitive where the vertex lies on, for the surface and light vertex
+  int primID = -1;
 
   PathVertex() = default;
 
@@ -88,6 +104,11 @@ struct PathVertex {
   // TODO fixme
   bool is_inf_light() const { return false; }
 
+  //* Return whether the vertex is on a light with delta position
+  bool is_delta_light() const {
+    return type == VertexType::LightVertex && light && light->shape.expired();
+  }
+
   //* This function turn a pdf in solid-angle measure to unit area measure
   float convert_pdf(float pdf_solid_angle, const PathVertex &next) const {
     Vector3f w = next.position - position;
@@ -143,7 +164,8 @@ struct PathVertex {
       std::cout << "No implementation for bdpt inf light\n";
       std::exit(1);
     } else {
-      float pdf_dir = std::abs(dot(normal, w));
+      //* Area lights emit with a cosine weighted direction
+      float pdf_dir = std::abs(dot(normal, w)) * INV_PI;
       pdf = pdf_dir * inv_dist2;
     }
     if (vertex->on_surface())
@@ -162,8 +184,13 @@ struct PathVertex {
       std::exit(1);
     } else {
       auto shape_ptr = light->shape.lock();
-      float pdf_choice = scene.pdfEmitter(light);
-      return pdf_choice / shape_ptr->getSurfaceArea();
+      //* The origin is chosen with respect to prev (next event estimation)
+      float pdf_choice = scene.pdfEmitter(light, prev->position, prev->normal);
+      //* Point emitters have a delta position
+      if (!shape_ptr)
+        return pdf_choice;
+      return pdf_choice * shape_ptr->pdfOnSurface(primID, position, normal,
+                                                  prev->position);
     }
   }
 
@@ -174,26 +201,30 @@ struct PathVertex {
     res.pdf_fwd = info.pdf;
     res.position = info.position;
     res.normal = info.normal;
-    res.light = info.light;
+    res.light = info.light.get();
+    res.primID = info.primID;
     return res;
   }
 
-  static PathVertex create_surface(std::shared_ptr<IntersectionInfo> info,
+  static PathVertex create_surface(const SurfaceIntersectionInfo *info,
                                    SpectrumRGB beta, float pdf_fwd,
                                    const PathVertex &prev) {
     PathVertex res;
     res.type = VertexType::SurfaceVertex;
     res.info = info;
+    res.light = info->light.get();
     res.beta = beta;
     res.position = info->position;
-    res.normal = ((SurfaceIntersectionInfo *)info.get())->geometryNormal;
+    res.normal = info->geometryNormal;
+    res.primID = info->primID;
     res.pdf_fwd = prev.convert_pdf(pdf_fwd, res);
     return res;
   }
 
-  static PathVertex create_camera(std::shared_ptr<Camera> camera,
-                                  const Ray3f &ray, SpectrumRGB beta) {
+  static PathVertex create_camera(const Camera *camera, const Ray3f &ray,
+                                  SpectrumRGB beta) {
     PathVertex result;
+    result.type = VertexType::CameraVertex;
     result.camera = camera;
     result.beta = beta;
     result.normal = Vector3f(0);
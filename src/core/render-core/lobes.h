@@ -0,0 +1,74 @@
+#pragma once
+#include <core/math/common.h>
+#include <core/math/math.h>
+#include <core/math/warp.h>
+#include <core/render-core/info.h>
+
+//*   The closed form lobes of the common BSDFs, over the parameters resolved
+//* in the closure of a hitpoint. The BSDF classes forward their virtual
+//* methods to them, and with XLIGHT_STATIC_DISPATCH the queries of a hitpoint
+//* switch over the lobe of its closure and call them inline instead
+
+struct LambertianLobe {
+  static SpectrumRGB evaluate(SpectrumRGB albedo, const BSDFQueryRecord &bRec) {
+    if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
+      return SpectrumRGB{.0f};
+    return albedo * INV_PI * std::abs(Frame::cosTheta(bRec.wo));
+  }
+
+  static float pdf(const BSDFQueryRecord &bRec) {
+    if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
+      return .0f;
+    return INV_PI * std::abs(Frame::cosTheta(bRec.wo));
+  }
+
+  static SpectrumRGB sample(SpectrumRGB albedo, BSDFQueryRecord &bRec,
+                            const Point2f &sample, float &pdf,
+                            ScatterSampleType *type) {
+    if (Frame::cosTheta(bRec.wi) <= 0) {
+      pdf = .0f;
+      return SpectrumRGB{.0f};
+    }
+    bRec.wo = Warp::squareToCosineHemisphere(sample);
+    pdf = INV_PI * std::abs(Frame::cosTheta(bRec.wo));
+    *type = ScatterSampleType::SurfaceReflection;
+    return albedo;
+  }
+};
+
+struct MirrorLobe {
+  static SpectrumRGB sample(BSDFQueryRecord &bRec, float &pdf,
+                            ScatterSampleType *type) {
+    *type = ScatterSampleType::SurfaceReflection;
+    bRec.wo = reflect(bRec.wi);
+    pdf = FINF;
+    bRec.isDelta = true;
+    return SpectrumRGB{1.f};
+  }
+};
+
+struct DielectricLobe {
+  //* eta is the relative index of refraction, interior over exterior
+  static SpectrumRGB sample(float eta, BSDFQueryRecord &bRec,
+                            const Point2f &sample, float &pdf,
+                            ScatterSampleType *type) {
+    float cosThetaT;
+    float F = Fresnel(Frame::cosTheta(bRec.wi), eta, &cosThetaT);
+    pdf = FINF;
+    if (sample.x <= F) {
+      bRec.wo = reflect(bRec.wi);
+      *type = ScatterSampleType::SurfaceReflection;
+      // TODO replace with specular reflectance
+      return SpectrumRGB{1.f};
+    }
+    bRec.wo = refract(bRec.wi, eta, cosThetaT);
+    *type = ScatterSampleType::SurfaceTransmission;
+    // TODO consider the transmittance and factor
+    return SpectrumRGB{1};
+  }
+
+  static Vector3f refract(const Vector3f &wi, float eta, float cosThetaT) {
+    float scale = -((cosThetaT < 0) ? (1 / eta) : eta);
+    return Vector3f{wi.x * scale, cosThetaT, wi.z * scale};
+  }
+};
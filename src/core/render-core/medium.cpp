@@ -2,25 +2,35 @@
 
 #include <core/render-core/info.h>
 
+//*   The light projects to the foot at distance a before the ray origin (a is
+//* negative when the foot is ahead), at distance D from the ray. The segment
+//* spans the angles [thetaA, thetaB] seen from the light
+struct EquiAngularFrame {
+  double a, D, thetaA, thetaB;
+};
+
+static EquiAngularFrame equiAngularFrame(Ray3f ray, float tBounds,
+                                         Point3f lightPosition) {
+  Vector3f ori2light = lightPosition - ray.ori;
+  double a = -dot(ori2light, ray.dir) / ray.dir.length(), b = tBounds + a,
+         D = std::sqrt(std::max(.0, ori2light.length2() - a * a));
+  return {a, D, std::atan(a / D), std::atan(b / D)};
+}
+
 std::shared_ptr<MediumIntersectionInfo> Medium::sampleIntersectionEquiAngular(
     Ray3f ray, float tBounds, Point2f sample,
     const LightSourceInfo &info) const {
   if (info.lightType == LightSourceInfo::LightType::Area ||
       info.lightType == LightSourceInfo::LightType::Spot) {
     //* Only these two situations do equi-angular sampling
-    Vector3f ori2light = info.position - ray.ori;
-    double a = -dot(ori2light, ray.dir) / ray.dir.length(), b = tBounds + a,
-           D = std::sqrt(std::max(.0, ori2light.length2() - a * a));
-
-    double thetaA = std::atan(a / D), thetaB = std::atan(b / D);
+    auto [a, D, thetaA, thetaB] = equiAngularFrame(ray, tBounds, info.position);
+    if (D <= 0) return nullptr;
 
     auto [x, y] = sample;
     float sample_t = D * std::tan((1 - x) * thetaA + x * thetaB),
           pdf_t = D / (thetaB - thetaA) / (D * D + sample_t * sample_t);
 
-    sample_t -= a;
-
-    if (sample_t > tBounds) return nullptr;
+    sample_t = std::clamp(float(sample_t - a), .0f, tBounds);
 
     auto res = std::make_shared<MediumIntersectionInfo>();
     res->medium = this;
@@ -36,4 +46,12 @@ std::shared_ptr<MediumIntersectionInfo> Medium::sampleIntersectionEquiAngular(
     //* Just sample propotional to tr
     return sampleIntersectionDeterministic(ray, tBounds, sample);
   }
+}
+
+float Medium::pdfEquiAngular(Ray3f ray, float tBounds, float t,
+                             Point3f lightPosition) {
+  auto [a, D, thetaA, thetaB] = equiAngularFrame(ray, tBounds, lightPosition);
+  if (D <= 0) return 0;
+  double s = t + a;
+  return D / (thetaB - thetaA) / (D * D + s * s);
 }
\ No newline at end of file
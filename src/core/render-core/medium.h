@@ -29,6 +29,12 @@ struct MediumSampleRecord {
 
 class Medium : public Configurable {
  public:
+  //*   The estimators of the transmittance through a medium without a closed
+  //* form. Delta tracking returns 0 or 1, ratio tracking weights each
+  //* tentative collision by the probability of it being null, and residual
+  //* ratio tracking does the same on top of a homogeneous control density
+  enum class TrEstimator { Delta, Ratio, ResidualRatio };
+
   Medium() = default;
   Medium(const rapidjson::Value &_value) {}
   virtual ~Medium() = default;
@@ -53,6 +59,9 @@ class Medium : public Configurable {
 
   void setPhase(std::shared_ptr<PhaseFunction> phase) { this->mPhase = phase; }
 
+  //* Ignored by the media with an analytic transmittance
+  void setTrEstimator(TrEstimator estimator) { this->mTrEstimator = estimator; }
+
   virtual std::shared_ptr<MediumIntersectionInfo> sampleIntersection(
       Ray3f ray, float tBounds, Point2f sample) const = 0;
 
@@ -60,12 +69,25 @@ class Medium : public Configurable {
   sampleIntersectionDeterministic(Ray3f ray, float tBounds,
                                   Point2f sample) const = 0;
 
+  //*   The pdf of sampleIntersection scattering at distance t from the start
+  //* of the flight. Negative for the media sampled by tracking, which have no
+  //* closed form
+  virtual float pdfDistance(float t) const { return -1; }
+
+  //*   Sample a scattering distance in [0, tBounds) proportional to the inverse
+  //* squared distance to the light point, nullptr if the light lies on the ray
   std::shared_ptr<MediumIntersectionInfo> sampleIntersectionEquiAngular(
       Ray3f ray, float tBounds, Point2f sample,
       const LightSourceInfo &info) const;
 
+  //* The pdf of sampleIntersectionEquiAngular choosing distance t
+  static float pdfEquiAngular(Ray3f ray, float tBounds, float t,
+                              Point3f lightPosition);
+
  protected:
   std::shared_ptr<PhaseFunction> mPhase;
+
+  TrEstimator mTrEstimator = TrEstimator::Ratio;
 };
 
 struct MediumIntersection {
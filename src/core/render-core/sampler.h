@@ -30,6 +30,9 @@ class Sampler : public Configurable {
   virtual Point2f next2D() = 0;
   virtual Point3f next3D() = 0;
   virtual void nextSample() = 0;
+  //* Switch to another stream of dimensions, so that each part of a sample
+  //* always reads the same dimensions. Ignored by the pixel samplers
+  virtual void startStream(int index){};
 
   CameraSample getCameraSample() {
     CameraSample sample;
@@ -41,10 +44,13 @@ class Sampler : public Configurable {
 
   virtual std::shared_ptr<Sampler> clone() const { return nullptr; }
 
+  //* Each thread draws from its own generator, a shared one is a data race
+  //* on the free flights of the media
   static float sample1D() {
-    static std::uniform_real_distribution<> s_dist(0, 1.f);
-    static pcg_extras::seed_seq_from<std::random_device> s_seed_source;
-    static pcg32 s_rng(s_seed_source);
+    static thread_local std::uniform_real_distribution<> s_dist(0, 1.f);
+    static thread_local pcg_extras::seed_seq_from<std::random_device>
+        s_seed_source;
+    static thread_local pcg32 s_rng(s_seed_source);
 
     return s_dist(s_rng);
   }
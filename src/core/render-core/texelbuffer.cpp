@@ -0,0 +1,208 @@
+#include "texelbuffer.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+
+//* Decode tables of the 8 bits formats
+static const std::array<float, 256> &unormTable() {
+  static const std::array<float, 256> table = [] {
+    std::array<float, 256> t;
+    for (int i = 0; i < 256; ++i) t[i] = i / 255.f;
+    return t;
+  }();
+  return table;
+}
+
+static const std::array<float, 256> &srgbTable() {
+  static const std::array<float, 256> table = [] {
+    std::array<float, 256> t;
+    for (int i = 0; i < 256; ++i) {
+      float c = i / 255.f;
+      t[i] = c <= .04045f ? c / 12.92f : std::pow((c + .055f) / 1.055f, 2.4f);
+    }
+    return t;
+  }();
+  return table;
+}
+
+static uint8_t encodeUNorm(float v) {
+  return uint8_t(std::clamp(v, .0f, 1.f) * 255.f + .5f);
+}
+
+static uint8_t encodeSRGB(float v) {
+  v = std::clamp(v, .0f, 1.f);
+  v = v <= .0031308f ? v * 12.92f : 1.055f * std::pow(v, 1 / 2.4f) - .055f;
+  return uint8_t(v * 255.f + .5f);
+}
+
+uint16_t floatToHalf(float f) {
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  uint16_t sign = (x >> 16) & 0x8000;
+  uint32_t mantissa = x & 0x7fffff;
+  int exponent = int((x >> 23) & 0xff);
+  //* Inf and nan
+  if (exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  exponent += 15 - 127;
+  if (exponent >= 31) return sign | 0x7c00;
+  if (exponent <= 0) {
+    //* Subnormal, or flushed to zero
+    if (exponent < -10) return sign;
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    if ((mantissa >> (shift - 1)) & 1) ++half;
+    return sign | half;
+  }
+  //* The carry of the rounding goes into the exponent
+  uint32_t half = (exponent << 10) | (mantissa >> 13);
+  if (mantissa & 0x1000) ++half;
+  return sign | half;
+}
+
+float halfToFloat(uint16_t h) {
+  uint32_t sign = uint32_t(h & 0x8000) << 16, mantissa = h & 0x3ff;
+  int exponent = (h >> 10) & 0x1f;
+  uint32_t x;
+  if (exponent == 31) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent == 0) {
+    if (mantissa == 0) {
+      x = sign;
+    } else {
+      //* Normalize the subnormal
+      exponent = 1;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        --exponent;
+      }
+      x = sign | uint32_t(exponent + 127 - 15) << 23 | (mantissa & 0x3ff) << 13;
+    }
+  } else {
+    x = sign | uint32_t(exponent + 127 - 15) << 23 | mantissa << 13;
+  }
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+TileLayout::TileLayout(int _width, int _height)
+    : width(_width), height(_height) {
+  while (tileLog2 < 5 && (1 << tileLog2) < std::max(width, height))
+    ++tileLog2;
+  int tile = 1 << tileLog2;
+  tilesX = (width + tile - 1) >> tileLog2;
+  tilesY = (height + tile - 1) >> tileLog2;
+}
+
+int texelBytes(TexelFormat format) {
+  switch (format) {
+    case TexelFormat::UNorm8:
+    case TexelFormat::SRGB8:
+      return 3;
+    case TexelFormat::Half:
+      return 3 * sizeof(uint16_t);
+    case TexelFormat::Float:
+    default:
+      return 3 * sizeof(float);
+  }
+}
+
+SpectrumRGB decodeTexel(TexelFormat format, const uint8_t *src) {
+  switch (format) {
+    case TexelFormat::UNorm8: {
+      const auto &table = unormTable();
+      return SpectrumRGB{table[src[0]], table[src[1]], table[src[2]]};
+    }
+    case TexelFormat::SRGB8: {
+      const auto &table = srgbTable();
+      return SpectrumRGB{table[src[0]], table[src[1]], table[src[2]]};
+    }
+    case TexelFormat::Half: {
+      uint16_t half[3];
+      std::memcpy(half, src, sizeof(half));
+      return SpectrumRGB{halfToFloat(half[0]), halfToFloat(half[1]),
+                         halfToFloat(half[2])};
+    }
+    case TexelFormat::Float:
+    default: {
+      float value[3];
+      std::memcpy(value, src, sizeof(value));
+      return SpectrumRGB{value[0], value[1], value[2]};
+    }
+  }
+}
+
+void TexelBuffer::allocate(int width, int height, TexelFormat format) {
+  mLayout = TileLayout(width, height);
+  mFormat = format;
+  mTexelBytes = texelBytes(format);
+  size_t texels = (size_t)mLayout.tileCount() * mLayout.tileTexels();
+  mData.assign(texels * mTexelBytes, 0);
+}
+
+TexelBuffer::TexelBuffer(int width, int height, TexelFormat format,
+                         const float *rgb) {
+  allocate(width, height, format);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x) {
+      const float *src = rgb + 3 * ((size_t)y * width + x);
+      uint8_t *dst = &mData[index(x, y) * mTexelBytes];
+      for (int c = 0; c < 3; ++c) {
+        switch (format) {
+          case TexelFormat::UNorm8:
+            dst[c] = encodeUNorm(src[c]);
+            break;
+          case TexelFormat::SRGB8:
+            dst[c] = encodeSRGB(src[c]);
+            break;
+          case TexelFormat::Half: {
+            uint16_t half = floatToHalf(src[c]);
+            std::memcpy(dst + c * sizeof(half), &half, sizeof(half));
+            break;
+          }
+          case TexelFormat::Float:
+            std::memcpy(dst + c * sizeof(float), src + c, sizeof(float));
+            break;
+        }
+      }
+    }
+}
+
+TexelBuffer::TexelBuffer(int width, int height, TexelFormat format,
+                         const unsigned char *rgb) {
+  if (format != TexelFormat::UNorm8 && format != TexelFormat::SRGB8) {
+    //* Decode as the unsigned normalized values first
+    std::vector<float> values((size_t)width * height * 3);
+    for (size_t i = 0; i < values.size(); ++i) values[i] = rgb[i] / 255.f;
+    *this = TexelBuffer(width, height, format, values.data());
+    return;
+  }
+  allocate(width, height, format);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      std::memcpy(&mData[index(x, y) * mTexelBytes],
+                  rgb + 3 * ((size_t)y * width + x), 3);
+}
+
+TexelBuffer::TexelBuffer(int width, int height, TexelFormat format,
+                         std::vector<uint8_t> &&data) {
+  mLayout = TileLayout(width, height);
+  mFormat = format;
+  mTexelBytes = texelBytes(format);
+  mData = std::move(data);
+}
+
+SpectrumRGB TexelBuffer::average() const {
+  if (width() == 0 || height() == 0) return SpectrumRGB{.0f};
+  double sum[3] = {0, 0, 0};
+  for (int y = 0; y < height(); ++y)
+    for (int x = 0; x < width(); ++x) {
+      SpectrumRGB value = texel(x, y);
+      for (int c = 0; c < 3; ++c) sum[c] += value[c];
+    }
+  double n = (double)width() * height();
+  return SpectrumRGB{float(sum[0] / n), float(sum[1] / n), float(sum[2] / n)};
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "core/geometry/geometry.h"
+#include "spectrum.h"
+
+//* The storage formats of the texels, all with 3 channels
+enum class TexelFormat {
+  //* 8 bits per channel, value / 255
+  UNorm8,
+  //* 8 bits per channel, sRGB encoded
+  SRGB8,
+  //* 16 bits half float per channel
+  Half,
+  //* 32 bits float per channel
+  Float
+};
+
+//* IEEE 754 half precision, rounded to the nearest
+uint16_t floatToHalf(float f);
+
+float halfToFloat(uint16_t h);
+
+//*   The tiling of an image. The image is cut into square tiles stored one
+//* after another, and the texels inside a tile are in Morton order, so the
+//* 2x2 footprint of a bilinear lookup is nearly always in the same few cache
+//* lines. The tiles are 32 x 32 texels, smaller for the smaller images
+struct TileLayout {
+  int width = 0, height = 0;
+  int tileLog2 = 0, tilesX = 0, tilesY = 0;
+
+  TileLayout() = default;
+
+  TileLayout(int _width, int _height);
+
+  int tileCount() const { return tilesX * tilesY; }
+
+  int tileTexels() const { return 1 << (2 * tileLog2); }
+
+  int tile(int x, int y) const {
+    return (y >> tileLog2) * tilesX + (x >> tileLog2);
+  }
+
+  int texelInTile(int x, int y) const {
+    int mask = (1 << tileLog2) - 1;
+    return morton(x & mask, y & mask);
+  }
+
+  //* Interleave the bits of x and y, x in the even bits
+  static uint32_t morton(uint32_t x, uint32_t y) {
+    auto spread = [](uint32_t v) {
+      v = (v | (v << 8)) & 0x00ff00ff;
+      v = (v | (v << 4)) & 0x0f0f0f0f;
+      v = (v | (v << 2)) & 0x33333333;
+      v = (v | (v << 1)) & 0x55555555;
+      return v;
+    };
+    return spread(x) | (spread(y) << 1);
+  }
+};
+
+//* The bytes of a texel in the format
+int texelBytes(TexelFormat format);
+
+//* The linear RGB of the texel stored at src
+SpectrumRGB decodeTexel(TexelFormat format, const uint8_t *src);
+
+//*   The filtered lookups, texel(x, y) returns the texel with (0, 0) the top
+//* left one. The uv out of [0, 1] are clamped
+template <typename Fetch>
+SpectrumRGB nearestLookup(int width, int height, Point2f uv, Fetch &&texel) {
+  int x = std::min(static_cast<int>(std::abs(uv.x) * width), width - 1);
+  int y = std::min(static_cast<int>(std::abs(uv.y) * height), height - 1);
+  return texel(x, y);
+}
+
+//* Bilinear interpolation between the 4 texel centers around uv
+template <typename Fetch>
+SpectrumRGB bilinearLookup(int width, int height, Point2f uv, Fetch &&texel) {
+  float u = std::abs(uv.x) * width - .5f, v = std::abs(uv.y) * height - .5f;
+  float fu = std::floor(u), fv = std::floor(v);
+  float du = u - fu, dv = v - fv;
+  int x0 = std::clamp(int(fu), 0, width - 1),
+      x1 = std::clamp(int(fu) + 1, 0, width - 1),
+      y0 = std::clamp(int(fv), 0, height - 1),
+      y1 = std::clamp(int(fv) + 1, 0, height - 1);
+  return (texel(x0, y0) * (1 - du) + texel(x1, y0) * du) * (1 - dv) +
+         (texel(x0, y1) * (1 - du) + texel(x1, y1) * du) * dv;
+}
+
+//*   Contiguous texel storage of an image in the order of its TileLayout.
+//* The texels are decoded to linear RGB on lookup
+class TexelBuffer {
+ public:
+  TexelBuffer() = default;
+
+  //* rgb holds width * height * 3 floats by rows, from the top left texel
+  TexelBuffer(int width, int height, TexelFormat format, const float *rgb);
+
+  //* rgb holds width * height * 3 bytes by rows, format is UNorm8 or SRGB8
+  TexelBuffer(int width, int height, TexelFormat format,
+              const unsigned char *rgb);
+
+  //* Take the texels already in the tile order
+  TexelBuffer(int width, int height, TexelFormat format,
+              std::vector<uint8_t> &&data);
+
+  //* The linear RGB of the texel, with (0, 0) the top left one
+  SpectrumRGB texel(int x, int y) const {
+    return decodeTexel(mFormat, &mData[index(x, y) * mTexelBytes]);
+  }
+
+  //* The texel covering uv, the uv out of [0, 1] are clamped
+  SpectrumRGB nearest(Point2f uv) const {
+    return nearestLookup(mLayout.width, mLayout.height, uv,
+                         [this](int x, int y) { return texel(x, y); });
+  }
+
+  SpectrumRGB bilinear(Point2f uv) const {
+    return bilinearLookup(mLayout.width, mLayout.height, uv,
+                          [this](int x, int y) { return texel(x, y); });
+  }
+
+  //* The average of all texels
+  SpectrumRGB average() const;
+
+  int width() const { return mLayout.width; }
+
+  int height() const { return mLayout.height; }
+
+  TexelFormat format() const { return mFormat; }
+
+  const TileLayout &layout() const { return mLayout; }
+
+  //* The texels in the tile order
+  const std::vector<uint8_t> &data() const { return mData; }
+
+  size_t bytes() const { return mData.size(); }
+
+ private:
+  void allocate(int width, int height, TexelFormat format);
+
+  //* The index of the texel in the storage order
+  size_t index(int x, int y) const {
+    return ((size_t)mLayout.tile(x, y) << (2 * mLayout.tileLog2)) +
+           mLayout.texelInTile(x, y);
+  }
+
+  TileLayout mLayout;
+  TexelFormat mFormat = TexelFormat::Float;
+  int mTexelBytes = 0;
+  std::vector<uint8_t> mData;
+};
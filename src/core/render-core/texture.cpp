@@ -2,38 +2,34 @@
 
 #include "stb/stb_image.h"
 
-SpectrumRGB **TextureLoader::toRGB(const std::string &filepath, int &width,
-                                   int &height, int &channels) {
-  bool isHdr = stbi_is_hdr(filepath.c_str());
-  stbi_info(filepath.c_str(), &width, &height, &channels);
-  SpectrumRGB **data = new SpectrumRGB *[width];
-  for (int i = 0; i < width; ++i) {
-    data[i] = new SpectrumRGB[height]();
-  }
-
-  if (isHdr) {
-    float *tmp = stbi_loadf(filepath.c_str(), &width, &height, &channels, 0);
-
-    for (int x = 0; x < width; ++x) {
-      for (int y = 0; y < height; ++y) {
-        int offset = x * 3 + y * width * 3;
-        data[x][y] = SpectrumRGB{tmp[offset], tmp[offset + 1], tmp[offset + 2]};
-      }
-    }
-    stbi_image_free(tmp);
-  } else {
-    unsigned char *tmp =
-        stbi_load(filepath.c_str(), &width, &height, &channels, 3);
+SpectrumRGB Texture::evaluate(const Point2f &uv, const Vector2f &duvdx,
+                              const Vector2f &duvdy) const {
+  return evaluate(uv, std::max(std::abs(duvdx.x), std::abs(duvdy.x)),
+                  std::max(std::abs(duvdx.y), std::abs(duvdy.y)));
+}
 
-    for (int x = 0; x < width; ++x) {
-      for (int y = 0; y < height; ++y) {
-        int offset = x * 3 + y * width * 3;
-        data[x][y] = SpectrumRGB{(float)tmp[offset] / 255.f,
-                                 (float)tmp[offset + 1] / 255.f,
-                                 (float)tmp[offset + 2] / 255.f};
-      }
+TexelBuffer TextureLoader::load(const std::string &filepath, bool srgb,
+                                bool half) {
+  int width, height, channels;
+  if (stbi_is_hdr(filepath.c_str())) {
+    float *tmp = stbi_loadf(filepath.c_str(), &width, &height, &channels, 3);
+    if (!tmp) {
+      std::cout << "Error when loading texture " << filepath << std::endl;
+      std::exit(1);
     }
+    TexelBuffer texels(width, height,
+                       half ? TexelFormat::Half : TexelFormat::Float, tmp);
     stbi_image_free(tmp);
+    return texels;
+  }
+  unsigned char *tmp =
+      stbi_load(filepath.c_str(), &width, &height, &channels, 3);
+  if (!tmp) {
+    std::cout << "Error when loading texture " << filepath << std::endl;
+    std::exit(1);
   }
-  return data;
+  TexelBuffer texels(width, height,
+                     srgb ? TexelFormat::SRGB8 : TexelFormat::UNorm8, tmp);
+  stbi_image_free(tmp);
+  return texels;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include "core/utils/configurable.h"
 #include "spectrum.h"
+#include "texelbuffer.h"
 
 class Texture : public Configurable {
  public:
@@ -13,6 +14,12 @@ class Texture : public Configurable {
   virtual SpectrumRGB evaluate(const Point2f &uv, float du = 0,
                                float dv = 0) const = 0;
 
+  //*   The lookup filtered over the footprint of a pixel, the parallelogram
+  //* spanned by the uv differentials along the x and y of the screen. By
+  //* default it's reduced to the extents of the footprint along u and v
+  virtual SpectrumRGB evaluate(const Point2f &uv, const Vector2f &duvdx,
+                               const Vector2f &duvdy) const;
+
   virtual SpectrumRGB average() const = 0;
 
   virtual Vector2i getResolution() const = 0;
@@ -26,6 +33,8 @@ class TextureLoader {
  public:
   TextureLoader() = delete;
 
-  static SpectrumRGB **toRGB(const std::string &filepath, int &width,
-                             int &height, int &channels);
+  //*   Load the image as 8 bits texels (sRGB encoded if srgb), or as half
+  //* or float texels for the hdr images
+  static TexelBuffer load(const std::string &filepath, bool srgb = false,
+                          bool half = false);
 };
\ No newline at end of file
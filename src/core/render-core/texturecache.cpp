@@ -0,0 +1,274 @@
+#include "texturecache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+#include "texture.h"
+
+//*   The tiled file starts with the magic, the identity of its source, the
+//* average of the finest level as 3 floats, the format and the number of
+//* levels, then the width and height of each level as int32. The tiles of
+//* the levels follow one level after another
+static const char TILED_MAGIC[8] = {'X', 'L', 'T', 'E', 'X', '0', '0', '2'};
+
+struct TiledHeader {
+  FileIdentity source;
+  SpectrumRGB average{.0f};
+  TexelFormat format;
+  std::vector<TileLayout> layouts;
+};
+
+static bool readHeader(std::istream &in, TiledHeader *header) {
+  char magic[8];
+  in.read(magic, sizeof(magic));
+  if (!in || std::memcmp(magic, TILED_MAGIC, sizeof(magic)) != 0) return false;
+  if (!header->source.read(in)) return false;
+  float average[3];
+  int32_t counts[2];
+  in.read(reinterpret_cast<char *>(average), sizeof(average));
+  in.read(reinterpret_cast<char *>(counts), sizeof(counts));
+  if (!in) return false;
+  if (counts[0] < 0 || counts[0] > (int)TexelFormat::Float) return false;
+  if (counts[1] <= 0 || counts[1] > 32) return false;
+  header->average = SpectrumRGB{average[0], average[1], average[2]};
+  header->format = (TexelFormat)counts[0];
+  header->layouts.clear();
+  for (int i = 0; i < counts[1]; ++i) {
+    int32_t size[2];
+    in.read(reinterpret_cast<char *>(size), sizeof(size));
+    if (!in || size[0] <= 0 || size[1] <= 0) return false;
+    header->layouts.emplace_back(size[0], size[1]);
+  }
+  return true;
+}
+
+static size_t levelBytes(const TileLayout &layout, TexelFormat format) {
+  return (size_t)layout.tileCount() * layout.tileTexels() * texelBytes(format);
+}
+
+TextureCache &TextureCache::instance() {
+  static TextureCache cache;
+  return cache;
+}
+
+void TextureCache::configure(size_t _budget, const std::string &_directory) {
+  budget = _budget;
+  directory = _directory;
+  if (!directory.empty()) std::filesystem::create_directories(directory);
+}
+
+std::string TextureCache::tiledFile(const std::string &source,
+                                    const std::string &variant) const {
+  std::filesystem::path path(source);
+  //* The hash of the path keeps apart the images of the same name
+  std::string name = path.filename().string() + "." +
+                     FileIdentity::of(source).pathHash() + "." + variant +
+                     ".xltex";
+  std::filesystem::path parent =
+      directory.empty() ? path.parent_path() : std::filesystem::path(directory);
+  return (parent / name).string();
+}
+
+bool TextureCache::upToDate(const std::string &tiledPath,
+                            const std::string &source) {
+  std::ifstream in(tiledPath, std::ios::binary);
+  TiledHeader header;
+  if (!readHeader(in, &header)) return false;
+  FileIdentity identity = FileIdentity::of(source);
+  //* Without the source, the tiled file is all there is
+  return !identity.exists || header.source == identity;
+}
+
+bool TextureCache::writeTiled(const std::string &tiledPath,
+                              const FileIdentity &source,
+                              const std::vector<TexelBuffer> &levels) {
+  const TexelBuffer &finest = levels[0];
+  SpectrumRGB mean = finest.average();
+  float average[3] = {mean[0], mean[1], mean[2]};
+
+  //* Write to a temporary file first, so an interrupted conversion never
+  //* leaves a broken tiled file behind
+  std::string tmpPath = tiledPath + ".tmp";
+  {
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+    int32_t counts[2] = {(int32_t)finest.format(), (int32_t)levels.size()};
+    out.write(TILED_MAGIC, sizeof(TILED_MAGIC));
+    source.write(out);
+    out.write(reinterpret_cast<const char *>(average), sizeof(average));
+    out.write(reinterpret_cast<const char *>(counts), sizeof(counts));
+    for (const auto &level : levels) {
+      int32_t size[2] = {level.width(), level.height()};
+      out.write(reinterpret_cast<const char *>(size), sizeof(size));
+    }
+    for (const auto &level : levels)
+      out.write(reinterpret_cast<const char *>(level.data().data()),
+                level.bytes());
+    if (!out) return false;
+  }
+  std::error_code error;
+  std::filesystem::rename(tmpPath, tiledPath, error);
+  return !error;
+}
+
+std::vector<TexelBuffer> TextureCache::readTiled(const std::string &tiledPath) {
+  std::ifstream in(tiledPath, std::ios::binary);
+  TiledHeader header;
+  if (!readHeader(in, &header)) {
+    std::cout << "Error when reading tiled texture " << tiledPath << std::endl;
+    std::exit(1);
+  }
+  std::vector<TexelBuffer> levels;
+  TexelFormat format = header.format;
+  for (const auto &layout : header.layouts) {
+    std::vector<uint8_t> data(levelBytes(layout, format));
+    in.read(reinterpret_cast<char *>(data.data()), data.size());
+    if (!in) {
+      std::cout << "Error when reading tiled texture " << tiledPath
+                << std::endl;
+      std::exit(1);
+    }
+    levels.emplace_back(layout.width, layout.height, format, std::move(data));
+  }
+  return levels;
+}
+
+int TextureCache::openImage(const std::string &filepath, bool srgb,
+                            bool half) {
+  std::string variant =
+      std::string(srgb ? "srgb" : "linear") + (half ? "-half" : "");
+  std::string tiledPath = tiledFile(filepath, variant);
+  if (!upToDate(tiledPath, filepath)) {
+    std::cout << "Converting " << filepath << " into " << tiledPath << "\n";
+    if (!writeTiled(tiledPath, FileIdentity::of(filepath),
+                    {TextureLoader::load(filepath, srgb, half)})) {
+      std::cout << "Error when writing tiled texture " << tiledPath
+                << std::endl;
+      std::exit(1);
+    }
+  }
+  return open(tiledPath);
+}
+
+int TextureCache::open(const std::string &tiledPath) {
+  auto file = std::make_unique<File>();
+  file->path = tiledPath;
+  file->stream.open(tiledPath, std::ios::binary);
+  TiledHeader header;
+  if (!readHeader(file->stream, &header)) {
+    std::cout << "Error when opening tiled texture " << tiledPath << std::endl;
+    std::exit(1);
+  }
+  file->format = header.format;
+  file->average = header.average;
+  file->texelBytes = texelBytes(file->format);
+  size_t offset = file->stream.tellg();
+  for (const auto &layout : header.layouts) {
+    file->levels.emplace_back(Level{
+        layout, offset, (size_t)layout.tileTexels() * file->texelBytes});
+    offset += levelBytes(layout, file->format);
+  }
+  int handle = fileCount++;
+  if (handle >= MAX_FILES) {
+    std::cout << "Too many tiled textures open" << std::endl;
+    std::exit(1);
+  }
+  files[handle] = std::move(file);
+  return handle;
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::fetch(int file,
+                                                              int level,
+                                                              int tile) {
+  uint64_t k = key(file, level, tile);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto itr = entries.find(k);
+    if (itr != entries.end()) {
+      lru.splice(lru.begin(), lru, itr->second.lru);
+      ++hits;
+      return itr->second.tile;
+    }
+  }
+
+  //* Read the tile outside the lock of the LRU, two threads missing the same
+  //* tile may both read it and the second one keeps the first copy
+  File &f = *files[file];
+  const Level &l = f.levels[level];
+  auto loaded = std::make_shared<Tile>();
+  loaded->texels.resize(l.tileBytes);
+  {
+    std::lock_guard<std::mutex> lock(f.mutex);
+    f.stream.seekg(l.offset + (size_t)tile * l.tileBytes);
+    f.stream.read(reinterpret_cast<char *>(loaded->texels.data()),
+                  l.tileBytes);
+    if (!f.stream) {
+      std::cout << "Error when reading tiled texture " << f.path << std::endl;
+      std::exit(1);
+    }
+  }
+  ++misses;
+  bytesRead += l.tileBytes;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto [itr, inserted] = entries.try_emplace(k);
+  if (!inserted) return itr->second.tile;
+  lru.push_front(k);
+  itr->second = Entry{loaded, lru.begin()};
+  used += l.tileBytes;
+  //* Keep at least the new tile even if it alone is over the budget
+  while (used > budget && lru.size() > 1) {
+    auto victim = entries.find(lru.back());
+    used -= victim->second.tile->texels.size();
+    entries.erase(victim);
+    lru.pop_back();
+    ++evictions;
+  }
+  if (used > peak) peak = used;
+  return loaded;
+}
+
+SpectrumRGB TextureCache::texel(int file, int level, int x, int y) {
+  //* The micro cache of the thread, indexed by a hash of the tile key
+  static constexpr int MICRO_SIZE = 64;
+  struct MicroEntry {
+    uint64_t key = ~0ull;
+    std::shared_ptr<const Tile> tile;
+  };
+  static thread_local MicroEntry micro[MICRO_SIZE];
+  //* The lookups are counted per thread and flushed now and then
+  static thread_local uint64_t localLookups = 0;
+  if (++localLookups == 4096) {
+    lookups += localLookups;
+    localLookups = 0;
+  }
+
+  const Level &l = files[file]->levels[level];
+  int tile = l.layout.tile(x, y);
+  uint64_t k = key(file, level, tile);
+  MicroEntry &entry = micro[(k * 0x9e3779b97f4a7c15ull) >> 58];
+  if (entry.key != k) {
+    entry.tile = fetch(file, level, tile);
+    entry.key = k;
+  }
+  const uint8_t *src =
+      entry.tile->texels.data() +
+      (size_t)l.layout.texelInTile(x, y) * files[file]->texelBytes;
+  return decodeTexel(files[file]->format, src);
+}
+
+void TextureCache::printStatistics() const {
+  if (!enabled()) return;
+  uint64_t microMisses = hits + misses;
+  std::cout << "====== Texture cache =====\n";
+  std::cout << fileCount << " tiled files, budget "
+            << budget / (1024 * 1024) << " MB, peak "
+            << peak / (1024 * 1024) << " MB\n";
+  std::cout << "lookups (approx.) " << std::max<uint64_t>(lookups, microMisses)
+            << ", micro cache misses " << microMisses << "\n";
+  std::cout << "tile hits " << hits << ", tile misses " << misses
+            << ", evictions " << evictions << ", "
+            << bytesRead / (1024 * 1024) << " MB read\n";
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <atomic>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core/utils/fileidentity.h"
+#include "texelbuffer.h"
+
+//*   Out of core storage of the image textures. Each texture is converted
+//* once into a tiled file (the levels of the texture, each in the order of
+//* its TileLayout), and the tiles are read from it on the first access.
+//*   The tiles live in a global LRU bounded by the memory budget, and each
+//* thread keeps the last tiles it used in a small direct mapped micro cache
+//* which is checked without locking. A tile evicted from the LRU stays alive
+//* until the micro caches holding it move on
+class TextureCache {
+ public:
+  static TextureCache &instance();
+
+  //* A budget of 0 disables the cache, the textures are then loaded whole.
+  //* The tiled files go to directory, or next to the images if it's empty
+  void configure(size_t budget, const std::string &directory);
+
+  bool enabled() const { return budget > 0; }
+
+  //*   Open the image through the cache, converting it on the first use or
+  //* when the image is newer than its tiled file. Returns the file handle
+  int openImage(const std::string &filepath, bool srgb, bool half);
+
+  //* The tiled file of a source, variant tells apart the different
+  //* conversions of the same source and the hash of its path the sources of
+  //* the same name
+  std::string tiledFile(const std::string &source,
+                        const std::string &variant) const;
+
+  //* Open a tiled file for the lookups, returns its handle
+  int open(const std::string &tiledPath);
+
+  //* The texel of a level of the file, through the micro cache of the thread
+  SpectrumRGB texel(int file, int level, int x, int y);
+
+  int levels(int file) const { return files[file]->levels.size(); }
+
+  //* The tiled files open at most
+  static constexpr int MAX_FILES = 1 << 16;
+
+  const TileLayout &layout(int file, int level) const {
+    return files[file]->levels[level].layout;
+  }
+
+  TexelFormat format(int file) const { return files[file]->format; }
+
+  //* The average of the finest level, kept in the header at the conversion
+  SpectrumRGB average(int file) const { return files[file]->average; }
+
+  void printStatistics() const;
+
+  //* Whether the tiled file is valid and was converted from the current
+  //* version of its source
+  static bool upToDate(const std::string &tiledPath, const std::string &source);
+
+  //* Returns false if the file can't be written
+  static bool writeTiled(const std::string &tiledPath,
+                         const FileIdentity &source,
+                         const std::vector<TexelBuffer> &levels);
+
+  //* Read all levels of a tiled file at once
+  static std::vector<TexelBuffer> readTiled(const std::string &tiledPath);
+
+ private:
+  TextureCache() : files(MAX_FILES) {}
+
+  struct Tile {
+    std::vector<uint8_t> texels;
+  };
+
+  struct Level {
+    TileLayout layout;
+    //* The offset of the first tile in the file
+    size_t offset;
+    size_t tileBytes;
+  };
+
+  struct File {
+    std::string path;
+    TexelFormat format;
+    SpectrumRGB average{.0f};
+    int texelBytes;
+    std::vector<Level> levels;
+    //* Reads of the same file are serialized
+    std::mutex mutex;
+    std::ifstream stream;
+  };
+
+  struct Entry {
+    std::shared_ptr<const Tile> tile;
+    std::list<uint64_t>::iterator lru;
+  };
+
+  static uint64_t key(int file, int level, int tile) {
+    return (uint64_t)file << 40 | (uint64_t)level << 32 | (uint32_t)tile;
+  }
+
+  //* Find the tile in the LRU, or read it and evict the least recently used
+  //* tiles over the budget
+  std::shared_ptr<const Tile> fetch(int file, int level, int tile);
+
+  size_t budget = 0;
+  std::string directory;
+
+  //*   The slots are allocated upfront, so the textures loaded in parallel
+  //* open files while others already look up theirs
+  std::vector<std::unique_ptr<File>> files;
+  std::atomic<int> fileCount{0};
+
+  std::mutex mutex;
+  std::unordered_map<uint64_t, Entry> entries;
+  //* The most recently used tiles in the front
+  std::list<uint64_t> lru;
+  size_t used = 0;
+
+  std::atomic<uint64_t> lookups{0}, hits{0}, misses{0}, evictions{0};
+  std::atomic<size_t> bytesRead{0}, peak{0};
+};
@@ -0,0 +1,329 @@
+#include "lightbvh.h"
+
+#include <core/math/math.h>
+
+#include <algorithm>
+
+namespace {
+
+constexpr float ONE_MINUS_EPSILON = 0x1.fffffep-1;
+
+inline float safeSqrt(float x) { return std::sqrt(std::max(.0f, x)); }
+
+inline float safeACos(float x) { return std::acos(std::clamp(x, -1.f, 1.f)); }
+
+AABB3f unionBounds(const AABB3f &a, const AABB3f &b) {
+  return AABB3f{Point3f{std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y),
+                        std::min(a.min.z, b.min.z)},
+                Point3f{std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y),
+                        std::max(a.max.z, b.max.z)}};
+}
+
+//* Rotate v around the (unnormalized) axis by theta, Rodrigues' formula
+Vector3f rotate(const Vector3f &v, Vector3f axis, float theta) {
+  axis = normalize(axis);
+  float cosTheta = std::cos(theta), sinTheta = std::sin(theta);
+  return v * cosTheta + cross(axis, v) * sinTheta +
+         axis * (dot(axis, v) * (1 - cosTheta));
+}
+
+//* cos(max(0, theta_a - theta_b)) and sin(max(0, theta_a - theta_b))
+inline float cosSubClamped(float sinThetaA, float cosThetaA, float sinThetaB,
+                           float cosThetaB) {
+  if (cosThetaA > cosThetaB)
+    return 1;
+  return cosThetaA * cosThetaB + sinThetaA * sinThetaB;
+}
+
+inline float sinSubClamped(float sinThetaA, float cosThetaA, float sinThetaB,
+                           float cosThetaB) {
+  if (cosThetaA > cosThetaB)
+    return 0;
+  return sinThetaA * cosThetaB - cosThetaA * sinThetaB;
+}
+
+//* Surface area orientation heuristic of pbrt-v4
+float evaluateCost(const LightBounds &b, const AABB3f &bounds, int dim) {
+  float thetaO = safeACos(b.cosThetaO), thetaE = safeACos(b.cosThetaE),
+        thetaW = std::min(thetaO + thetaE, PI),
+        sinThetaO = safeSqrt(1 - b.cosThetaO * b.cosThetaO);
+  float mOmega = 2 * PI * (1 - b.cosThetaO) +
+                 PI / 2 *
+                     (2 * thetaW * sinThetaO - std::cos(thetaO - 2 * thetaW) -
+                      2 * thetaO * sinThetaO + b.cosThetaO);
+  Vector3f diagonal = bounds.max - bounds.min,
+           d = b.bounds.max - b.bounds.min;
+  float kr = std::max({diagonal.x, diagonal.y, diagonal.z}) /
+             std::max(diagonal[dim], EPSILON);
+  float area = 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+  return b.phi * mOmega * kr * area;
+}
+
+} // namespace
+
+float LightBounds::importance(Point3f p, Vector3f n) const {
+  //* Clamp the squared distance to avoid the singularity inside the bounds
+  Point3f pc = bounds.getCentroid();
+  float d2 = (p - pc).length2();
+  d2 = std::max(d2, (bounds.max - bounds.min).length() / 2);
+
+  Vector3f wi = p - pc;
+  if (wi.isZero())
+    wi = w;
+  wi = normalize(wi);
+  float cosThetaW = dot(w, wi);
+  if (twoSided)
+    cosThetaW = std::abs(cosThetaW);
+  float sinThetaW = safeSqrt(1 - cosThetaW * cosThetaW);
+
+  //* Cone of directions subtended by the bounding sphere
+  float radius2 = (bounds.max - pc).length2(), dist2 = (p - pc).length2(),
+        cosThetaB = dist2 < radius2 ? -1 : safeSqrt(1 - radius2 / dist2),
+        sinThetaB = safeSqrt(1 - cosThetaB * cosThetaB);
+
+  //* Minimal angle between the emission cone and the reference point
+  float sinThetaO = safeSqrt(1 - cosThetaO * cosThetaO),
+        cosThetaX =
+            cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO),
+        sinThetaX =
+            sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO),
+        cosThetaP =
+            cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+  if (cosThetaP <= cosThetaE)
+    return 0;
+
+  float importance = phi * cosThetaP / d2;
+  if (!n.isZero()) {
+    float cosThetaI = absDot(wi, n),
+          sinThetaI = safeSqrt(1 - cosThetaI * cosThetaI);
+    importance *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+  }
+  return std::max(importance, .0f);
+}
+
+LightBounds LightBounds::merge(const LightBounds &a, const LightBounds &b) {
+  if (a.phi == 0)
+    return b;
+  if (b.phi == 0)
+    return a;
+
+  LightBounds result;
+  result.bounds = unionBounds(a.bounds, b.bounds);
+  result.phi = a.phi + b.phi;
+  result.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+  result.twoSided = a.twoSided || b.twoSided;
+
+  //* Merge the normal cones
+  float thetaA = safeACos(a.cosThetaO), thetaB = safeACos(b.cosThetaO),
+        thetaD = safeACos(dot(a.w, b.w));
+  if (std::min(thetaD + thetaB, PI) <= thetaA) {
+    result.w = a.w, result.cosThetaO = a.cosThetaO;
+  } else if (std::min(thetaD + thetaA, PI) <= thetaB) {
+    result.w = b.w, result.cosThetaO = b.cosThetaO;
+  } else {
+    float thetaO = (thetaA + thetaD + thetaB) / 2;
+    Vector3f axis = cross(a.w, b.w);
+    if (thetaO >= PI || axis.length2() == 0) {
+      result.w = Vector3f{0, 1, 0}, result.cosThetaO = -1;
+    } else {
+      result.w = rotate(a.w, axis, thetaO - thetaA);
+      result.cosThetaO = std::cos(thetaO);
+    }
+  }
+  return result;
+}
+
+void LightBoundsTree::build(const std::vector<LightBounds> &items) {
+  nodes.clear();
+  bitTrails.assign(items.size(), std::nullopt);
+
+  std::vector<std::pair<int, LightBounds>> bounded;
+  for (int i = 0; i < items.size(); ++i)
+    if (items[i].phi > 0)
+      bounded.emplace_back(i, items[i]);
+  if (bounded.empty())
+    return;
+  nodes.reserve(2 * bounded.size() - 1);
+  buildRecursive(bounded, 0, bounded.size(), 0, 0);
+}
+
+int LightBoundsTree::buildRecursive(
+    std::vector<std::pair<int, LightBounds>> &items, int begin, int end,
+    uint64_t bitTrail, int depth) {
+  if (end - begin == 1) {
+    int nodeIndex = nodes.size();
+    nodes.emplace_back(Node{items[begin].second, items[begin].first, true});
+    bitTrails[items[begin].first] = bitTrail;
+    return nodeIndex;
+  }
+
+  AABB3f bounds = items[begin].second.bounds,
+         centroidBounds{items[begin].second.bounds.getCentroid()};
+  for (int i = begin + 1; i < end; ++i) {
+    const AABB3f &b = items[i].second.bounds;
+    Point3f pc = b.getCentroid();
+    bounds = unionBounds(bounds, b);
+    centroidBounds = unionBounds(centroidBounds, AABB3f{pc});
+  }
+
+  //* Split by the bucketed SAOH, fall back to the median split
+  constexpr int nBuckets = 12;
+  float minCost = FINF;
+  int minBucket = -1, minDim = -1;
+  auto bucketOf = [&](const LightBounds &b, int dim) {
+    float extent = centroidBounds.max[dim] - centroidBounds.min[dim],
+          offset = (b.bounds.getCentroid()[dim] - centroidBounds.min[dim]) /
+                   extent;
+    return std::clamp(int(nBuckets * offset), 0, nBuckets - 1);
+  };
+  for (int dim = 0; dim < 3; ++dim) {
+    if (centroidBounds.max[dim] == centroidBounds.min[dim])
+      continue;
+    LightBounds buckets[nBuckets];
+    for (int i = begin; i < end; ++i) {
+      int b = bucketOf(items[i].second, dim);
+      buckets[b] = LightBounds::merge(buckets[b], items[i].second);
+    }
+    for (int i = 0; i < nBuckets - 1; ++i) {
+      LightBounds b0, b1;
+      for (int j = 0; j <= i; ++j)
+        b0 = LightBounds::merge(b0, buckets[j]);
+      for (int j = i + 1; j < nBuckets; ++j)
+        b1 = LightBounds::merge(b1, buckets[j]);
+      if (b0.phi == 0 || b1.phi == 0)
+        continue;
+      float cost =
+          evaluateCost(b0, bounds, dim) + evaluateCost(b1, bounds, dim);
+      if (cost > 0 && cost < minCost)
+        minCost = cost, minBucket = i, minDim = dim;
+    }
+  }
+
+  //* The bit trail holds 64 levels, keep the deep subtrees balanced
+  int mid;
+  if (minDim == -1 || depth >= 32) {
+    mid = (begin + end) / 2;
+  } else {
+    auto pmid = std::partition(
+        items.begin() + begin, items.begin() + end,
+        [&](const auto &l) { return bucketOf(l.second, minDim) <= minBucket; });
+    mid = pmid - items.begin();
+    if (mid == begin || mid == end)
+      mid = (begin + end) / 2;
+  }
+
+  int nodeIndex = nodes.size();
+  nodes.emplace_back();
+  int child0 = buildRecursive(items, begin, mid, bitTrail, depth + 1),
+      child1 = buildRecursive(items, mid, end,
+                              bitTrail | (uint64_t(1) << depth), depth + 1);
+  assert(child0 == nodeIndex + 1);
+  nodes[nodeIndex] = Node{LightBounds::merge(nodes[child0].lightBounds,
+                                             nodes[child1].lightBounds),
+                          child1, false};
+  return nodeIndex;
+}
+
+std::pair<int, float> LightBoundsTree::sample(Point3f p, Vector3f n,
+                                              float u) const {
+  if (nodes.empty())
+    return {-1, .0f};
+
+  int nodeIndex = 0;
+  float pmf = 1;
+  while (true) {
+    const Node &node = nodes[nodeIndex];
+    if (node.isLeaf) {
+      if (nodeIndex > 0 || node.lightBounds.importance(p, n) > 0)
+        return {node.childOrItemIndex, pmf};
+      return {-1, .0f};
+    }
+    float c0 = nodes[nodeIndex + 1].lightBounds.importance(p, n),
+          c1 = nodes[node.childOrItemIndex].lightBounds.importance(p, n);
+    if (c0 == 0 && c1 == 0)
+      return {-1, .0f};
+    float p0 = c0 / (c0 + c1);
+    if (u < p0) {
+      nodeIndex = nodeIndex + 1;
+      u = std::min(u / p0, ONE_MINUS_EPSILON);
+      pmf *= p0;
+    } else {
+      nodeIndex = node.childOrItemIndex;
+      u = std::min((u - p0) / (1 - p0), ONE_MINUS_EPSILON);
+      pmf *= 1 - p0;
+    }
+  }
+}
+
+float LightBoundsTree::pmf(int index, Point3f p, Vector3f n) const {
+  if (index < 0 || index >= bitTrails.size() || !bitTrails[index])
+    return 0;
+
+  uint64_t bitTrail = *bitTrails[index];
+  int nodeIndex = 0;
+  float pmf = 1;
+  while (true) {
+    const Node &node = nodes[nodeIndex];
+    if (node.isLeaf)
+      return (nodeIndex > 0 || node.lightBounds.importance(p, n) > 0) ? pmf
+                                                                       : 0;
+    int child0 = nodeIndex + 1, child1 = node.childOrItemIndex;
+    float c0 = nodes[child0].lightBounds.importance(p, n),
+          c1 = nodes[child1].lightBounds.importance(p, n);
+    if (c0 == 0 && c1 == 0)
+      return 0;
+    pmf *= (bitTrail & 1) ? c1 / (c0 + c1) : c0 / (c0 + c1);
+    nodeIndex = (bitTrail & 1) ? child1 : child0;
+    bitTrail >>= 1;
+  }
+}
+
+void LightBVH::build(const std::vector<std::shared_ptr<Emitter>> &emitters) {
+  boundedLights.clear();
+  infiniteLights.clear();
+  lightIndices.clear();
+
+  std::vector<LightBounds> lightBounds;
+  for (auto emitter : emitters) {
+    if (auto b = emitter->bounds(); b) {
+      lightIndices[emitter.get()] = boundedLights.size();
+      boundedLights.emplace_back(emitter);
+      lightBounds.emplace_back(*b);
+    } else {
+      infiniteLights.emplace_back(emitter);
+    }
+  }
+  tree.build(lightBounds);
+}
+
+float LightBVH::pInfinite() const {
+  float nInfinite = infiniteLights.size();
+  return nInfinite / (nInfinite + (tree.empty() ? 0 : 1));
+}
+
+std::pair<std::shared_ptr<Emitter>, float>
+LightBVH::sample(Point3f p, Vector3f n, float u) const {
+  float pInf = pInfinite();
+  if (u < pInf) {
+    int index = std::min<int>(u / pInf * infiniteLights.size(),
+                              infiniteLights.size() - 1);
+    return {infiniteLights[index], pInf / infiniteLights.size()};
+  }
+  if (tree.empty())
+    return {nullptr, .0f};
+
+  u = std::min((u - pInf) / (1 - pInf), ONE_MINUS_EPSILON);
+  auto [index, pmf] = tree.sample(p, n, u);
+  if (index < 0)
+    return {nullptr, .0f};
+  return {boundedLights[index], pmf * (1 - pInf)};
+}
+
+float LightBVH::pmf(const Emitter *emitter, Point3f p, Vector3f n) const {
+  if (auto itr = lightIndices.find(emitter); itr != lightIndices.end())
+    return tree.pmf(itr->second, p, n) * (1 - pInfinite());
+  for (const auto &light : infiniteLights)
+    if (light.get() == emitter)
+      return pInfinite() / infiniteLights.size();
+  return 0;
+}
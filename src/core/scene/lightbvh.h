@@ -0,0 +1,78 @@
+#pragma once
+#include <core/render-core/emitter.h>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+//* Bounding volume hierarchy over LightBounds, each node stores the merged
+//* bounds of its subtree so that the traversal can choose a child by its
+//* importance with respect to the reference point. Items are identified by
+//* their index in the array given to build()
+class LightBoundsTree {
+public:
+  LightBoundsTree() = default;
+
+  ~LightBoundsTree() = default;
+
+  void build(const std::vector<LightBounds> &items);
+
+  //* Return the chosen index and the probability of choosing it, or -1 if no
+  //* item can contribute to the reference point
+  std::pair<int, float> sample(Point3f p, Vector3f n, float u) const;
+
+  //* The probability that sample(p, n, u) chooses the item
+  float pmf(int index, Point3f p, Vector3f n) const;
+
+  bool empty() const { return nodes.empty(); }
+
+private:
+  struct Node {
+    LightBounds lightBounds;
+    //* Interior : index of the second child, the first one follows the node
+    //* Leaf     : index of the item
+    int childOrItemIndex;
+    bool isLeaf;
+  };
+
+  int buildRecursive(std::vector<std::pair<int, LightBounds>> &items,
+                     int begin, int end, uint64_t bitTrail, int depth);
+
+  std::vector<Node> nodes;
+
+  //* The path from the root to the leaf of each item, one bit per level (0
+  //* for the first child and 1 for the second), items with no power are
+  //* left out of the tree
+  std::vector<std::optional<uint64_t>> bitTrails;
+};
+
+//* Emitter selection with respect to a reference point, the emitters with
+//* finite extent are organized in a LightBoundsTree while the emitters at
+//* infinity are chosen uniformly with a fixed probability
+class LightBVH {
+public:
+  LightBVH() = default;
+
+  ~LightBVH() = default;
+
+  void build(const std::vector<std::shared_ptr<Emitter>> &emitters);
+
+  //* Return the chosen emitter and the probability of choosing it, or nullptr
+  //* if no emitter can contribute to the reference point
+  std::pair<std::shared_ptr<Emitter>, float> sample(Point3f p, Vector3f n,
+                                                    float u) const;
+
+  //* The probability that sample(p, n, u) chooses the emitter
+  float pmf(const Emitter *emitter, Point3f p, Vector3f n) const;
+
+  bool empty() const { return tree.empty() && infiniteLights.empty(); }
+
+private:
+  float pInfinite() const;
+
+  LightBoundsTree tree;
+
+  std::vector<std::shared_ptr<Emitter>> boundedLights, infiniteLights;
+
+  std::unordered_map<const Emitter *, int> lightIndices;
+};
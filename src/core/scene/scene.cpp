@@ -1,6 +1,7 @@
 #include "scene.h"
 
 #include <spdlog/spdlog.h>
+#include <tbb/parallel_for.h>
 
 #include <stack>
 
@@ -20,12 +21,26 @@ void Scene::addShape(std::shared_ptr<ShapeInterface> shape) {
   shapes.emplace_back(shape);
 }
 
+void Scene::addShapes(
+    const std::vector<std::shared_ptr<ShapeInterface>> &newShapes) {
+  tbb::parallel_for(0, (int)newShapes.size(), [&](int i) {
+    newShapes[i]->initEmbreeGeometry(this->device);
+  });
+  for (const auto &shape : newShapes) {
+    rtcAttachGeometryByID(scene, shape->embreeGeometry, shapeCount++);
+    rtcReleaseGeometry(shape->embreeGeometry);
+    shapes.emplace_back(shape);
+  }
+}
+
 void Scene::addEmitter(std::shared_ptr<Emitter> emitter) {
   emitters.emplace_back(emitter);
 }
 
 void Scene::postProcess() {
   rtcCommitScene(scene);
+  for (auto shape : shapes)
+    bounds.expands(shape->getBounds());
   //* Construct the light distribution using some measure
   //* Here distribution is refer to a single emitter
   //! Just uniform distribution now
@@ -33,9 +48,12 @@ void Scene::postProcess() {
     lightDistrib.append(emitter, 1);
   }
   lightDistrib.postProcess();
+  //* The light BVH is used when a reference point exists
+  lightBVH.build(emitters);
 
-  if (environment)
-    environment->initialize();
+  //* The emitters build their sampling structures independently
+  tbb::parallel_for(0, (int)emitters.size(),
+                    [&](int i) { emitters[i]->initialize(); });
 }
 
 std::optional<ShapeIntersection> Scene::intersect(const Ray3f &ray) const {
@@ -53,7 +71,12 @@ std::optional<ShapeIntersection> Scene::intersect(const Ray3f &ray) const {
     //* No hit
     return std::nullopt;
   }
-  std::shared_ptr<ShapeInterface> shape = shapes[geomID];
+  return std::make_optional(fillIntersection(ray, rayhit));
+}
+
+ShapeIntersection Scene::fillIntersection(const Ray3f &ray,
+                                          const RTCRayHit &rayhit) const {
+  std::shared_ptr<ShapeInterface> shape = shapes[rayhit.hit.geomID];
   ShapeIntersection its;
   //* Fill the intersection
   its.shape = shape;
@@ -94,7 +117,7 @@ std::optional<ShapeIntersection> Scene::intersect(const Ray3f &ray) const {
   }
 
   its.uv = shape->getHitTextureCoordinate(triangleIndex, uv);
-  return std::make_optional(its);
+  return its;
 }
 
 bool Scene::occlude(const Ray3f &ray) const {
@@ -107,20 +130,99 @@ float Scene::pdfEmitter(std::shared_ptr<Emitter> emitter) const {
   return lightDistrib.pdf(emitter);
 }
 
+float Scene::pdfEmitter(const Emitter *emitter) const {
+  for (const auto &e : emitters)
+    if (e.get() == emitter)
+      return lightDistrib.pdf(e);
+  return 0;
+}
+
+float Scene::pdfEmitter(const Emitter *emitter, Point3f p, Vector3f n) const {
+  return lightBVH.pmf(emitter, p, n);
+}
+
+//* Only surfaces restrict the directions of incoming light
+static Vector3f referenceNormal(const IntersectionInfo &info) {
+  if (auto surface = dynamic_cast<const SurfaceIntersectionInfo *>(&info);
+      surface && surface->shape)
+    return surface->geometryNormal;
+  return Vector3f{0};
+}
+
+float Scene::pdfEmitter(std::shared_ptr<Emitter> emitter, Point3f p,
+                        Vector3f n) const {
+  return pdfEmitter(emitter.get(), p, n);
+}
+
+float Scene::pdfEmitter(std::shared_ptr<Emitter> emitter,
+                        const IntersectionInfo &ref) const {
+  return pdfEmitter(emitter, ref.position, referenceNormal(ref));
+}
+
 std::shared_ptr<SurfaceIntersectionInfo>
 Scene::intersectWithSurface(const Ray3f &ray) const {
   auto info = std::make_shared<SurfaceIntersectionInfo>();
+  intersectWithSurface(ray, info.get());
+  return info;
+}
+
+void Scene::intersectWithSurface(const Ray3f &ray,
+                                 SurfaceIntersectionInfo *info) const {
   // todo replace the old interface
-  auto itsOpt = intersect(ray);
+  fillSurfaceInfo(ray, intersect(ray), info);
+}
+
+void Scene::intersectThroughNull(const Ray3f &ray,
+                                 SurfaceIntersectionInfo *info,
+                                 std::vector<MediumSegment> *segments) const {
+  segments->clear();
+  RTCIntersectContext ictx;
+  rtcInitIntersectContext(&ictx);
 
+  RTCRayHit rayhit;
+  rayhit.ray = ray.toRTC();
+  const Medium *medium = ray.medium;
+  float tmin = 0;
+  while (true) {
+    rayhit.ray.tfar = ray.tmax;
+    rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    rtcIntersect1(scene, &ictx, &rayhit);
+
+    if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+      segments->emplace_back(MediumSegment{medium, tmin, ray.tmax});
+      fillSurfaceInfo(ray, std::nullopt, info);
+      return;
+    }
+    float t = rayhit.ray.tfar;
+    segments->emplace_back(MediumSegment{medium, tmin, t});
+    const auto &shape = shapes[rayhit.hit.geomID];
+    if (shape->getBSDF()->m_type != BSDF::EBSDFType::EEmpty) {
+      fillSurfaceInfo(ray, fillIntersection(ray, rayhit), info);
+      return;
+    }
+    //* Cross the null interface, the medium behind it follows the rule of
+    //* SurfaceIntersectionInfo::scatterRay
+    Vector3f ng{rayhit.hit.Ng_x, rayhit.hit.Ng_y, rayhit.hit.Ng_z};
+    bool outwards = dot(ray.dir, ng) > 0;
+    auto next = outwards ? envMedium : shape->getInsideMedium();
+    medium = next ? next.get() : nullptr;
+    tmin = t;
+    rayhit.ray.tnear = t + 0.0001f;
+  }
+}
+
+void Scene::fillSurfaceInfo(const Ray3f &ray,
+                            const std::optional<ShapeIntersection> &itsOpt,
+                            SurfaceIntersectionInfo *info) const {
   if (!itsOpt) {
     info->shape = nullptr;
     info->light = getEnvEmitter();
+    info->primID = -1;
     info->distance = 100000.f;
     info->position = ray.at(info->distance);
     info->wi = ray.dir;
-
-    return info;
+    info->closureResolved = false;
+    return;
   }
 
   info->shape = itsOpt->shape.get();
@@ -129,20 +231,32 @@ Scene::intersectWithSurface(const Ray3f &ray) const {
   info->distance = itsOpt->distance;
   info->wi = -ray.dir;
   info->geometryNormal = itsOpt->geometryN;
+  info->primID = itsOpt->primID;
   info->shadingFrame = itsOpt->shadingF;
   info->uv = itsOpt->uv;
   info->dpdu = itsOpt->dpdu;
   info->dpdv = itsOpt->dpdv;
   info->computeDifferential(ray);
-  return info;
+  info->closureResolved = false;
 }
 
 LightSourceInfo Scene::sampleLightSource(const IntersectionInfo &itsInfo,
                                          Sampler *sampler) const {
-  auto [light, pdfLight] = lightDistrib.sample(sampler->next1D());
-  LightSourceInfo info = light->sampleLightSource(itsInfo, sampler->next3D());
+  auto [light, pdfLight] = lightBVH.sample(
+      itsInfo.position, referenceNormal(itsInfo), sampler->next1D());
+  //* The light point is drawn anyway, so the dimensions stay the same
+  Point3f u = sampler->next3D();
+  if (!light) {
+    //* No emitter reaches the point, an empty sample with pdf 0
+    LightSourceInfo info;
+    info.pdf = 0;
+    info.pdfChoice = 0;
+    return info;
+  }
+  LightSourceInfo info = light->sampleLightSource(itsInfo, u);
   info.light = light;
   info.pdf *= pdfLight;
+  info.pdfChoice = pdfLight;
   return info;
 }
 
@@ -151,5 +265,6 @@ LightSourceInfo Scene::sampleLightSource(Sampler *sampler) const {
   LightSourceInfo info = light->sampleLightSource(sampler->next3D());
   info.light = light;
   info.pdf *= pdfLight;
+  info.pdfChoice = pdfLight;
   return info;
 }
\ No newline at end of file
@@ -11,8 +11,17 @@
 #include <vector>
 
 #include "core/render-core/medium.h"
+#include "lightbvh.h"
 
 using Intersection = std::variant<ShapeIntersection, MediumIntersection>;
+
+//* The part of a ray inside a single medium, in distances along the ray
+struct MediumSegment {
+  //* nullptr means vacuum
+  const Medium *medium;
+  float tmin, tmax;
+};
+
 class Scene {
 public:
   Scene();
@@ -21,6 +30,9 @@ public:
 
   void addShape(std::shared_ptr<ShapeInterface> shape);
 
+  //* Build the geometries of the shapes in parallel, then attach them in order
+  void addShapes(const std::vector<std::shared_ptr<ShapeInterface>> &shapes);
+
   void addEmitter(std::shared_ptr<Emitter> emitter);
 
   void postProcess();
@@ -41,8 +53,25 @@ public:
 
   float pdfEmitter(std::shared_ptr<Emitter> emitter) const;
 
+  //* The probability of choosing the emitter with respect to the reference
+  //* point, matching sampleLightSource(info, sampler)
+  //* n is zero for the points not on a surface
+  float pdfEmitter(std::shared_ptr<Emitter> emitter, Point3f p,
+                   Vector3f n) const;
+
+  float pdfEmitter(std::shared_ptr<Emitter> emitter,
+                   const IntersectionInfo &ref) const;
+
+  //* Non-owning versions for the path vertices of bidir methods
+  float pdfEmitter(const Emitter *emitter) const;
+
+  float pdfEmitter(const Emitter *emitter, Point3f p, Vector3f n) const;
+
   std::shared_ptr<Emitter> getEnvEmitter() const { return environment; }
 
+  //* The bounding box of all shapes, valid after postProcess
+  AABB3f getBounds() const { return bounds; }
+
 private:
   //* Embree
   RTCDevice device;
@@ -51,14 +80,34 @@ private:
   int shapeCount = 0;
   std::shared_ptr<Emitter> environment;
   std::vector<std::shared_ptr<ShapeInterface>> shapes;
+  AABB3f bounds;
   std::shared_ptr<Medium> envMedium;
 
   std::vector<std::shared_ptr<Emitter>> emitters;
   Distrib1D<std::shared_ptr<Emitter>> lightDistrib;
+  LightBVH lightBVH;
+
+  ShapeIntersection fillIntersection(const Ray3f &ray,
+                                     const RTCRayHit &rayhit) const;
+
+  void fillSurfaceInfo(const Ray3f &ray,
+                       const std::optional<ShapeIntersection> &itsOpt,
+                       SurfaceIntersectionInfo *info) const;
 
 public:
   std::shared_ptr<SurfaceIntersectionInfo>
   intersectWithSurface(const Ray3f &ray) const;
+  //* Fill the given info instead of allocating a new one
+  void intersectWithSurface(const Ray3f &ray,
+                            SurfaceIntersectionInfo *info) const;
+  //*   Find the first surface along the ray which is not a null interface
+  //* (empty bsdf). The traversal continues past the null interfaces without
+  //* building their surface info, and the media crossed are appended to
+  //* segments in order. The distance of info is measured from ray.ori
+  void intersectThroughNull(const Ray3f &ray, SurfaceIntersectionInfo *info,
+                            std::vector<MediumSegment> *segments) const;
+  //*   Choose a light by its importance to the point and sample it. If no
+  //* light reaches the point the result has no light and pdf 0
   LightSourceInfo sampleLightSource(const IntersectionInfo &info,
                                     Sampler *sampler) const;
   LightSourceInfo sampleLightSource(Sampler *sampler) const;
@@ -3,11 +3,41 @@
 #include <openvdb/openvdb.h>
 #include <openvdb/tools/GridTransformer.h>
 
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
 #include "core/render-core/hetergeneous.h"
+#include "core/utils/fileidentity.h"
+
+static const char SNAPSHOT_MAGIC[8] = {'X', 'L', 'G', 'R', 'I', 'D', '0', '1'};
+
+namespace {
+//* A float grid flattened into a medium, with its world bounds
+struct FlatGrid {
+  Point3f pMin, pMax;
+  std::shared_ptr<Hetergeneous> medium;
+};
+}  // namespace
+
+//* In the order of the file
+using FlatGrids = std::vector<std::pair<std::string, FlatGrid>>;
+
+//* The hash of the path keeps apart the files of the same name
+static std::string snapshotPath(const FileIdentity &source,
+                                const std::string &directory) {
+  std::filesystem::path path(source.path);
+  std::string name =
+      path.filename().string() + "." + source.pathHash() + ".xlgrid";
+  std::filesystem::path parent =
+      directory.empty() ? path.parent_path() : std::filesystem::path(directory);
+  return (parent / name).string();
+}
 
-std::unordered_map<std::string, std::shared_ptr<ShapeInterface>> loadVdbFile(
-    const std::string &filePath, float scale) {
-  std::unordered_map<std::string, std::shared_ptr<ShapeInterface>> result;
+//* Every float grid of the file
+static FlatGrids flattenVdbFile(const std::string &filePath, float scale,
+                                bool trilinear) {
+  FlatGrids result;
 
   using namespace openvdb;
   initialize();
@@ -15,32 +45,156 @@ std::unordered_map<std::string, std::shared_ptr<ShapeInterface>> loadVdbFile(
   io::File vdbFile(filePath);
   vdbFile.open();
 
-  auto itr = vdbFile.beginName();
-  if (itr == vdbFile.endName()) {
+  std::vector<std::string> names;
+  for (auto itr = vdbFile.beginName(); itr != vdbFile.endName(); ++itr)
+    names.emplace_back(itr.gridName());
+  if (names.empty()) {
     std::cout << "Error!, no grid in file\n";
     std::exit(1);
   }
-  auto gridName = itr.gridName();
-  std::cout << "GridName = " << gridName << std::endl;
-  GridBase::Ptr grid = vdbFile.readGrid(gridName);
-  vdbFile.close();
 
-  FloatGrid::Ptr densityGrid = gridPtrCast<FloatGrid>(grid);
+  for (const auto &gridName : names) {
+    FloatGrid::Ptr densityGrid =
+        gridPtrCast<FloatGrid>(vdbFile.readGrid(gridName));
+    if (!densityGrid) {
+      std::cout << "Skip grid " << gridName << ", not a float grid\n";
+      continue;
+    }
+    std::cout << "GridName = " << gridName << std::endl;
+
+    openvdb::Mat4R m =
+        densityGrid->transform().baseMap()->getAffineMap()->getMat4();
+    auto transform = openvdb::math::Transform::createLinearTransform(m);
 
-  openvdb::Mat4R m =
-      densityGrid->transform().baseMap()->getAffineMap()->getMat4();
-  auto transform = openvdb::math::Transform::createLinearTransform(m);
+    densityGrid->setTransform(transform);
 
-  densityGrid->setTransform(transform);
+    auto worldBound = densityGrid->evalActiveVoxelBoundingBox();
+    auto min = densityGrid->indexToWorld(worldBound.min()),
+         max = densityGrid->indexToWorld(worldBound.max());
 
-  auto worldBound = densityGrid->evalActiveVoxelBoundingBox();
-  auto min = densityGrid->indexToWorld(worldBound.min()),
-       max = densityGrid->indexToWorld(worldBound.max());
+    //* The medium keeps a flattened copy, the grid itself is released here
+    auto medium = std::make_shared<Hetergeneous>(densityGrid, scale, trilinear);
+    result.emplace_back(gridName, FlatGrid{Point3f(min.x(), min.y(), min.z()),
+                                           Point3f(max.x(), max.y(), max.z()),
+                                           medium});
+  }
+  vdbFile.close();
 
-  result[gridName] = std::make_shared<GridMedium>(
-      Point3f(min.x(), min.y(), min.z()), Point3f(max.x(), max.y(), max.z()),
-      std::make_shared<Hetergeneous>(densityGrid, scale));
+  return result;
+}
 
+//*   The snapshot is the magic, the identity of the source, the scale and the
+//* grid count, then for each grid the length of its name, the name, its
+//* world bounds and its flattened medium
+static bool writeSnapshot(const std::string &path, const FileIdentity &source,
+                          float scale, const FlatGrids &grids) {
+  //* Write to a temporary file first, so an interrupted run never leaves a
+  //* broken snapshot behind
+  std::string tmpPath = path + ".tmp";
+  {
+    SnapshotWriter out(tmpPath);
+    if (!out) return false;
+    out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    source.write(out);
+    out.value(scale);
+    out.value<uint32_t>(grids.size());
+    for (const auto &[name, grid] : grids) {
+      out.value<uint32_t>(name.size());
+      out.write(name.data(), name.size());
+      float bounds[6] = {grid.pMin.x, grid.pMin.y, grid.pMin.z,
+                         grid.pMax.x, grid.pMax.y, grid.pMax.z};
+      out.value(bounds);
+      grid.medium->write(out);
+    }
+    if (!out) return false;
+  }
+  std::error_code error;
+  std::filesystem::rename(tmpPath, path, error);
+  return !error;
+}
+
+//*   Map the snapshot, the bricks and majorants of the media point into the
+//* mapping. False if it's invalid, taken from another version of source or
+//* with another scale
+static bool readSnapshot(const std::string &path, const FileIdentity &source,
+                         float scale, bool trilinear, FlatGrids *grids) {
+  auto file = MappedFile::open(path);
+  if (!file) return false;
+  SnapshotReader in(file);
+
+  char magic[8];
+  FileIdentity snapshotSource;
+  float snapshotScale;
+  uint32_t count;
+  if (!in.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+      !snapshotSource.read(in) || !in.value(&snapshotScale) ||
+      !in.value(&count))
+    return false;
+  //* Without the source, the snapshot is all there is
+  if (source.exists && !(snapshotSource == source)) return false;
+  if (snapshotScale != scale) return false;
+
+  FlatGrids result;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t length;
+    if (!in.value(&length) || length > 4096) return false;
+    std::string name(length, '\0');
+    float bounds[6];
+    if (!in.read(name.data(), name.size()) || !in.value(&bounds)) return false;
+    auto medium = Hetergeneous::read(in, trilinear);
+    if (!medium) return false;
+    result.emplace_back(name,
+                        FlatGrid{Point3f(bounds[0], bounds[1], bounds[2]),
+                                 Point3f(bounds[3], bounds[4], bounds[5]),
+                                 medium});
+  }
+  *grids = std::move(result);
+  return true;
+}
+
+std::unordered_map<std::string, std::shared_ptr<ShapeInterface>> loadVdbFile(
+    const std::string &filePath, float scale, bool trilinear,
+    const std::vector<std::string> &gridNames, bool snapshot,
+    const std::string &directory) {
+  FlatGrids grids;
+  if (!snapshot) {
+    grids = flattenVdbFile(filePath, scale, trilinear);
+  } else {
+    FileIdentity source = FileIdentity::of(filePath);
+    std::string path = snapshotPath(source, directory);
+    if (readSnapshot(path, source, scale, trilinear, &grids)) {
+      std::cout << "Read " << grids.size() << " grids from " << path << "\n";
+    } else {
+      grids = flattenVdbFile(filePath, scale, trilinear);
+      if (!writeSnapshot(path, source, scale, grids))
+        std::cout << "Can't write the grid snapshot " << path << "\n";
+    }
+  }
+  if (grids.empty()) {
+    std::cout << "Error!, no float grid in file\n";
+    std::exit(1);
+  }
+  auto find = [&](const std::string &name) {
+    return std::find_if(grids.begin(), grids.end(),
+                        [&](const auto &grid) { return grid.first == name; });
+  };
+
+  //* The density grid (or the first one) unless the grids are named
+  std::vector<std::string> names = gridNames;
+  if (names.empty())
+    names.emplace_back(find("density") != grids.end() ? "density"
+                                                      : grids.front().first);
+  std::unordered_map<std::string, std::shared_ptr<ShapeInterface>> result;
+  for (const auto &name : names) {
+    auto grid = find(name);
+    if (grid == grids.end()) {
+      std::cout << "Error!, no float grid " << name << " in file\n";
+      std::exit(1);
+    }
+    result[name] = std::make_shared<GridMedium>(
+        grid->second.pMin, grid->second.pMax, grid->second.medium);
+  }
   return result;
 }
 
@@ -2,8 +2,16 @@
 
 #include "shape.h"
 
+//*   Flatten all the float grids of the file, and make media of the ones
+//* named in gridNames. If it's empty, only the density grid (or the first
+//* one) becomes a medium. With snapshot, the flattened grids are kept in a
+//* binary snapshot next to the file (or in directory), which is mapped
+//* instead of reading the file again as long as neither it nor the scale
+//* changes
 std::unordered_map<std::string, std::shared_ptr<ShapeInterface>> loadVdbFile(
-    const std::string &filePath, float scale);
+    const std::string &filePath, float scale, bool trilinear = false,
+    const std::vector<std::string> &gridNames = {}, bool snapshot = false,
+    const std::string &directory = "");
 
 class GridMedium : public ShapeInterface {
  public:
@@ -41,6 +49,12 @@ class GridMedium : public ShapeInterface {
     return {Vector3f{}, Vector3f{}};
   }
 
+  virtual AABB3f getBounds() const override { return AABB3f{mPMin, mPMax}; }
+
+  virtual std::pair<Vector3f, float> getNormalCone() const override {
+    return {Vector3f{0, 1, 0}, -1};
+  }
+
   friend void rtcGridMediumBoundsFunc(const RTCBoundsFunctionArguments *args);
 
   friend void rtcGridMediumIntersectFunc(
@@ -1,10 +1,54 @@
 #include "mesh.h"
 
+#include <filesystem>
+#include <fstream>
+
+#include "core/math/warp.h"
 #include "core/render-core/sampler.h"
+#include "core/render-core/texelbuffer.h"
+
+static const char SNAPSHOT_MAGIC[8] = {'X', 'L', 'M', 'E', 'S', 'H', '0', '3'};
+
+//* The hash of the path keeps apart the files of the same name
+static std::string snapshotPath(const FileIdentity &source,
+                                const std::string &directory) {
+  std::filesystem::path path(source.path);
+  std::string name =
+      path.filename().string() + "." + source.pathHash() + ".xlmesh";
+  std::filesystem::path parent =
+      directory.empty() ? path.parent_path() : std::filesystem::path(directory);
+  return (parent / name).string();
+}
 
 std::unordered_map<std::string, std::shared_ptr<ShapeInterface>>
-loadObjFile(const std::string &filePath) {
-  std::unordered_map<std::string, std::shared_ptr<ShapeInterface>> result;
+loadObjFile(const std::string &filePath, bool snapshot,
+            const std::string &directory, bool compact) {
+  TriangleMesh::MeshMap result;
+  if (!snapshot) {
+    result = TriangleMesh::importObjFile(filePath);
+  } else {
+    FileIdentity source = FileIdentity::of(filePath);
+    std::string path = snapshotPath(source, directory);
+    if (TriangleMesh::readSnapshot(path, source, &result)) {
+      std::cout << "Read " << result.size() << " meshes from " << path
+                << "\n";
+    } else {
+      result = TriangleMesh::importObjFile(filePath);
+      if (!TriangleMesh::writeSnapshot(path, source, result))
+        std::cout << "Can't write the mesh snapshot " << path << "\n";
+    }
+  }
+  //* The snapshot keeps the float buffers, the meshes are compacted after
+  if (compact)
+    for (auto &[name, mesh] : result) {
+      std::cout << "Mesh : " << name << " ";
+      static_cast<TriangleMesh *>(mesh.get())->compact();
+    }
+  return result;
+}
+
+TriangleMesh::MeshMap TriangleMesh::importObjFile(const std::string &filePath) {
+  MeshMap result;
 
   Assimp::Importer importer;
   const aiScene *ai_scene =
@@ -29,9 +73,12 @@ loadObjFile(const std::string &filePath) {
     }
     //*---------- Parsing vertexes ----------
     int numVertexes = ai_mesh->mNumVertices;
-    triMesh->m_vertexes.resize(3, numVertexes);
-    std::memcpy(triMesh->m_vertexes.data(), ai_mesh->mVertices,
-                numVertexes * sizeof(aiVector3D));
+    auto vectors = [numVertexes](const aiVector3D *source) {
+      std::vector<float> values(3 * numVertexes);
+      std::memcpy(values.data(), source, numVertexes * sizeof(aiVector3D));
+      return values;
+    };
+    triMesh->m_vertexes = vectors(ai_mesh->mVertices);
 
     if (!ai_mesh->HasFaces()) {
       std::cerr << "Mesh with no faces!\n";
@@ -39,31 +86,29 @@ loadObjFile(const std::string &filePath) {
     }
     //*---------- Parsing faces -------------
     int numFaces = ai_mesh->mNumFaces;
-    triMesh->m_faces.reserve(numFaces);
+    std::vector<uint32_t> faces;
+    faces.reserve(3 * numFaces);
     triMesh->m_triangles_distribution =
         std::make_shared<Distribution1D>(numFaces);
     for (int j = 0; j < ai_mesh->mNumFaces; ++j) {
       auto face = ai_mesh->mFaces[j].mIndices;
-      triMesh->m_faces.emplace_back(Point3ui(face[0], face[1], face[2]));
+      faces.insert(faces.end(), {face[0], face[1], face[2]});
     }
+    triMesh->m_faces = std::move(faces);
 
     if (!ai_mesh->HasNormals()) {
       std::cerr << "Mesh with no normals!\n";
       std::exit(1);
     }
     //*--------- Parsing normals -----------
-    triMesh->m_normals.resize(3, numVertexes);
-    std::memcpy(triMesh->m_normals.data(), ai_mesh->mNormals,
-                numVertexes * sizeof(aiVector3D));
+    triMesh->m_normals = vectors(ai_mesh->mNormals);
 
     //*---------- Parsing tangents ---------
     if (!ai_mesh->HasTangentsAndBitangents())
       triMesh->hasTangent = false;
     else {
       triMesh->hasTangent = true;
-      triMesh->m_tangents.resize(3, numVertexes);
-      std::memcpy(triMesh->m_tangents.data(), ai_mesh->mTangents,
-                  numVertexes * sizeof(aiVector3D));
+      triMesh->m_tangents = vectors(ai_mesh->mTangents);
     }
 
     //*----------- Parsing UVs -------------
@@ -71,41 +116,119 @@ loadObjFile(const std::string &filePath) {
       triMesh->hasUV = false;
     else {
       triMesh->hasUV = true;
-      triMesh->m_UVs.reserve(numVertexes);
+      std::vector<float> uvs;
+      uvs.reserve(2 * numVertexes);
       auto &uv = ai_mesh->mTextureCoords[0];
       for (int j = 0; j < numVertexes; ++j) {
-        triMesh->m_UVs.emplace_back(Point2f(uv[j][0], uv[j][1]));
+        uvs.insert(uvs.end(), {uv[j][0], uv[j][1]});
       }
+      triMesh->m_UVs = std::move(uvs);
     }
     result[ai_mesh->mName.C_Str()] = triMesh;
   }
   return result;
 }
 
+//*   The snapshot is the magic, the identity of the source and the mesh
+//* count, then for each mesh the length of its name, the name and the flags
+//* of the optional buffers, followed by its vertexes, normals, tangents,
+//* faces and uvs as aligned arrays, which are used in place once mapped
+bool TriangleMesh::writeSnapshot(const std::string &path,
+                                 const FileIdentity &source,
+                                 const MeshMap &meshes) {
+  //* Write to a temporary file first, so an interrupted run never leaves a
+  //* broken snapshot behind
+  std::string tmpPath = path + ".tmp";
+  {
+    SnapshotWriter out(tmpPath);
+    if (!out) return false;
+    out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    source.write(out);
+    out.value<uint32_t>(meshes.size());
+    for (const auto &[name, shape] : meshes) {
+      const auto *mesh = static_cast<const TriangleMesh *>(shape.get());
+      uint32_t header[3] = {(uint32_t)name.size(), (uint32_t)mesh->hasTangent,
+                            (uint32_t)mesh->hasUV};
+      out.value(header);
+      out.write(name.data(), name.size());
+      for (const auto *buffer : {&mesh->m_vertexes, &mesh->m_normals,
+                                 &mesh->m_tangents, &mesh->m_UVs})
+        out.array(buffer->data(), buffer->size());
+      out.array(mesh->m_faces.data(), mesh->m_faces.size());
+    }
+    if (!out) return false;
+  }
+  std::error_code error;
+  std::filesystem::rename(tmpPath, path, error);
+  return !error;
+}
+
+bool TriangleMesh::readSnapshot(const std::string &path,
+                                const FileIdentity &source, MeshMap *meshes) {
+  auto file = MappedFile::open(path);
+  if (!file) return false;
+  SnapshotReader in(file);
+
+  char magic[8];
+  FileIdentity snapshotSource;
+  uint32_t count;
+  if (!in.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+      !snapshotSource.read(in) || !in.value(&count))
+    return false;
+  //* Without the source, the snapshot is all there is
+  if (source.exists && !(snapshotSource == source)) return false;
+
+  MeshMap result;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t header[3];
+    if (!in.value(&header) || header[0] > 4096) return false;
+    std::string name(header[0], '\0');
+    auto mesh = std::make_shared<TriangleMesh>();
+    if (!in.read(name.data(), name.size()) || !in.array(&mesh->m_vertexes) ||
+        !in.array(&mesh->m_normals) || !in.array(&mesh->m_tangents) ||
+        !in.array(&mesh->m_UVs) || !in.array(&mesh->m_faces))
+      return false;
+    mesh->hasTangent = header[1];
+    mesh->hasUV = header[2];
+    //* A corrupted snapshot must not read out of the buffers
+    size_t numVertexes = mesh->m_vertexes.size() / 3;
+    if (mesh->m_vertexes.size() % 3 != 0 || mesh->m_faces.size() % 3 != 0 ||
+        mesh->m_normals.size() != 3 * numVertexes ||
+        mesh->m_tangents.size() != (mesh->hasTangent ? 3 * numVertexes : 0) ||
+        mesh->m_UVs.size() != (mesh->hasUV ? 2 * numVertexes : 0))
+      return false;
+    for (uint32_t index : mesh->m_faces)
+      if (index >= numVertexes) return false;
+    mesh->m_triangles_distribution =
+        std::make_shared<Distribution1D>(mesh->faceCount());
+    result[name] = mesh;
+  }
+  *meshes = std::move(result);
+  return true;
+}
+
 void TriangleMesh::initEmbreeGeometry(RTCDevice device) {
   this->embreeGeometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
 
   float *vertexes = (float *)rtcSetNewGeometryBuffer(
       this->embreeGeometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
-      3 * sizeof(float), m_vertexes.cols());
+      3 * sizeof(float), vertexCount());
 
   // brute-force copy
-  for (int i = 0; i < m_vertexes.cols(); ++i) {
-    vertexes[i * 3 + 0] = m_vertexes.col(i).x();
-    vertexes[i * 3 + 1] = m_vertexes.col(i).y();
-    vertexes[i * 3 + 2] = m_vertexes.col(i).z();
-  }
+  std::memcpy(vertexes, m_vertexes.data(), m_vertexes.size() * sizeof(float));
 
   unsigned *faces = (unsigned *)rtcSetNewGeometryBuffer(
       this->embreeGeometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
-      3 * sizeof(unsigned), m_faces.size());
+      3 * sizeof(unsigned), faceCount());
 
   // brute-force copy
   //* compute the triangle distribution
-  for (int i = 0; i < m_faces.size(); ++i) {
-    faces[i * 3 + 0] = m_faces[i].x;
-    faces[i * 3 + 1] = m_faces[i].y;
-    faces[i * 3 + 2] = m_faces[i].z;
+  for (int i = 0; i < faceCount(); ++i) {
+    Point3ui face = getFace(i);
+    faces[i * 3 + 0] = face.x;
+    faces[i * 3 + 1] = face.y;
+    faces[i * 3 + 2] = face.z;
 
     m_triangles_distribution->append(getTriArea(i));
   }
@@ -114,19 +237,128 @@ void TriangleMesh::initEmbreeGeometry(RTCDevice device) {
   rtcCommitGeometry(this->embreeGeometry);
 }
 
+//*   The octahedral encoding of a unit vector, "A survey of efficient
+//* representations for independent unit vectors" (Cigolle et al. 2014). The
+//* vector is projected on the octahedron, whose lower half is folded over
+//* the upper one, and the two coordinates are stored as 16 bits snorm
+static void encodeOctahedral(Vector3f v, uint16_t *encoded) {
+  auto signOf = [](float x) { return x < 0 ? -1.f : 1.f; };
+  float l1 = std::abs(v.x) + std::abs(v.y) + std::abs(v.z);
+  float u = l1 > 0 ? v.x / l1 : 0, w = l1 > 0 ? v.y / l1 : 0;
+  if (v.z < 0) {
+    float fu = (1 - std::abs(w)) * signOf(u),
+          fw = (1 - std::abs(u)) * signOf(w);
+    u = fu;
+    w = fw;
+  }
+  auto quantize = [](float x) {
+    return uint16_t(int16_t(std::round(std::clamp(x, -1.f, 1.f) * 32767)));
+  };
+  encoded[0] = quantize(u);
+  encoded[1] = quantize(w);
+}
+
+static Vector3f decodeOctahedral(const uint16_t *encoded) {
+  auto signOf = [](float x) { return x < 0 ? -1.f : 1.f; };
+  float u = int16_t(encoded[0]) / 32767.f, w = int16_t(encoded[1]) / 32767.f;
+  float z = 1 - std::abs(u) - std::abs(w);
+  if (z < 0) {
+    float fu = (1 - std::abs(w)) * signOf(u),
+          fw = (1 - std::abs(u)) * signOf(w);
+    u = fu;
+    w = fw;
+  }
+  return normalize(Vector3f{u, w, z});
+}
+
+void TriangleMesh::compact() {
+  if (m_compact)
+    return;
+  int numVertexes = vertexCount();
+  size_t before = (m_normals.size() + m_tangents.size() + m_UVs.size()) *
+                      sizeof(float) +
+                  m_faces.size() * sizeof(uint32_t);
+
+  //* The largest angle between a vector and its encoding, in degrees
+  auto encodeAll = [numVertexes](const MappedArray<float> &vectors,
+                                 std::vector<uint16_t> *encoded) {
+    encoded->resize(2 * numVertexes);
+    float minCos = 1;
+    for (int i = 0; i < numVertexes; ++i) {
+      Vector3f v{vectors[3 * i], vectors[3 * i + 1], vectors[3 * i + 2]};
+      if (v.length2() == 0) {
+        encodeOctahedral(Vector3f{0, 0, 1}, &(*encoded)[2 * i]);
+        continue;
+      }
+      v = normalize(v);
+      encodeOctahedral(v, &(*encoded)[2 * i]);
+      minCos = std::min(minCos, dot(v, decodeOctahedral(&(*encoded)[2 * i])));
+    }
+    return std::acos(std::clamp(minCos, -1.f, 1.f)) * 180 / M_PI;
+  };
+  float normalError = encodeAll(m_normals, &m_octNormals), tangentError = 0;
+  if (hasTangent)
+    tangentError = encodeAll(m_tangents, &m_octTangents);
+
+  float uvError = 0;
+  if (hasUV) {
+    m_halfUVs.resize(2 * numVertexes);
+    for (int i = 0; i < numVertexes; ++i) {
+      m_halfUVs[2 * i] = floatToHalf(m_UVs[2 * i]);
+      m_halfUVs[2 * i + 1] = floatToHalf(m_UVs[2 * i + 1]);
+      uvError = std::max(
+          {uvError, std::abs(halfToFloat(m_halfUVs[2 * i]) - m_UVs[2 * i]),
+           std::abs(halfToFloat(m_halfUVs[2 * i + 1]) - m_UVs[2 * i + 1])});
+    }
+  }
+
+  if (numVertexes <= 65536) {
+    m_compactFaces.assign(m_faces.begin(), m_faces.end());
+    m_faces = MappedArray<uint32_t>();
+  }
+
+  m_normals = MappedArray<float>();
+  m_tangents = MappedArray<float>();
+  m_UVs = MappedArray<float>();
+  m_compact = true;
+
+  size_t after = (m_octNormals.size() + m_octTangents.size() +
+                  m_halfUVs.size() + m_compactFaces.size()) *
+                     sizeof(uint16_t) +
+                 m_faces.size() * sizeof(uint32_t);
+  size_t positions = m_vertexes.size() * sizeof(float);
+  std::cout << "compacted from " << (positions + before) / 1024 << " KB to "
+            << (positions + after) / 1024 << " KB, error of normals "
+            << normalError << " deg, tangents " << tangentError
+            << " deg, uvs " << uvError << "\n";
+}
+
 Point3f TriangleMesh::getVertex(int idx) const {
-  auto vertex = m_vertexes.col(idx);
-  return Point3f{vertex.x(), vertex.y(), vertex.z()};
+  const float *vertex = &m_vertexes[3 * idx];
+  return Point3f{vertex[0], vertex[1], vertex[2]};
 }
 
-Point3ui TriangleMesh::getFace(int idx) const { return m_faces[idx]; }
+Point3ui TriangleMesh::getFace(int idx) const {
+  if (m_compactFaces.empty())
+    return Point3ui(m_faces[3 * idx], m_faces[3 * idx + 1],
+                    m_faces[3 * idx + 2]);
+  const uint16_t *face = &m_compactFaces[3 * idx];
+  return Point3ui(face[0], face[1], face[2]);
+}
 
 Normal3f TriangleMesh::getNormal(int idx) const {
-  auto normal = m_normals.col(idx);
-  return Normal3f{normal.x(), normal.y(), normal.z()};
+  if (m_compact)
+    return Normal3f(decodeOctahedral(&m_octNormals[2 * idx]));
+  const float *normal = &m_normals[3 * idx];
+  return Normal3f{normal[0], normal[1], normal[2]};
 }
 
-Point2f TriangleMesh::getUV(int idx) const { return m_UVs[idx]; }
+Point2f TriangleMesh::getUV(int idx) const {
+  if (m_compact)
+    return Point2f(halfToFloat(m_halfUVs[2 * idx]),
+                   halfToFloat(m_halfUVs[2 * idx + 1]));
+  return Point2f(m_UVs[2 * idx], m_UVs[2 * idx + 1]);
+}
 
 float TriangleMesh::getTriArea(int idx) const {
   auto triangle = this->getFace(idx);
@@ -152,8 +384,10 @@ Normal3f TriangleMesh::getHitNormal(int triIdx, Point2f uv) const {
 }
 
 Vector3f TriangleMesh::getTangent(int idx) const {
-  auto tangent = m_tangents.col(idx);
-  return Vector3f{tangent.x(), tangent.y(), tangent.z()};
+  if (m_compact)
+    return decodeOctahedral(&m_octTangents[2 * idx]);
+  const float *tangent = &m_tangents[3 * idx];
+  return Vector3f{tangent[0], tangent[1], tangent[2]};
 }
 
 Vector3f TriangleMesh::getHitTangent(int triIdx, Point2f uv) const {
@@ -218,6 +452,99 @@ void TriangleMesh::sampleOnSurface(PointQueryRecord *pRec,
   pRec->normal = getNormal(triangle.x) * w0 + getNormal(triangle.y) * w1 +
                  getNormal(triangle.z) * w2;
   pRec->pdf = 1 / m_surface_area;
+  pRec->primID = triIdx;
+}
+
+//* Triangles subtending a too small (numerically unstable) or too large solid
+//* angle are sampled by area
+static bool sampleBySolidAngle(float solidAngle) {
+  return 3e-4f <= solidAngle && solidAngle <= 6.22f;
+}
+
+void TriangleMesh::initEmitterSampling() {
+  std::vector<LightBounds> triangleBounds(faceCount());
+  for (int i = 0; i < faceCount(); ++i) {
+    auto [i0, i1, i2] = getFace(i);
+    Point3f p0 = getVertex(i0), p1 = getVertex(i1), p2 = getVertex(i2);
+    Normal3f n0 = getNormal(i0), n1 = getNormal(i1), n2 = getNormal(i2);
+
+    LightBounds &b = triangleBounds[i];
+    b.bounds = AABB3f{p0};
+    b.bounds.expands(p1);
+    b.bounds.expands(p2);
+    Vector3f axis = n0 + n1 + n2;
+    if (axis.length2() < 1e-8) {
+      b.w = Vector3f{0, 1, 0}, b.cosThetaO = -1;
+    } else {
+      b.w = normalize(axis);
+      b.cosThetaO = std::min({dot(b.w, n0), dot(b.w, n1), dot(b.w, n2)});
+    }
+    b.cosThetaE = 0;
+    //* Uniform emission, the area stands for the power
+    b.phi = getTriArea(i);
+    b.twoSided = two_side;
+  }
+  m_triangles_tree.build(triangleBounds);
+}
+
+void TriangleMesh::sampleOnSurface(PointQueryRecord *pRec, Point3f ref,
+                                   Point3f sample) const {
+  if (m_triangles_tree.empty()) {
+    sampleOnSurface(pRec, sample);
+    return;
+  }
+  pRec->pdf = 0;
+  auto [triIdx, pmf] = m_triangles_tree.sample(ref, Vector3f{0}, sample[0]);
+  if (triIdx < 0)
+    return;
+
+  auto [i0, i1, i2] = getFace(triIdx);
+  Point3f v[3] = {getVertex(i0), getVertex(i1), getVertex(i2)};
+  float solidAngle = Warp::sphericalTriangleArea(
+      normalize(v[0] - ref), normalize(v[1] - ref), normalize(v[2] - ref));
+
+  Vector3f bary;
+  float pdfSolidAngle = 0;
+  if (sampleBySolidAngle(solidAngle)) {
+    bary = Warp::squareToSphericalTriangle(Point2f{sample[1], sample[2]}, v,
+                                           ref, &pdfSolidAngle);
+  } else {
+    float x = sample[1], y = sample[2];
+    bary.x = 1 - std::sqrt(1 - x), bary.y = y * std::sqrt(1 - x);
+    bary.z = std::max(.0f, 1 - bary.x - bary.y);
+  }
+
+  pRec->p = v[0] * bary.x + v[1] * bary.y + v[2] * bary.z;
+  pRec->normal = getNormal(i0) * bary.x + getNormal(i1) * bary.y +
+                 getNormal(i2) * bary.z;
+  pRec->primID = triIdx;
+  if (!sampleBySolidAngle(solidAngle)) {
+    pRec->pdf = pmf / getTriArea(triIdx);
+  } else if (pdfSolidAngle != 0) {
+    //* Convert to area measure with the normal used by the emitters
+    Vector3f dir = pRec->p - ref;
+    pRec->pdf = pmf / solidAngle *
+                std::abs(dot(pRec->normal, normalize(dir))) / dir.length2();
+  }
+}
+
+float TriangleMesh::pdfOnSurface(int primID, Point3f point, Normal3f normal,
+                                 Point3f ref) const {
+  if (m_triangles_tree.empty())
+    return 1 / m_surface_area;
+  float pmf = m_triangles_tree.pmf(primID, ref, Vector3f{0});
+  if (pmf == 0)
+    return 0;
+
+  auto [i0, i1, i2] = getFace(primID);
+  Point3f v[3] = {getVertex(i0), getVertex(i1), getVertex(i2)};
+  float solidAngle = Warp::sphericalTriangleArea(
+      normalize(v[0] - ref), normalize(v[1] - ref), normalize(v[2] - ref));
+  if (!sampleBySolidAngle(solidAngle))
+    return pmf / getTriArea(primID);
+  Vector3f dir = point - ref;
+  return pmf / solidAngle * std::abs(dot(normal, normalize(dir))) /
+         dir.length2();
 }
 
 std::pair<Vector3f, Vector3f>
@@ -248,4 +575,46 @@ TriangleMesh::positionDifferential(int triIdx) const {
     Coordinate(n, &dpdu, &dpdv);
   }
   return {dpdu, dpdv};
-}
\ No newline at end of file
+}
+
+AABB3f TriangleMesh::getBounds() const {
+  AABB3f bounds;
+  for (int i = 0; i < vertexCount(); ++i)
+    bounds.expands(getVertex(i));
+  return bounds;
+}
+
+std::pair<Vector3f, float> TriangleMesh::getNormalCone() const {
+  //* The emission side follows the vertex normals (see sampleOnSurface)
+  Vector3f axis{0};
+  for (int i = 0; i < vertexCount(); ++i)
+    axis += getNormal(i);
+  if (axis.length2() < 1e-8)
+    return {Vector3f{0, 1, 0}, -1};
+  axis = normalize(axis);
+
+  float cosTheta = 1;
+  for (int i = 0; i < vertexCount(); ++i)
+    cosTheta = std::min(cosTheta, dot(axis, getNormal(i)));
+  return {axis, cosTheta};
+}
+
+float TriangleMesh::curvature(int triIdx) const {
+  //* The change of the normal along each edge over its length, for a sphere
+  //* of radius r it's 1 / r on all edges
+  auto [i0, i1, i2] = getFace(triIdx);
+  Point3f p[3] = {getVertex(i0), getVertex(i1), getVertex(i2)};
+  Vector3f n[3] = {getNormal(i0), getNormal(i1), getNormal(i2)};
+  float sum = 0;
+  int edges = 0;
+  for (int i = 0; i < 3; ++i) {
+    int j = (i + 1) % 3;
+    Vector3f dp = p[j] - p[i];
+    float length2 = dp.length2();
+    if (length2 == 0)
+      continue;
+    sum += dot(n[j] - n[i], dp) / length2;
+    ++edges;
+  }
+  return edges ? sum / edges : 0;
+}
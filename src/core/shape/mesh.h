@@ -8,10 +8,18 @@
 #include <vector>
 
 #include "core/geometry/geometry.h"
+#include "core/scene/lightbvh.h"
+#include "core/utils/fileidentity.h"
+#include "core/utils/mappedfile.h"
 #include "shape.h"
 
+//*   Import the meshes of the file. With snapshot, the imported buffers are
+//* kept in a binary snapshot next to the file (or in directory), which is
+//* mapped instead of importing the file again as long as it doesn't change.
+//* With compact, the meshes are stored in the compact vertex format
 std::unordered_map<std::string, std::shared_ptr<ShapeInterface>>
-loadObjFile(const std::string &filePath);
+loadObjFile(const std::string &filePath, bool snapshot = false,
+            const std::string &directory = "", bool compact = false);
 
 class TriangleMesh : public ShapeInterface {
 public:
@@ -41,9 +49,23 @@ public:
   virtual void sampleOnSurface(PointQueryRecord *pRec,
                                Point3f sample) const override;
 
+  virtual void sampleOnSurface(PointQueryRecord *pRec, Point3f ref,
+                               Point3f sample) const override;
+
+  virtual float pdfOnSurface(int primID, Point3f point, Normal3f normal,
+                             Point3f ref) const override;
+
+  virtual void initEmitterSampling() override;
+
   virtual std::pair<Vector3f, Vector3f>
   positionDifferential(int triIdx) const override;
 
+  virtual AABB3f getBounds() const override;
+
+  virtual std::pair<Vector3f, float> getNormalCone() const override;
+
+  virtual float curvature(int triIdx) const override;
+
 protected:
   virtual Point3f getVertex(int idx) const override;
 
@@ -57,17 +79,55 @@ protected:
 
   float getTriArea(int idx) const;
 
+  int vertexCount() const { return m_vertexes.size() / 3; }
+
+  int faceCount() const {
+    return (m_compactFaces.empty() ? m_faces.size() : m_compactFaces.size()) /
+           3;
+  }
+
+  //*   Switch to the compact vertex format : the normals and the tangents in
+  //* 16 bits octahedral coordinates, the uvs in half floats and the indices
+  //* in 16 bits when the vertexes allow it. The positions are kept in floats.
+  //* Reports the memory saved and the largest errors of the encoding
+  void compact();
+
 private:
-  //* data
-  Eigen::MatrixXf m_vertexes;
-  Eigen::MatrixXf m_normals;
-  Eigen::MatrixXf m_tangents; // optional
-  std::vector<Point3ui> m_faces;
-  std::vector<Point2f> m_UVs; // optional
+  //* data, owned or in the mapped snapshot
+  MappedArray<float> m_vertexes; // 3 per vertex
+  MappedArray<float> m_normals;  // 3 per vertex
+  MappedArray<float> m_tangents; // 3 per vertex, optional
+  MappedArray<uint32_t> m_faces; // 3 per face
+  MappedArray<float> m_UVs;      // 2 per vertex, optional
+
+  //* The compact vertex format, the float buffers above are then empty but
+  //* for the positions
+  bool m_compact = false;
+  std::vector<uint16_t> m_octNormals;  // 2 per vertex
+  std::vector<uint16_t> m_octTangents; // 2 per vertex, optional
+  std::vector<uint16_t> m_halfUVs;     // 2 per vertex, optional
+  std::vector<uint16_t> m_compactFaces; // 3 per face, if the indices fit
 
   std::shared_ptr<Distribution1D> m_triangles_distribution;
+  //* Chooses the triangles with respect to a reference point, only built
+  //* for emitters
+  LightBoundsTree m_triangles_tree;
+
+  using MeshMap =
+      std::unordered_map<std::string, std::shared_ptr<ShapeInterface>>;
+
+  static MeshMap importObjFile(const std::string &filePath);
+
+  //* The buffers of the meshes in a binary file
+  static bool writeSnapshot(const std::string &path,
+                            const FileIdentity &source, const MeshMap &meshes);
+
+  //*   Map the snapshot, the buffers of the meshes point into the mapping.
+  //* False if it's invalid or taken from another version of source
+  static bool readSnapshot(const std::string &path,
+                           const FileIdentity &source, MeshMap *meshes);
 
   //* friend function
   friend std::unordered_map<std::string, std::shared_ptr<ShapeInterface>>
-  loadObjFile(const std::string &);
+  loadObjFile(const std::string &, bool, const std::string &, bool);
 };
@@ -49,8 +49,35 @@ public:
   virtual void sampleOnSurface(PointQueryRecord *pRec,
                                Point3f sample) const = 0;
 
+  //* Sample a point with respect to the reference point, pRec->pdf is in area
+  //* measure with respect to pRec->normal. Sample by area by default
+  virtual void sampleOnSurface(PointQueryRecord *pRec, Point3f ref,
+                               Point3f sample) const {
+    sampleOnSurface(pRec, sample);
+  }
+
+  //* The pdf (in area measure with respect to normal) that the method above
+  //* samples point on the primitive primID
+  virtual float pdfOnSurface(int primID, Point3f point, Normal3f normal,
+                             Point3f ref) const {
+    return 1.f / m_surface_area;
+  }
+
+  //* Prepare the sampling with respect to a reference point, called once the
+  //* shape is bound to an emitter
+  virtual void initEmitterSampling() {}
+
   float getSurfaceArea() const { return m_surface_area; }
 
+  virtual AABB3f getBounds() const = 0;
+
+  //* Return the axis and the cosine of the cone which bounds all normals
+  virtual std::pair<Vector3f, float> getNormalCone() const = 0;
+
+  //*   The curvature of the primitive estimated from its vertex normals,
+  //* positive where the normals diverge. It widens the ray cones
+  virtual float curvature(int triIdx) const { return 0; }
+
   void setBSDF(std::shared_ptr<BSDF> bsdf) { this->bsdf = bsdf; }
 
   void setBSSRDF(std::shared_ptr<BSSRDF> bssrdf) { this->bssrdf = bssrdf; }
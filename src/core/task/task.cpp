@@ -1,10 +1,18 @@
 #include "task.h"
 
+#include <tbb/parallel_for.h>
+#include <tbb/task_group.h>
+
+#include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <mutex>
 
+#include "core/render-core/assetcache.h"
 #include "core/render-core/film.h"
+#include "core/render-core/texturecache.h"
 #include "core/shape/gridmedium.h"
 #include "core/shape/mesh.h"
 #include "core/utils/configurable.h"
@@ -72,169 +80,308 @@ void configureOutPut(std::shared_ptr<RenderTask> task,
   std::cout << "spp : " << task->spp << std::endl;
 }
 
-void configureScene(std::shared_ptr<RenderTask> task,
-                    const rapidjson::Value &config) {
-  std::cout << "====== Configure scene =====\n";
-
-  const auto &textures = config["textures"].GetArray();
-  for (int i = 0; i < textures.Size(); ++i) {
-    const auto &texture = textures[i].GetObject();
-    const auto &textureName = texture["name"].GetString();
-    const auto &textureType = texture["type"].GetString();
-    std::shared_ptr<Texture> texture_ptr(static_cast<Texture *>(
-        ObjectFactory::createInstance(textureType, texture)));
-    task->textures[textureName] = texture_ptr;
+//*   The wall clock time of the phases of the scene loading. The phases run
+//* concurrently overlap, the total is the time of the whole loading
+class PhaseTimer {
+ public:
+  PhaseTimer() : begin(std::chrono::steady_clock::now()) {}
+
+  template <typename F> void run(const std::string &phase, F &&f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::lock_guard<std::mutex> lock(mutex);
+    phases.emplace_back(phase, seconds(start));
   }
 
-  std::cout << task->textures.size() << " textures configured\n";
-
-  const auto &bsdfs = config["bsdfs"].GetArray();
-  for (int i = 0; i < bsdfs.Size(); ++i) {
-    const auto &bsdf = bsdfs[i].GetObject();
-    const auto &bsdfName = bsdf["name"].GetString();
-    const auto &bsdfType = bsdf["type"].GetString();
-    std::shared_ptr<BSDF> bsdf_ptr{
-        static_cast<BSDF *>(ObjectFactory::createInstance(bsdfType, bsdf))};
+  void report() const {
+    std::cout << "===== Scene loading =====\n";
+    for (const auto &[phase, time] : phases)
+      std::cout << phase << " : " << time << "s\n";
+    std::cout << "total : " << seconds(begin) << "s\n";
+  }
 
-    if (bsdf.HasMember("textureRef")) {
-      const auto &textureRef = bsdf["textureRef"].GetString();
-      bsdf_ptr->setTexture(task->getTexture(textureRef));
-    }
-    if (bsdf.HasMember("normalmapRef")) {
-      const auto &normalRef = bsdf["normalmapRef"].GetString();
-      bsdf_ptr->setNormalmap(task->getTexture(normalRef));
-    }
-    // TODO add bumpmap and normalmap
-    task->bsdfs[bsdfName] = bsdf_ptr;
-    // TODO fix it
-    bsdf_ptr->initialize();
+ private:
+  static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
   }
 
-  std::cout << task->bsdfs.size() << " bsdfs configured\n";
-
-  const auto &emitters = config["emitters"].GetArray();
-  for (int i = 0; i < emitters.Size(); ++i) {
-    const auto &emitter = emitters[i].GetObject();
-    const auto &emitterType = emitter["type"].GetString();
-    if (std::strcmp(emitterType, "envemitter") == 0) {
-      const auto &textureRef = emitter["textureRef"].GetString();
-      auto texture = task->getTexture(textureRef);
-      // TODO set envmap
-      std::shared_ptr<Emitter> envEmitter{static_cast<Emitter *>(
-          ObjectFactory::createInstance("envemitter", emitter))};
-      envEmitter->setTexture(texture.get());
-      task->scene->setEnvMap(envEmitter);
-      task->scene->addEmitter(envEmitter);
-    } else if (std::strcmp("area", emitterType) == 0) {
-      std::cout << "Area light should be declared directly in mesh!\n";
-      std::exit(1);
-    } else {
-      //* Spot, directional etc...
-      const auto &emitterName = emitter["name"].GetString();
-      std::shared_ptr<Emitter> emitter_ptr{static_cast<Emitter *>(
-          ObjectFactory::createInstance(emitterType, emitter))};
-      task->scene->addEmitter(emitter_ptr);
-    }
+  std::chrono::steady_clock::time_point begin;
+  std::mutex mutex;
+  std::vector<std::pair<std::string, double>> phases;
+};
+
+using ShapeMap =
+    std::unordered_map<std::string, std::shared_ptr<ShapeInterface>>;
+
+//* The float grids of a grid-medium entity as media
+static ShapeMap loadGridEntity(const rapidjson::Value &entity, bool snapshot,
+                               const std::string &snapshotDirectory) {
+  float scale = entity["scale"].GetFloat();
+  //* Nearest voxel lookup by default, trilinear is smoother but slower
+  bool trilinear =
+      entity.HasMember("trilinear") && entity["trilinear"].GetBool();
+  //* The density grid becomes the medium, the others only if named here
+  std::vector<std::string> gridNames;
+  if (entity.HasMember("grids"))
+    for (const auto &name : entity["grids"].GetArray())
+      gridNames.emplace_back(name.GetString());
+  return loadVdbFile(entity["filepath"].GetString(), scale, trilinear,
+                     gridNames, snapshot, snapshotDirectory);
+}
+
+void configureScene(std::shared_ptr<RenderTask> task,
+                    const rapidjson::Value &config) {
+  std::cout << "====== Configure scene =====\n";
+  PhaseTimer timer;
+
+  //* The image textures go through the out of core cache when it has a
+  //* budget, given in MB
+  if (config.HasMember("textureCache")) {
+    const auto &cache = config["textureCache"];
+    Params params(cache);
+    size_t budget = std::max(0, params.fetch<int>("budget", 0));
+    std::string directory =
+        cache.HasMember("directory") ? cache["directory"].GetString() : "";
+    TextureCache::instance().configure(budget << 20, directory);
   }
 
-  std::cout << task->emitters.size() << " emitters configured\n";
-
-  const auto &mediums = config["mediums"].GetArray();
-  for (int i = 0; i < mediums.Size(); ++i) {
-    const auto &medium = mediums[i].GetObject();
-    const auto &mediumType = medium["type"].GetString();
-    const auto &mediumName = medium["name"].GetString();
-    std::shared_ptr<Medium> medium_ptr{static_cast<Medium *>(
-        ObjectFactory::createInstance(mediumType, medium))};
-
-    if (medium.HasMember("phase")) {
-      const auto &phaseType = medium["phase"]["type"].GetString();
-      std::shared_ptr<PhaseFunction> phase{
-          static_cast<PhaseFunction *>(ObjectFactory::createInstance(
-              phaseType, medium["phase"].GetObject()))};
-      medium_ptr->setPhase(phase);
-    } else {
-      std::shared_ptr<PhaseFunction> phase{static_cast<PhaseFunction *>(
-          ObjectFactory::createInstance("isotropic", medium))};
-      medium_ptr->setPhase(phase);
+  //*   The imported meshes and the flattened grids are kept in binary
+  //* snapshots, next to the files or in the directory, which the next runs
+  //* map instead of importing them. The image texels persist as tiled files
+  //* only with a textureCache budget (and the mipmaps with their cache), and
+  //* the light and triangle distributions are built again
+  bool snapshot = config.HasMember("snapshot");
+  std::string snapshotDirectory =
+      snapshot && config["snapshot"].HasMember("directory")
+          ? config["snapshot"]["directory"].GetString()
+          : "";
+  if (!snapshotDirectory.empty())
+    std::filesystem::create_directories(snapshotDirectory);
+
+  //*   The files are read first, all at once : the images are decoded, the
+  //* meshes imported and the grids read concurrently, each into its own slot
+  //* so the scene is wired in the order of the description whatever the
+  //* loading order
+  const auto &textures = config["textures"].GetArray();
+  const auto entities = config["entities"].GetArray();
+  std::vector<std::shared_ptr<Texture>> textureList(textures.Size());
+  std::vector<ShapeMap> entityShapes(entities.Size());
+  auto isEntity = [&](int i, const char *type) {
+    return std::strcmp(type, entities[i]["type"].GetString()) == 0;
+  };
+
+  tbb::task_group loading;
+  loading.run([&] {
+    timer.run("textures", [&] {
+      tbb::parallel_for(0, (int)textures.Size(), [&](int i) {
+        const auto &texture = textures[i].GetObject();
+        const auto &textureType = texture["type"].GetString();
+        textureList[i].reset(static_cast<Texture *>(
+            ObjectFactory::createInstance(textureType, texture)));
+      });
+    });
+  });
+  loading.run([&] {
+    timer.run("meshes", [&] {
+      tbb::parallel_for(0, (int)entities.Size(), [&](int i) {
+        if (isEntity(i, "geometry-mesh")) {
+          const auto &entity = entities[i];
+          //* The compact vertex format trades a little precision for memory
+          bool compact =
+              entity.HasMember("compact") && entity["compact"].GetBool();
+          entityShapes[i] = loadObjFile(entity["filepath"].GetString(),
+                                        snapshot, snapshotDirectory, compact);
+        }
+      });
+    });
+  });
+  loading.run([&] {
+    timer.run("volumes", [&] {
+      tbb::parallel_for(0, (int)entities.Size(), [&](int i) {
+        if (isEntity(i, "grid-medium"))
+          entityShapes[i] =
+              loadGridEntity(entities[i], snapshot, snapshotDirectory);
+      });
+    });
+  });
+  loading.wait();
+
+  for (int i = 0; i < textures.Size(); ++i)
+    task->textures[textures[i]["name"].GetString()] = textureList[i];
+
+  std::cout << task->textures.size() << " textures configured, "
+            << AssetCache::instance().uniqueAssets() << " unique assets\n";
+
+  //* The shapes in the order of the description, their geometries are built
+  //* at once after the wiring
+  std::vector<std::shared_ptr<ShapeInterface>> shapes;
+  timer.run("wiring", [&] {
+    const auto &bsdfs = config["bsdfs"].GetArray();
+    for (int i = 0; i < bsdfs.Size(); ++i) {
+      const auto &bsdf = bsdfs[i].GetObject();
+      const auto &bsdfName = bsdf["name"].GetString();
+      const auto &bsdfType = bsdf["type"].GetString();
+      std::shared_ptr<BSDF> bsdf_ptr{
+          static_cast<BSDF *>(ObjectFactory::createInstance(bsdfType, bsdf))};
+
+      if (bsdf.HasMember("textureRef")) {
+        const auto &textureRef = bsdf["textureRef"].GetString();
+        bsdf_ptr->setTexture(task->getTexture(textureRef));
+      }
+      if (bsdf.HasMember("normalmapRef")) {
+        const auto &normalRef = bsdf["normalmapRef"].GetString();
+        bsdf_ptr->setNormalmap(task->getTexture(normalRef));
+      }
+      // TODO add bumpmap and normalmap
+      task->bsdfs[bsdfName] = bsdf_ptr;
+      // TODO fix it
+      bsdf_ptr->initialize();
     }
-    task->mediums[mediumName] = medium_ptr;
 
-    if (medium.HasMember("isEnv")) {
-      bool isEnv = medium["isEnv"].GetBool();
-      if (isEnv) {
-        task->scene->setEnvMedium(medium_ptr);
+    std::cout << task->bsdfs.size() << " bsdfs configured\n";
+
+    const auto &emitters = config["emitters"].GetArray();
+    for (int i = 0; i < emitters.Size(); ++i) {
+      const auto &emitter = emitters[i].GetObject();
+      const auto &emitterType = emitter["type"].GetString();
+      if (std::strcmp(emitterType, "envemitter") == 0) {
+        const auto &textureRef = emitter["textureRef"].GetString();
+        auto texture = task->getTexture(textureRef);
+        // TODO set envmap
+        std::shared_ptr<Emitter> envEmitter{static_cast<Emitter *>(
+            ObjectFactory::createInstance("envemitter", emitter))};
+        envEmitter->setTexture(texture.get());
+        task->scene->setEnvMap(envEmitter);
+        task->scene->addEmitter(envEmitter);
+      } else if (std::strcmp("area", emitterType) == 0) {
+        std::cout << "Area light should be declared directly in mesh!\n";
+        std::exit(1);
+      } else {
+        //* Spot, directional etc...
+        const auto &emitterName = emitter["name"].GetString();
+        std::shared_ptr<Emitter> emitter_ptr{static_cast<Emitter *>(
+            ObjectFactory::createInstance(emitterType, emitter))};
+        task->scene->addEmitter(emitter_ptr);
       }
     }
-  }
-  std::cout << task->mediums.size() << " mediums configured\n";
 
-  const auto entities = config["entities"].GetArray();
-  for (int i = 0; i < entities.Size(); ++i) {
-    const auto &entity = entities[i].GetObject();
-    const auto &filepath = entity["filepath"].GetString();
-    const auto &fileType = entity["type"].GetString();
-    if (std::strcmp("geometry-mesh", fileType) == 0) {
-      const auto &meshes = loadObjFile(filepath);
-      for (auto mesh : meshes) {
-        task->scene->addShape(mesh.second);
+    std::cout << task->emitters.size() << " emitters configured\n";
+
+    const auto &mediums = config["mediums"].GetArray();
+    for (int i = 0; i < mediums.Size(); ++i) {
+      const auto &medium = mediums[i].GetObject();
+      const auto &mediumType = medium["type"].GetString();
+      const auto &mediumName = medium["name"].GetString();
+      std::shared_ptr<Medium> medium_ptr{static_cast<Medium *>(
+          ObjectFactory::createInstance(mediumType, medium))};
+
+      if (medium.HasMember("phase")) {
+        const auto &phaseType = medium["phase"]["type"].GetString();
+        std::shared_ptr<PhaseFunction> phase{
+            static_cast<PhaseFunction *>(ObjectFactory::createInstance(
+                phaseType, medium["phase"].GetObject()))};
+        medium_ptr->setPhase(phase);
+      } else {
+        std::shared_ptr<PhaseFunction> phase{static_cast<PhaseFunction *>(
+            ObjectFactory::createInstance("isotropic", medium))};
+        medium_ptr->setPhase(phase);
       }
-      const auto meshProperties = entity["meshProperties"].GetArray();
-      for (int i = 0; i < meshProperties.Size(); ++i) {
-        const auto &property = meshProperties[i].GetObject();
-        const auto &meshName = property["meshName"].GetString();
-        auto mesh = meshes.find(meshName);
-        if (mesh == meshes.end()) {
-          std::cerr << "No such a mesh : \"" << meshName << "\"\n";
-          std::exit(1);
-        }
-        if (property.HasMember("emitter")) {
-          auto emitter = property["emitter"].GetObject();
-          auto emitterType = emitter["type"].GetString();
-
-          std::shared_ptr<Emitter> emitter_ptr{static_cast<Emitter *>(
-              ObjectFactory::createInstance(emitterType, emitter))};
-          emitter_ptr->shape = mesh->second;
-          mesh->second->setEmitter(emitter_ptr);
-          mesh->second->setBSDF(std::make_shared<BlackHole>());
-          task->scene->addEmitter(emitter_ptr);
+      task->mediums[mediumName] = medium_ptr;
+
+      if (medium.HasMember("isEnv")) {
+        bool isEnv = medium["isEnv"].GetBool();
+        if (isEnv) {
+          task->scene->setEnvMedium(medium_ptr);
         }
-        if (property.HasMember("BSDFRef")) {
-          const auto &bsdfName = property["BSDFRef"].GetString();
-          auto bsdf = task->getBSDF(bsdfName);
-          mesh->second->setBSDF(bsdf);
+      }
+    }
+    std::cout << task->mediums.size() << " mediums configured\n";
+
+    for (int i = 0; i < entities.Size(); ++i) {
+      const auto &entity = entities[i].GetObject();
+      const auto &meshes = entityShapes[i];
+      if (isEntity(i, "geometry-mesh")) {
+        for (auto mesh : meshes) {
+          shapes.emplace_back(mesh.second);
         }
-        if (property.HasMember("mediumRef")) {
-          const auto mediumName = property["mediumRef"].GetString();
-          auto medium = task->getMedium(mediumName);
-          mesh->second->setMedium(medium);
+        const auto meshProperties = entity["meshProperties"].GetArray();
+        for (int i = 0; i < meshProperties.Size(); ++i) {
+          const auto &property = meshProperties[i].GetObject();
+          const auto &meshName = property["meshName"].GetString();
+          auto mesh = meshes.find(meshName);
+          if (mesh == meshes.end()) {
+            std::cerr << "No such a mesh : \"" << meshName << "\"\n";
+            std::exit(1);
+          }
+          if (property.HasMember("emitter")) {
+            auto emitter = property["emitter"].GetObject();
+            auto emitterType = emitter["type"].GetString();
+
+            std::shared_ptr<Emitter> emitter_ptr{static_cast<Emitter *>(
+                ObjectFactory::createInstance(emitterType, emitter))};
+            emitter_ptr->shape = mesh->second;
+            mesh->second->setEmitter(emitter_ptr);
+            mesh->second->setBSDF(std::make_shared<BlackHole>());
+            task->scene->addEmitter(emitter_ptr);
+          }
+          if (property.HasMember("BSDFRef")) {
+            const auto &bsdfName = property["BSDFRef"].GetString();
+            auto bsdf = task->getBSDF(bsdfName);
+            mesh->second->setBSDF(bsdf);
+          }
+          if (property.HasMember("mediumRef")) {
+            const auto mediumName = property["mediumRef"].GetString();
+            auto medium = task->getMedium(mediumName);
+            mesh->second->setMedium(medium);
+          }
+          if (property.HasMember("twoSide")) {
+            bool twoSide = property["twoSide"].GetBool();
+            mesh->second->two_side = true;
+          }
+          if (property.HasMember("BSSRDF")) {
+            bool bssrdf = property["BSSRDF"].GetBool();
+            std::shared_ptr<BSSRDF> bssrdf_ptr{static_cast<BSSRDF *>(
+                ObjectFactory::createInstance("seperate", property))};
+            if (bssrdf)
+              mesh->second->setBSSRDF(bssrdf_ptr);
+          }
         }
-        if (property.HasMember("twoSide")) {
-          bool twoSide = property["twoSide"].GetBool();
-          mesh->second->two_side = true;
+      } else if (isEntity(i, "grid-medium")) {
+        //* The estimator of the transmittance of the shadow rays
+        Medium::TrEstimator estimator = Medium::TrEstimator::Ratio;
+        if (entity.HasMember("transmittance")) {
+          std::string name = entity["transmittance"].GetString();
+          if (name == "delta") {
+            estimator = Medium::TrEstimator::Delta;
+          } else if (name == "residual-ratio") {
+            estimator = Medium::TrEstimator::ResidualRatio;
+          } else if (name != "ratio") {
+            std::cout << "Unsupported transmittance estimator " << name
+                      << "\n";
+            std::exit(1);
+          }
         }
-        if (property.HasMember("BSSRDF")) {
-          bool bssrdf = property["BSSRDF"].GetBool();
-          std::shared_ptr<BSSRDF> bssrdf_ptr{static_cast<BSSRDF *>(
-              ObjectFactory::createInstance("seperate", property))};
-          if (bssrdf)
-            mesh->second->setBSSRDF(bssrdf_ptr);
+        for (auto grid : meshes) {
+          auto empty = task->getBSDF("empty_bsdf");
+          grid.second->setBSDF(empty);
+          shapes.emplace_back(grid.second);
+          std::shared_ptr<PhaseFunction> phase{static_cast<PhaseFunction *>(
+              ObjectFactory::createInstance("isotropic", entity))};
+          grid.second->getInsideMedium()->setPhase(phase);
+          grid.second->getInsideMedium()->setTrEstimator(estimator);
         }
       }
-    } else if (std::strcmp("grid-medium", fileType) == 0) {
-      float scale = entity["scale"].GetFloat();
-      const auto &grids = loadVdbFile(filepath, scale);
-      for (auto grid : grids) {
-        auto empty = task->getBSDF("empty_bsdf");
-        grid.second->setBSDF(empty);
-        task->scene->addShape(grid.second);
-        std::shared_ptr<PhaseFunction> phase{static_cast<PhaseFunction *>(
-            ObjectFactory::createInstance("isotropic", entity))};
-        grid.second->getInsideMedium()->setPhase(phase);
-      }
     }
-  }
-  task->scene->postProcess();
+  });
+
+  //* The embree geometries of the shapes, then the acceleration structure and
+  //* the sampling structures of the emitters
+  timer.run("geometry", [&] { task->scene->addShapes(shapes); });
+  timer.run("acceleration and emitters",
+            [&] { task->scene->postProcess(); });
+  timer.report();
 }
 
 void configureRenderer(std::shared_ptr<RenderTask> task,
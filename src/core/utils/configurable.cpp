@@ -59,4 +59,10 @@ template <>
 int Params::fetch(const std::string &key, int default_value) const {
   if (!value.HasMember(key.c_str())) return default_value;
   return value[key.c_str()].GetInt();
-}
\ No newline at end of file
+}
+
+template <>
+bool Params::fetch(const std::string &key, bool default_value) const {
+  if (!value.HasMember(key.c_str())) return default_value;
+  return value[key.c_str()].GetBool();
+}
@@ -37,6 +37,25 @@ class Params {
   static std::map<std::string, std::shared_ptr<Configurable>> ref_cache;
 };
 
+template <>
+Point3f Params::fetch(const std::string &key, Point3f default_value) const;
+
+template <>
+Vector3f Params::fetch(const std::string &key, Vector3f default_value) const;
+
+template <>
+SpectrumRGB Params::fetch(const std::string &key,
+                          SpectrumRGB default_value) const;
+
+template <>
+float Params::fetch(const std::string &key, float default_value) const;
+
+template <>
+int Params::fetch(const std::string &key, int default_value) const;
+
+template <>
+bool Params::fetch(const std::string &key, bool default_value) const;
+
 class Configurable {
  public:
   Configurable() = default;
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+//*   The identity of a source file, its canonical path, size and time of
+//* modification. The files derived from a source (the tiled textures, the
+//* mesh snapshots) store it and are derived again when it changes, and the
+//* hash of the path tells apart the sources of the same name in a shared
+//* directory
+struct FileIdentity {
+  std::string path;
+  uint64_t size = 0;
+  int64_t time = 0;
+  //* False if the source can't be found, e.g. only its derived files shipped
+  bool exists = false;
+
+  static FileIdentity of(const std::string &filepath) {
+    FileIdentity identity;
+    std::error_code error;
+    std::filesystem::path canonical =
+        std::filesystem::weakly_canonical(filepath, error);
+    identity.path = error ? filepath : canonical.string();
+    identity.size = std::filesystem::file_size(identity.path, error);
+    if (error) return identity;
+    identity.time = std::filesystem::last_write_time(identity.path, error)
+                        .time_since_epoch()
+                        .count();
+    identity.exists = !error;
+    return identity;
+  }
+
+  bool operator==(const FileIdentity &rhs) const {
+    return path == rhs.path && size == rhs.size && time == rhs.time;
+  }
+
+  //* The 64 bits FNV-1a hash of the canonical path, in hexadecimal
+  std::string pathHash() const {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : path) {
+      hash ^= (uint8_t)c;
+      hash *= 0x100000001b3ull;
+    }
+    std::ostringstream out;
+    out << std::hex << hash;
+    return out.str();
+  }
+
+  //* The key of the source in the in-memory caches
+  std::string key() const {
+    return path + "|" + std::to_string(size) + "|" + std::to_string(time);
+  }
+
+  //* To a std::ostream or a SnapshotWriter
+  template <typename Stream>
+  void write(Stream &out) const {
+    uint32_t length = path.size();
+    out.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    out.write(path.data(), length);
+    out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    out.write(reinterpret_cast<const char *>(&time), sizeof(time));
+  }
+
+  //* From a std::istream or a SnapshotReader
+  template <typename Stream>
+  bool read(Stream &in) {
+    uint32_t length = 0;
+    in.read(reinterpret_cast<char *>(&length), sizeof(length));
+    if (!in || length > 4096) return false;
+    path.resize(length);
+    in.read(path.data(), length);
+    in.read(reinterpret_cast<char *>(&size), sizeof(size));
+    in.read(reinterpret_cast<char *>(&time), sizeof(time));
+    exists = true;
+    return bool(in);
+  }
+};
@@ -0,0 +1,169 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+//*   A file mapped read-only in memory. The pages come from the page cache,
+//* so the processes mapping the same file share them, and they are only read
+//* from the disk when touched
+class MappedFile {
+ public:
+  //* Nullptr if the file can't be opened or is empty
+  static std::shared_ptr<const MappedFile> open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat status;
+    void *address = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && status.st_size > 0)
+      address = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    //* The mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (address == MAP_FAILED) return nullptr;
+    return std::shared_ptr<const MappedFile>(
+        new MappedFile((const char *)address, status.st_size));
+  }
+
+  ~MappedFile() { munmap((void *)address, length); }
+
+  MappedFile(const MappedFile &) = delete;
+
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return address; }
+
+  size_t size() const { return length; }
+
+ private:
+  MappedFile(const char *_address, size_t _length)
+      : address(_address), length(_length) {}
+
+  const char *address;
+  size_t length;
+};
+
+//*   A read-only array, either owned or pointing into a mapped file which it
+//* keeps alive. The copies share the elements
+template <typename T>
+class MappedArray {
+ public:
+  MappedArray() = default;
+
+  MappedArray(std::vector<T> values) {
+    auto owned = std::make_shared<std::vector<T>>(std::move(values));
+    elements = owned->data();
+    count = owned->size();
+    owner = std::move(owned);
+  }
+
+  MappedArray(std::shared_ptr<const MappedFile> file, size_t offset,
+              size_t _count)
+      : elements(reinterpret_cast<const T *>(file->data() + offset)),
+        count(_count),
+        owner(std::move(file)) {}
+
+  const T &operator[](size_t i) const { return elements[i]; }
+
+  const T *data() const { return elements; }
+
+  size_t size() const { return count; }
+
+  bool empty() const { return count == 0; }
+
+  const T *begin() const { return elements; }
+
+  const T *end() const { return elements + count; }
+
+ private:
+  const T *elements = nullptr;
+  size_t count = 0;
+  std::shared_ptr<const void> owner;
+};
+
+//*   The arrays of a snapshot start on ALIGNMENT bytes, so once the file is
+//* mapped (on a page boundary) they can be used in place
+static constexpr size_t SNAPSHOT_ALIGNMENT = 16;
+
+//* Writes a snapshot, padding before each array
+class SnapshotWriter {
+ public:
+  SnapshotWriter(const std::string &path)
+      : out(path, std::ios::binary | std::ios::trunc) {}
+
+  SnapshotWriter &write(const char *data, size_t bytes) {
+    out.write(data, bytes);
+    offset += bytes;
+    return *this;
+  }
+
+  template <typename T>
+  void value(const T &v) {
+    write(reinterpret_cast<const char *>(&v), sizeof(T));
+  }
+
+  //* The element count, then the elements aligned
+  template <typename T>
+  void array(const T *elements, size_t count) {
+    value<uint64_t>(count);
+    static const char padding[SNAPSHOT_ALIGNMENT] = {};
+    write(padding, (SNAPSHOT_ALIGNMENT - offset % SNAPSHOT_ALIGNMENT) %
+                       SNAPSHOT_ALIGNMENT);
+    write(reinterpret_cast<const char *>(elements), count * sizeof(T));
+  }
+
+  explicit operator bool() const { return bool(out); }
+
+ private:
+  std::ofstream out;
+  size_t offset = 0;
+};
+
+//* Reads a mapped snapshot, any read past the end fails the reader
+class SnapshotReader {
+ public:
+  SnapshotReader(std::shared_ptr<const MappedFile> _file)
+      : file(std::move(_file)) {}
+
+  SnapshotReader &read(char *data, size_t bytes) {
+    if (!valid || bytes > file->size() - offset) {
+      valid = false;
+      return *this;
+    }
+    std::memcpy(data, file->data() + offset, bytes);
+    offset += bytes;
+    return *this;
+  }
+
+  template <typename T>
+  bool value(T *v) {
+    return bool(read(reinterpret_cast<char *>(v), sizeof(T)));
+  }
+
+  //* The elements stay in the mapping, nothing is copied
+  template <typename T>
+  bool array(MappedArray<T> *elements) {
+    uint64_t count;
+    if (!value(&count)) return false;
+    offset += (SNAPSHOT_ALIGNMENT - offset % SNAPSHOT_ALIGNMENT) %
+              SNAPSHOT_ALIGNMENT;
+    if (offset > file->size() || count > (file->size() - offset) / sizeof(T))
+      return valid = false;
+    *elements = MappedArray<T>(file, offset, count);
+    offset += count * sizeof(T);
+    return true;
+  }
+
+  explicit operator bool() const { return valid; }
+
+ private:
+  std::shared_ptr<const MappedFile> file;
+  size_t offset = 0;
+  bool valid = true;
+};
@@ -2,14 +2,10 @@
 
 #include "core/math/common.h"
 #include "core/render-core/bsdf.h"
+#include "core/render-core/lobes.h"
 class Dielectric : public BSDF {
   float extIOR, intIOR;
 
-  Vector3f refract(const Vector3f &wi, float eta, float cosThetaT) const {
-    float scale = -((cosThetaT < 0) ? (1 / eta) : eta);
-    return Vector3f{wi.x * scale, cosThetaT, wi.z * scale};
-  }
-
 public:
   Dielectric() = default;
 
@@ -33,31 +29,18 @@ public:
   virtual SpectrumRGB sample(BSDFQueryRecord &bRec, const Point2f &sample,
                              float &pdf,
                              ScatterSampleType *type) const override {
-    float cosThetaT;
-
-    float eta = (intIOR / extIOR);
-    float F = Fresnel(Frame::cosTheta(bRec.wi), eta, &cosThetaT);
-
-    if (sample.x <= F) {
-      // reflect
-      bRec.wo = reflect(bRec.wi);
-      // pdf = F;
-      pdf = FINF;
-      *type = ScatterSampleType::SurfaceReflection;
-      // TODO replace with specular reflectance
-      return SpectrumRGB{1.f};
-    } else {
-      // refract
-      bRec.wo = refract(bRec.wi, (intIOR / extIOR), cosThetaT);
-      // pdf = 1 - F;
-      pdf = FINF;
-      *type = ScatterSampleType::SurfaceTransmission;
-      // TODO consider the transmittance and factor
-      return SpectrumRGB{1};
-    }
+    return DielectricLobe::sample(intIOR / extIOR, bRec, sample, pdf, type);
   }
 
   virtual bool isDiffuse() const override { return false; }
+
+  virtual bool isDelta() const override { return true; }
+
+protected:
+  virtual void resolveLobe(MaterialClosure *closure) const override {
+    closure->lobe = MaterialClosure::Lobe::Dielectric;
+    closure->eta = intIOR / extIOR;
+  }
 };
 
 REGISTER_CLASS(Dielectric, "dielectric")
\ No newline at end of file
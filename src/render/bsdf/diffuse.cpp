@@ -1,8 +1,7 @@
 #include <core/render-core/info.h>
 
-#include "core/math/math.h"
-#include "core/math/warp.h"
 #include "core/render-core/bsdf.h"
+#include "core/render-core/lobes.h"
 
 class Diffuse : public BSDF {
  public:
@@ -18,29 +17,24 @@ class Diffuse : public BSDF {
   virtual bool isDiffuse() const override { return true; }
 
   virtual SpectrumRGB evaluate(const BSDFQueryRecord &bRec) const override {
-    if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
-      return SpectrumRGB{.0f};
-    return m_texture->evaluate(bRec.uv, bRec.du, bRec.dv) * INV_PI *
-           std::abs(Frame::cosTheta(bRec.wo));
+    return LambertianLobe::evaluate(evaluateTexture(bRec), bRec);
   }
 
   virtual float pdf(const BSDFQueryRecord &bRec) const override {
-    if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
-      return .0f;
-    return INV_PI * std::abs(Frame::cosTheta(bRec.wo));
+    return LambertianLobe::pdf(bRec);
   }
 
   virtual SpectrumRGB sample(BSDFQueryRecord &bRec, const Point2f &sample,
                              float &pdf,
                              ScatterSampleType *type) const override {
-    if (Frame::cosTheta(bRec.wi) <= 0) {
-      pdf = .0f;
-      return SpectrumRGB{.0f};
-    }
-    bRec.wo = Warp::squareToCosineHemisphere(sample);
-    pdf = INV_PI * std::abs(Frame::cosTheta(bRec.wo));
-    *type = ScatterSampleType::SurfaceReflection;
-    return m_texture->evaluate(bRec.uv, bRec.du, bRec.dv);
+    return LambertianLobe::sample(evaluateTexture(bRec), bRec, sample, pdf,
+                                  type);
+  }
+
+ protected:
+  virtual void resolveLobe(MaterialClosure *closure) const override {
+    if (closure->resolved)
+      closure->lobe = MaterialClosure::Lobe::Lambertian;
   }
 };
 
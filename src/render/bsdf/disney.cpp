@@ -28,21 +28,22 @@ class DisneyDiffuse : public BSDF {
       return SpectrumRGB{.0f};
 
     Vector3f half = normalize(bRec.wi + bRec.wo);
+    SpectrumRGB baseColor = evaluateTexture(bRec);
 
     //* Compute diffuse
     float fd90 = 0.5f + 2 * mRoughness * std::pow(dot(half, bRec.wo), 2);
     float fdi = FresnelDiffuse(fd90, Frame::cosTheta(bRec.wi)),
           fdo = FresnelDiffuse(fd90, Frame::cosTheta(bRec.wo));
 
-    SpectrumRGB diffuse = m_texture->evaluate(bRec.uv) * INV_PI * fdi * fdo *
-                          Frame::cosTheta(bRec.wo);
+    SpectrumRGB diffuse =
+        baseColor * INV_PI * fdi * fdo * Frame::cosTheta(bRec.wo);
 
     //* Compute subsurface
     float fss90 = mRoughness * std::pow(dot(half, bRec.wo), 2);
     float fssi = FresnelSubserface(fss90, Frame::cosTheta(bRec.wi)),
           fsso = FresnelSubserface(fss90, Frame::cosTheta(bRec.wo));
     SpectrumRGB subsurface =
-        m_texture->evaluate(bRec.uv) * INV_PI * 1.25 *
+        baseColor * INV_PI * 1.25 *
         (fssi * fsso *
              (1 / (Frame::cosTheta(bRec.wi) + Frame::cosTheta(bRec.wo)) - 0.5) +
          0.5) *
@@ -106,7 +107,7 @@ class DisneyMetal : public BSDF {
     }
 
     Vector3f half = normalize(bRec.wi + bRec.wo);
-    SpectrumRGB baseColor = m_texture->evaluate(bRec.uv);
+    SpectrumRGB baseColor = evaluateTexture(bRec);
     SpectrumRGB Fresnel = baseColor + SpectrumRGB(1 - baseColor.max()) *
                                           std::pow(1 - dot(half, bRec.wo), 5);
 
@@ -125,7 +126,7 @@ class DisneyMetal : public BSDF {
     pdf = halfPdf / (4 * dot(bRec.wo, half));
     if (pdf == 0) return SpectrumRGB{.0f};
 
-    SpectrumRGB baseColor = m_texture->evaluate(bRec.uv);
+    SpectrumRGB baseColor = evaluateTexture(bRec);
     SpectrumRGB Fresnel = baseColor + SpectrumRGB(1 - baseColor.max()) *
                                           std::pow(1 - dot(half, bRec.wo), 5);
 
@@ -37,7 +37,7 @@ public:
     //    float F =
     // fresnelDielectric(Frame::cosTheta(bRec.wi), (1.f / 1000), cosThetaT);
     // TODO fresnel term
-    return m_texture->evaluate(bRec.uv) * D * G /
+    return evaluateTexture(bRec) * D * G /
            (4.f * Frame::cosTheta(bRec.wo));
   }
 
@@ -1,6 +1,7 @@
 #include <core/render-core/info.h>
 
 #include "core/render-core/bsdf.h"
+#include "core/render-core/lobes.h"
 
 class Mirror : public BSDF {
  public:
@@ -29,14 +30,17 @@ class Mirror : public BSDF {
     //      pdf = .0f;
     //      return SpectrumRGB{.0f};
     //    }
-    *type = ScatterSampleType::SurfaceReflection;
-    bRec.wo = reflect(bRec.wi);
-    pdf = FINF;
-    bRec.isDelta = true;
-    return SpectrumRGB{1.f};
+    return MirrorLobe::sample(bRec, pdf, type);
   }
 
   virtual bool isDiffuse() const override { return false; }
+
+  virtual bool isDelta() const override { return true; }
+
+ protected:
+  virtual void resolveLobe(MaterialClosure *closure) const override {
+    closure->lobe = MaterialClosure::Lobe::Mirror;
+  }
 };
 
 REGISTER_CLASS(Mirror, "mirror")
\ No newline at end of file
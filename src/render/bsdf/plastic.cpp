@@ -33,10 +33,10 @@ public:
   virtual SpectrumRGB evaluate(const BSDFQueryRecord &bRec) const override {
     if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
       return SpectrumRGB{0.f};
-    float diffuse_weight = m_texture->evaluate(bRec.uv).max(),
-          specular_weight = 1 - diffuse_weight;
-    SpectrumRGB diffuse_term = m_texture->evaluate(bRec.uv) * diffuse_weight *
-                               INV_PI * Frame::cosTheta(bRec.wo);
+    SpectrumRGB albedo = evaluateTexture(bRec);
+    float diffuse_weight = albedo.max(), specular_weight = 1 - diffuse_weight;
+    SpectrumRGB diffuse_term =
+        albedo * diffuse_weight * INV_PI * Frame::cosTheta(bRec.wo);
 
     Vector3f m = normalize(bRec.wi + bRec.wo);
     float eta = m_int_eta / m_ext_eta;
@@ -54,7 +54,7 @@ public:
       return .0f;
     Vector3f m = normalize(bRec.wi + bRec.wo);
     float dwh_dho = 0.25f / dot(m, bRec.wo);
-    float diffuse_weight = m_texture->evaluate(bRec.uv).max(),
+    float diffuse_weight = evaluateTexture(bRec).max(),
           specular_weight = 1 - diffuse_weight;
     float specular_pdf =
         specular_weight * Warp::squareToBeckmannPdf(m, m_alpha) * dwh_dho;
@@ -67,7 +67,7 @@ public:
                              ScatterSampleType *type) const override {
     float prob = .5f * (sample[0] + sample[1]);
     float microfacet_pdf;
-    float diffuse_weight = m_texture->evaluate(bRec.uv).max(),
+    float diffuse_weight = evaluateTexture(bRec).max(),
           specular_weight = 1 - diffuse_weight;
     if (prob < specular_weight) {
       // sample according to specular
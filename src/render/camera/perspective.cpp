@@ -83,6 +83,7 @@ public:
         cameraToWorld.rotate(normalize(point_on_film_dy - Point3f(0, 0, 0)));
 
     ray.is_ray_differential = true;
+    ray.cone = RayCone{.0f, pixelSpread(resolution)};
     return ray;
   }
 
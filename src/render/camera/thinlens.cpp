@@ -40,8 +40,12 @@ public:
   virtual Ray3f
   sampleRayDifferential(const Point2i &offset, const Point2i &resolution,
                         const CameraSample &sample) const override {
-    std::cout << "Thinlens::sampleRayDifferential not implement!\n";
-    std::exit(1);
+    //* The cone leaves the lens sample with the spread of a pixel, the
+    //* defocus is integrated by the lens samples
+    Ray3f ray = sampleRay(Vector2i{offset.x, offset.y},
+                          Vector2i{resolution.x, resolution.y}, sample);
+    ray.cone = RayCone{.0f, pixelSpread(resolution)};
+    return ray;
   }
 
   virtual SpectrumRGB sampleWi(Point3f ref_p, Point2f u, Vector3f *wi,
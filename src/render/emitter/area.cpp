@@ -13,6 +13,11 @@ public:
   }
   ~AreaEmitter() = default;
 
+  virtual void initialize() override {
+    if (auto shape_ptr = shape.lock(); shape_ptr)
+      shape_ptr->initEmitterSampling();
+  }
+
   virtual void setTexture(Texture *texture) override {
     //! no implement
     std::cout << "AreaEmitter::setTexture no implement!\n";
@@ -32,7 +37,7 @@ public:
   virtual std::pair<SpectrumRGB, float>
   evaluate(const LightSourceInfo &info, Point3f destination) const override {
     Vector3f light2point = destination - info.position;
-    if (dot(light2point, info.normal) <= 0)
+    if (info.pdf == 0 || dot(light2point, info.normal) <= 0)
       return {SpectrumRGB{0}, .0f};
     float jacob = light2point.length2() /
                   std::abs(dot(info.normal, normalize(light2point))),
@@ -50,7 +55,9 @@ public:
   virtual float pdf(const SurfaceIntersectionInfo &info) const override {
     auto shape_ptr = shape.lock();
     assert(shape_ptr != nullptr);
-    float pdf = 1.f / shape_ptr->getSurfaceArea(),
+    Point3f ref = info.position + info.wi * info.distance;
+    float pdf = shape_ptr->pdfOnSurface(info.primID, info.position,
+                                        info.geometryNormal, ref),
           jacob = info.distance * info.distance /
                   std::abs(dot(info.geometryNormal, info.wi));
     return pdf * jacob;
@@ -61,13 +68,15 @@ public:
     auto shape_ptr = shape.lock();
     assert(shape_ptr != nullptr);
 
+    //* Sample the emissive triangles with respect to the shading point
     PointQueryRecord pRec;
-    shape_ptr->sampleOnSurface(&pRec, sample);
+    shape_ptr->sampleOnSurface(&pRec, info.position, sample);
 
     LightSourceInfo lightInfo;
     lightInfo.lightType = LightSourceInfo::LightType::Area;
     lightInfo.position = pRec.p;
     lightInfo.normal = pRec.normal;
+    lightInfo.primID = pRec.primID;
     lightInfo.direction = normalize(pRec.p - info.position);
     lightInfo.Le = m_lightEnergy;
     lightInfo.pdf = pRec.pdf;
@@ -85,6 +94,7 @@ public:
     lightInfo.lightType = LightSourceInfo::LightType::Area;
     lightInfo.position = pRec.p;
     lightInfo.normal = pRec.normal;
+    lightInfo.primID = pRec.primID;
     lightInfo.pdf = pRec.pdf;
     lightInfo.Le = m_lightEnergy;
     return lightInfo;
@@ -98,6 +108,21 @@ public:
     *pdf_pos = 1 / shape_ptr->getSurfaceArea();
     *pdf_dir = std::abs(dot(light_normal, ray.dir)) * INV_PI;
   }
+
+  virtual std::optional<LightBounds> bounds() const override {
+    auto shape_ptr = shape.lock();
+    assert(shape_ptr != nullptr);
+
+    LightBounds lightBounds;
+    lightBounds.bounds = shape_ptr->getBounds();
+    std::tie(lightBounds.w, lightBounds.cosThetaO) =
+        shape_ptr->getNormalCone();
+    lightBounds.cosThetaE = 0;
+    lightBounds.phi =
+        m_lightEnergy.average() * shape_ptr->getSurfaceArea() * PI;
+    lightBounds.twoSided = shape_ptr->two_side;
+    return lightBounds;
+  }
 };
 
 REGISTER_CLASS(AreaEmitter, "area")
\ No newline at end of file
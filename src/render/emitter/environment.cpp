@@ -9,6 +9,7 @@
 #include "core/render-core/texture.h"
 #include "stb/stb_image_write.h"
 #include <core/math/discretepdf.h>
+#include <tbb/parallel_for.h>
 
 class EnvironmentEmitter : public Emitter {
 public:
@@ -28,7 +29,8 @@ public:
     Vector2i resolution = m_envmap->getResolution();
     int width = resolution.x, height = resolution.y;
     m_env_distribution = std::make_unique<Distribution2D>(height, width);
-    for (int v = 0; v < height; ++v) {
+    //* Each row has its own conditional distribution
+    tbb::parallel_for(0, height, [&](int v) {
       float vp = (float)v / height;
       float sin_theta = std::sin(M_PI * float(v + .5f) / float(height));
       for (int u = 0; u < width; ++u) {
@@ -39,7 +41,7 @@ public:
                       sin_theta;
         m_env_distribution->appendAtX(v, value);
       }
-    }
+    });
     m_env_distribution->normalize();
 
     std::cout << "Finish envmap distribution construction\n";
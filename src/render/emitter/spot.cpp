@@ -1,5 +1,6 @@
 #include <core/render-core/info.h>
 
+#include "core/math/math.h"
 #include "core/render-core/emitter.h"
 
 class SpotEmitter : public Emitter {
@@ -20,7 +21,9 @@ public:
 
   virtual std::pair<SpectrumRGB, float>
   evaluate(const LightSourceInfo &info, Point3f destination) const override {
-    return {lightEnergy / (destination - info.position).length2(), FINF};
+    return {lightEnergy / (destination - info.position).length2() /
+                info.pdfChoice,
+            FINF};
   }
 
   virtual SpectrumRGB
@@ -57,6 +60,16 @@ public:
   virtual void pdf_le(Ray3f ray, Normal3f light_normal, float *pdf_pos,
                       float *pdf_dir) const override {}
 
+  virtual std::optional<LightBounds> bounds() const override {
+    //* Isotropic point emitter, all directions are covered
+    LightBounds lightBounds;
+    lightBounds.bounds = AABB3f{position};
+    lightBounds.cosThetaO = -1;
+    lightBounds.cosThetaE = 0;
+    lightBounds.phi = 4 * PI * lightEnergy.average();
+    return lightBounds;
+  }
+
 protected:
   Point3f position;
   SpectrumRGB lightEnergy;
@@ -0,0 +1,435 @@
+/**
+ * @file bidirpathtracer.h
+ * @brief Bidirectional path tracer, whose sampling of a single sample is
+ * shared with the metropolis integrator
+ *
+ */
+#pragma once
+#include <core/render-core/film.h>
+#include <core/render-core/info.h>
+#include <core/render-core/integrator.h>
+#include <core/task/task.h>
+#include <spdlog/spdlog.h>
+#include <tbb/tbb.h>
+
+//* Preallocated storage of a subpath, reused by all the samples of a tile
+//* The vertices keep the data touched by the connections and the MIS, while
+//* the intersection records, only read to evaluate the bsdf, are kept apart
+struct PathBuffer {
+  PathBuffer(int max_vertices) : vertices(max_vertices), infos(max_vertices) {}
+
+  std::vector<PathVertex> vertices;
+  std::vector<SurfaceIntersectionInfo> infos;
+};
+
+//* All pdf==0 should be consider as delta distribution
+inline float remap0(float f) { return f == 0 ? 1 : f; }
+
+class BidirectionalPathTracer : public Integrator {
+protected:
+  enum class TransportMode { Radiance, Importance };
+
+  int random_walk(const Scene &scene, Sampler *sampler, int max_depth,
+                  TransportMode mode, Ray3f ray, SpectrumRGB beta, float pdf,
+                  PathBuffer *path) const {
+    int bounces = 0;
+
+    //* pdf_fwd represents the pdf of sampling the current vertex (in
+    //* solid-angle measure) by previous vertex
+    //* pdf_rev represents the pdf of sampling the previous vertex (in
+    //* solid-angle measure) by the current vertex
+    float pdf_fwd = pdf, pdf_rev = .0f;
+
+    while (true) {
+      //* When bounces == max_depth, the random walk should terminate
+      if (bounces + 1 > max_depth)
+        break;
+      SurfaceIntersectionInfo *sits = &path->infos[bounces + 1];
+      scene.intersectWithSurface(ray, sits);
+      //* If escape the scene, just terminate
+      // TODO When environment in consideration, this should be expand
+      if (!sits->shape)
+        break;
+
+      ++bounces;
+      //* vertex -> sits
+      //* prev   -> previous vertex
+      PathVertex &vertex = path->vertices[bounces],
+                 &prev = path->vertices[bounces - 1];
+      //* create the current vertex
+      //* beta is the weight when the path arrived this vertex
+      //* pdf is the pdf_fwd (the pdf of sampling this vertex on previous
+      //* vertex with respect to solid-angle)
+      //* prev is the previous path vertex
+      vertex = PathVertex::create_surface(sits, beta, pdf_fwd, prev);
+
+      //* sample a direction of for random walk (in solid-angle measure)
+      auto scatter_info = sits->sampleScatter(sampler->next2D());
+      //* update the ray
+      ray = sits->scatterRay(scene, scatter_info.wo);
+      //* update the pdf_fwd and pdf_prev
+      pdf_fwd = scatter_info.pdf;
+      pdf_rev = sits->pdfScatter(scatter_info.wo, sits->wi);
+      beta *= scatter_info.weight;
+      if (pdf_fwd == FINF) {
+        vertex.delta = true;
+        pdf_fwd = pdf_rev = 0;
+      }
+      prev.pdf_rev = vertex.convert_pdf(pdf_rev, prev);
+      if (beta.isZero())
+        break;
+    }
+    return bounces;
+  }
+
+  int generate_lightpath(const Scene &scene, Sampler *sampler, int max_depth,
+                         PathBuffer *lightpath) const {
+    if (max_depth == 0)
+      return 0;
+    auto light_info = scene.sampleLightSource(sampler);
+
+    if (light_info.lightType == LightSourceInfo::LightType::Environment) {
+      std::cout << "Unhandle situation!\n";
+      std::exit(1);
+    }
+
+    Frame light_local{light_info.normal};
+    Vector3f dir_local = Warp::squareToCosineHemisphere(sampler->next2D()),
+             dir_world = light_local.toWorld(dir_local);
+
+    float pdf_pos = light_info.pdf,
+          pdf_dir = Warp::squareToCosineHemispherePdf(dir_local);
+
+    if (pdf_pos == 0 || pdf_dir == 0)
+      return 0;
+
+    //? What is the pdf_fwd of the light vertex
+    lightpath->vertices[0] = PathVertex::create_light(light_info);
+
+    //* beta = Le(x, dir) * abscos(<light_normal, dir>) / (pdf_pos * pdf_dir)
+    SpectrumRGB beta = light_info.Le *
+                       std::abs(dot(light_info.normal, dir_world)) /
+                       (pdf_pos * pdf_dir);
+
+    Ray3f ray{light_info.position, dir_world};
+    //* Random walk
+    //* Initial pdf = pdf_dir
+    return random_walk(scene, sampler, max_depth - 1, TransportMode::Importance,
+                       ray, beta, pdf_dir, lightpath) +
+           1;
+  }
+
+  int generate_camerapath(const Scene &scene, Sampler *sampler, int max_depth,
+                          const Camera *camera, Ray3f ray,
+                          PathBuffer *camerapath) const {
+    if (max_depth == 0)
+      return 0;
+
+    float pdf_pos, pdf_dir;
+    camerapath->vertices[0] =
+        PathVertex::create_camera(camera, ray, SpectrumRGB{1});
+    camera->pdfWe(ray, &pdf_pos, &pdf_dir);
+
+    //* Random walk
+    return random_walk(scene, sampler, max_depth - 1, TransportMode::Radiance,
+                       ray, SpectrumRGB{1}, pdf_dir, camerapath) +
+           1;
+  }
+
+  //* The light origin is sampled with respect to its neighbour when s == 1
+  //* (light BVH and per-triangle sampling), but uniformly by area from the
+  //* light distribution when the light subpath is traced, so the ratios
+  //* crossing between s == 1 and s > 1 carry the ratio of the two pdfs
+  float pdf_choice_ratio(const Scene &scene, const PathVertex &origin,
+                         const PathVertex &neighbour) const {
+    auto shape_ptr = origin.light->shape.lock();
+    float pdf_nee = origin.pdf_light_origin(scene, &neighbour),
+          pdf_traced = scene.pdfEmitter(origin.light) /
+                       (shape_ptr ? shape_ptr->getSurfaceArea() : 1.f);
+    if (pdf_nee > 0 && pdf_traced > 0)
+      return pdf_nee / pdf_traced;
+    return 1;
+  }
+
+  //*   The MIS weight of strategy (s, t) is 1 / (1 + sum_ri), where ri is
+  //* the ratio between the pdf of another strategy and the current one. The
+  //* ratios are products of pdf_rev / pdf_fwd along the subpath, so the part
+  //* that does not depend on the connection is accumulated once per subpath:
+  //*   camera : sum_k = r_k * (ok_k + sum_{k-1})
+  //*   light  : sum_k = r_k * (ok_k * c_k + sum_{k-1}), c_1 = choice ratio
+  //* where ok_k tells whether the strategy is not blocked by delta vertices
+  void cache_camera_mis(PathVertex *camerapath, int n) const {
+    camerapath[0].mis_sum = 0;
+    for (int k = 1; k < n; ++k) {
+      const PathVertex &vertex = camerapath[k], &prev = camerapath[k - 1];
+      float ok = (!vertex.delta && !prev.delta) ? 1 : 0;
+      camerapath[k].mis_sum = remap0(vertex.pdf_rev) /
+                              remap0(vertex.pdf_fwd) * (ok + prev.mis_sum);
+    }
+  }
+
+  //* Return the choice ratio of the light subpath
+  float cache_light_mis(const Scene &scene, PathVertex *lightpath,
+                        int n) const {
+    float ratio = n > 1 ? pdf_choice_ratio(scene, lightpath[0], lightpath[1])
+                        : 1.f;
+    float prev_sum = 0;
+    for (int k = 0; k < n; ++k) {
+      const PathVertex &vertex = lightpath[k];
+      bool prev_delta = k > 0 ? lightpath[k - 1].delta : vertex.is_delta_light();
+      float ok = (!vertex.delta && !prev_delta) ? 1 : 0;
+      lightpath[k].mis_sum = remap0(vertex.pdf_rev) / remap0(vertex.pdf_fwd) *
+                             (ok * (k == 1 ? ratio : 1) + prev_sum);
+      prev_sum = lightpath[k].mis_sum;
+    }
+    return ratio;
+  }
+
+  float mis_weight(const Scene &scene, const PathVertex *camerapath,
+                   const PathVertex *lightpath, float light_ratio, int t,
+                   int s, const PathVertex &sampled) const {
+
+    //* misw = pdf(current_strategy) / sum(pdf(all_strategy_with_same_length))
+    if (s + t == 2)
+      return 1;
+
+    //* The sampled vertex replaces qs when s == 1 and pt when t == 1
+    const PathVertex *qs = s == 1  ? &sampled
+                           : s > 1 ? &lightpath[s - 1]
+                                   : nullptr,
+                     *pt = t == 1 ? &sampled : &camerapath[t - 1],
+                     *qs_minus = s > 1 ? &lightpath[s - 2] : nullptr,
+                     *pt_minus = t > 1 ? &camerapath[t - 2] : nullptr;
+
+    //* Only the reverse pdfs around the connection differ from the cached
+    float pt_rev = 0, pt_minus_rev = 0, qs_rev = 0, qs_minus_rev = 0;
+    pt_rev = s > 0 ? qs->pdf(scene, qs_minus, pt)
+                   : pt->pdf_light_origin(scene, pt_minus);
+    if (pt_minus)
+      pt_minus_rev =
+          s > 0 ? pt->pdf(scene, qs, pt_minus) : pt->pdf_light(scene, pt_minus);
+    if (qs)
+      qs_rev = pt->pdf(scene, pt_minus, qs);
+    if (qs_minus)
+      qs_minus_rev = qs->pdf(scene, pt, qs_minus);
+
+    float ratio = 1;
+    if (s > 1)
+      ratio = light_ratio;
+    else if (s == 1 && t > 1)
+      ratio = pdf_choice_ratio(scene, sampled, *pt);
+    else if (s == 0)
+      ratio = pdf_choice_ratio(scene, *pt, *pt_minus);
+
+    //* misw = 1 / sum_ri
+    float sum_ri = 0;
+
+    //* Strategies with more light vertices, the connection vertices are
+    //* never delta
+    if (t > 1) {
+      float inner = 0;
+      if (t > 2) {
+        const PathVertex &vertex = camerapath[t - 2],
+                         &prev = camerapath[t - 3];
+        float ok = (!vertex.delta && !prev.delta) ? 1 : 0;
+        inner = remap0(pt_minus_rev) / remap0(vertex.pdf_fwd) *
+                (ok + prev.mis_sum);
+        //* Strategies with s' > 1 trace the light origin
+        if (s <= 1)
+          inner /= ratio;
+      }
+      float first = camerapath[t - 2].delta ? 0 : 1;
+      if (s == 1)
+        first /= ratio;
+      sum_ri += remap0(pt_rev) / remap0(pt->pdf_fwd) * (first + inner);
+    }
+
+    //* Strategies with fewer light vertices, including s' = 0
+    if (s == 1) {
+      float ok = sampled.is_delta_light() ? 0 : 1;
+      sum_ri += ok * remap0(qs_rev) / remap0(sampled.pdf_fwd);
+    } else if (s > 1) {
+      const PathVertex &vertex = lightpath[s - 2];
+      bool prev_delta =
+          s > 2 ? lightpath[s - 3].delta : vertex.is_delta_light();
+      float ok = (!vertex.delta && !prev_delta) ? 1 : 0;
+      float prev_sum = s > 2 ? lightpath[s - 3].mis_sum : 0;
+      float inner = remap0(qs_minus_rev) / remap0(vertex.pdf_fwd) *
+                    (ok * (s == 3 ? ratio : 1) + prev_sum);
+      float first = vertex.delta ? 0 : 1;
+      sum_ri += remap0(qs_rev) / remap0(qs->pdf_fwd) *
+                (first * (s == 2 ? ratio : 1) + inner);
+    }
+
+    return 1 / (1 + sum_ri);
+  }
+
+  SpectrumRGB connect_subpath(const Scene &scene, const Camera *camera,
+                              Point2i resolution, const PathVertex *lightpath,
+                              const PathVertex *camerapath, float light_ratio,
+                              int s, int t, Sampler *sampler,
+                              Point2i *pixel) const {
+    //* connect the given path (identified by s and t)
+    SpectrumRGB L{.0f};
+
+    //* No connection for a camera vertex on infinite light
+    if (t > 1 && s != 0 && camerapath[t - 1].type == VertexType::LightVertex)
+      return SpectrumRGB{.0f};
+    //* For a totally camerapath, if the vertex laies on light source, this
+    //* should be consider
+
+    PathVertex sampled;
+    if (s == 0) {
+      const PathVertex &vertex = camerapath[t - 1];
+      if (vertex.light)
+        L = vertex.evaluate_le(scene, camerapath[t - 2]) * vertex.beta;
+    }
+    //* For a lightpath connect to the camera (except the s == 1 situation)
+    else if (t == 1 && s != 1) {
+      const PathVertex &vertex = lightpath[s - 1];
+      //* The vertex is only connectable if is's not a delta distribution
+      if (!vertex.delta) {
+        //* First, we should sample the camera
+        //* But, we just implement the pinhole, so there is no need to sample
+        Vector3f wi;
+        float pdf;
+        Point2f p_raster;
+        SpectrumRGB importance =
+            camera->sampleWi(vertex.position, Point2f(), &wi, &pdf, &p_raster);
+        if (pdf > 0 && !importance.isZero()) {
+          Ray3f vis_ray{camera->get_position(), vertex.position};
+          sampled =
+              PathVertex::create_camera(camera, vis_ray, importance / pdf);
+          //* This connection will only contribute when it hit the film
+          //* and it was not occlude by the scene
+          if (!scene.occlude(vis_ray) && (0 <= p_raster.x && p_raster.x < 1) &&
+              (0 <= p_raster.y && p_raster.y < 1)) {
+            *pixel = Point2i{int(resolution.x * p_raster.x),
+                             int(resolution.y * p_raster.y)};
+            SpectrumRGB f = vertex.info->evaluateScatter(wi);
+            L = vertex.beta * f * (importance / pdf);
+          }
+        }
+      }
+    }
+    //* Connect the lightsource to camera path
+    else if (s == 1) {
+      const PathVertex &vertex = camerapath[t - 1];
+      //* This vertex can connect to lightsource only when it's not a delta
+      if (!vertex.delta) {
+        LightSourceInfo light_info =
+            scene.sampleLightSource(*vertex.info, sampler);
+        //* No light reaches the vertex, L stays zero
+        if (!light_info.light)
+          return L;
+        sampled = PathVertex::create_light(light_info);
+        sampled.pdf_fwd = sampled.pdf_light_origin(scene, &vertex);
+        Ray3f shadow_ray = vertex.info->scatterRay(scene, light_info.position);
+        if (!scene.occlude(shadow_ray)) {
+          auto light = light_info.light;
+          auto [le_weight, pdf] =
+              light->evaluate(light_info, vertex.info->position);
+          SpectrumRGB f = vertex.info->evaluateScatter(shadow_ray.dir);
+          L = vertex.beta * f * le_weight;
+        }
+      }
+    }
+    //* All other connect situations
+    else {
+      const PathVertex &camera_vertex = camerapath[t - 1],
+                       &light_vertex = lightpath[s - 1];
+      //* The two subpaths can only be connected if they aren't delta
+      if (!camera_vertex.delta && !light_vertex.delta) {
+        Vector3f camera2light = light_vertex.position - camera_vertex.position;
+        float inv_dist2 = 1.f / camera2light.length2();
+        camera2light = normalize(camera2light);
+        L = camera_vertex.beta *
+            camera_vertex.info->evaluateScatter(camera2light) *
+            light_vertex.beta *
+            light_vertex.info->evaluateScatter(-camera2light) * inv_dist2;
+        if (!L.isZero()) {
+          Ray3f vis_ray{light_vertex.position, camera_vertex.position};
+          L *= SpectrumRGB{scene.occlude(vis_ray) ? 0.f : 1.f};
+        }
+      }
+    }
+    //* Apply the multiple importance sampling
+    float misw = L.isZero() ? 0
+                            : mis_weight(scene, camerapath, lightpath,
+                                         light_ratio, t, s, sampled);
+
+    return L * misw;
+  }
+
+  //* The dimensions consumed by each part of a sample, only the samplers
+  //* keeping several streams (e.g. the primary sample space of MLT) care
+  static constexpr int CAMERA_STREAM = 0, LIGHT_STREAM = 1,
+                       CONNECTION_STREAM = 2, N_STREAMS = 3;
+
+  //*   Trace the subpaths of a sample whose camera ray passes p_pixel and
+  //* connect all the strategies. Return the contribution to p_pixel, while
+  //* the contributions of t == 1 land on other pixels and are passed to
+  //* splat(pixel, L). The camera ray should be drawn from the camera stream
+  template <typename Splat>
+  SpectrumRGB evaluate_sample(const Scene &scene, const Camera *camera,
+                              Point2i resolution, Point2i p_pixel, Ray3f ray,
+                              Sampler *sampler, PathBuffer *light_buffer,
+                              PathBuffer *camera_buffer, Splat &&splat) const {
+    //* generate camera subpath
+    int n_camerapath = generate_camerapath(scene, sampler, max_depth + 2,
+                                           camera, ray, camera_buffer);
+    cache_camera_mis(camera_buffer->vertices.data(), n_camerapath);
+
+    //* generate light subpath
+    sampler->startStream(LIGHT_STREAM);
+    int n_lightpath =
+        generate_lightpath(scene, sampler, max_depth + 1, light_buffer);
+    float light_ratio =
+        cache_light_mis(scene, light_buffer->vertices.data(), n_lightpath);
+
+    //* connect all light subpath vertex to camera
+    sampler->startStream(CONNECTION_STREAM);
+    SpectrumRGB L{.0f};
+    for (int t = 1; t <= n_camerapath; ++t) {
+      for (int s = 0; s <= n_lightpath; ++s) {
+        int depth = t + s - 2;
+        //* Ignore the following situations
+        if ((s == 1 && t == 1) || depth < 0 || depth > max_depth)
+          continue;
+        Point2i pixel = p_pixel;
+        SpectrumRGB L_path = connect_subpath(
+            scene, camera, resolution, light_buffer->vertices.data(),
+            camera_buffer->vertices.data(), light_ratio, s, t, sampler,
+            &pixel);
+        if (t == 1) {
+          if (!L_path.isZero() && (0 <= pixel.x && pixel.x < resolution.x) &&
+              (0 <= pixel.y && pixel.y < resolution.y))
+            splat(pixel, L_path);
+        } else {
+          L += L_path;
+        }
+      }
+    }
+    return L;
+  }
+
+public:
+  BidirectionalPathTracer() : max_depth(5) {}
+
+  BidirectionalPathTracer(const rapidjson::Value &_value) {
+    max_depth = getInt("maxDepth", _value);
+  }
+
+  virtual ~BidirectionalPathTracer() = default;
+
+  virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
+                            Sampler *sampler) const override {
+    // no implementation
+    std::cerr << "BidirectionalPathTracer::getLi not implement!\n";
+    std::exit(1);
+  }
+  virtual void render(std::shared_ptr<RenderTask> task) const override;
+
+protected:
+  int max_depth;
+};
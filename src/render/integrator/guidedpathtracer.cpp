@@ -0,0 +1,193 @@
+#include <core/math/common.h>
+#include <core/render-core/film.h>
+#include <core/render-core/integrator.h>
+#include <core/task/task.h>
+#include <spdlog/spdlog.h>
+
+#include "sdtree.h"
+
+//*   Path tracer guided by a spatial-directional tree of incident radiance,
+//* which is learned over training passes with doubling sample counts. At the
+//* non-specular surface vertices, the direction is drawn from the mixture of
+//* bsdf sampling and guided sampling (one-sample MIS)
+//*   Only the surface scattering is guided, bssrdf is not handled
+class GuidedPathTracer : public PixelIntegrator {
+public:
+  GuidedPathTracer() : mMaxDepth(5), mRRThreshold(3) {}
+
+  GuidedPathTracer(const rapidjson::Value &_value) {
+    mMaxDepth = getInt("maxDepth", _value);
+    mRRThreshold = getInt("rrThreshold", _value);
+
+    Params params(_value);
+    mTrainingPasses = std::max(0, params.fetch<int>("trainingPasses", 5));
+    mBSDFSamplingFraction = std::clamp(
+        params.fetch<float>("bsdfSamplingFraction", .5f), .0f, 1.f);
+    mSpatialThreshold = params.fetch<float>("spatialThreshold", 12000.f);
+    mDirectionalThreshold = params.fetch<float>("directionalThreshold", .01f);
+    mMaxDirectionalDepth = params.fetch<int>("maxDirectionalDepth", 20);
+  }
+
+  virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
+                            Sampler *sampler) const override {
+    //* The vertices whose incident radiance will be recorded
+    struct GuidingVertex {
+      DTreeWrapper *dTree;
+      Vector3f wo;
+      //* The path throughput after scattering at this vertex
+      SpectrumRGB throughput;
+      //* Radiance arriving at this vertex along wo
+      SpectrumRGB radiance;
+      float pdf;
+    };
+    GuidingVertex vertices[MAX_GUIDING_VERTICES];
+    int nVertices = 0;
+
+    SpectrumRGB Li{.0f}, beta{1.f};
+    auto addContribution = [&](SpectrumRGB contribution) {
+      Li += contribution;
+      if (!mTraining)
+        return;
+      for (int i = 0; i < nVertices; ++i) {
+        const SpectrumRGB &t = vertices[i].throughput;
+        vertices[i].radiance += SpectrumRGB{
+            t[0] > 0 ? contribution[0] / t[0] : 0,
+            t[1] > 0 ? contribution[1] / t[1] : 0,
+            t[2] > 0 ? contribution[2] / t[2] : 0};
+      }
+    };
+
+    float pdfDirection = FINF;
+    std::shared_ptr<IntersectionInfo> prevInfo = nullptr;
+    for (int bounces = 0;; ++bounces) {
+      auto itsInfo = scene.intersectWithSurface(ray);
+      //* Evaluate the Le using mis
+      {
+        SpectrumRGB Le = itsInfo->evaluateLe();
+        float pdf = itsInfo->pdfLe();
+        if (prevInfo && pdf != 0)
+          pdf *= scene.pdfEmitter(itsInfo->light, *prevInfo);
+        float misw = powerHeuristic(pdfDirection, pdf);
+        if (!Le.isZero())
+          addContribution(beta * Le * misw);
+      }
+      if (itsInfo->terminate() || bounces >= mMaxDepth)
+        break;
+
+      DTreeWrapper *dTree = nullptr;
+      if (itsInfo->shape && itsInfo->shape->getBSDF()->isDiffuse())
+        dTree = mSDTree.lookup(itsInfo->position);
+
+      //* Sample the direct
+      {
+        LightSourceInfo lightSourceInfo =
+            scene.sampleLightSource(*itsInfo, sampler);
+        Ray3f shadowRay = itsInfo->scatterRay(scene, lightSourceInfo.position);
+        if (lightSourceInfo.light && !scene.occlude(shadowRay)) {
+          auto light = lightSourceInfo.light;
+          auto [LeWeight, pdf] =
+              light->evaluate(lightSourceInfo, itsInfo->position);
+          SpectrumRGB f = itsInfo->evaluateScatter(shadowRay.dir);
+          float misw =
+              powerHeuristic(pdf, pdfScatter(*itsInfo, dTree, shadowRay.dir));
+          if (!f.isZero())
+            addContribution(beta * f * LeWeight * misw);
+        }
+      }
+
+      //* Sample the direction, from the bsdf or the guiding distribution
+      ScatterInfo scatterInfo;
+      if (!dTree) {
+        scatterInfo = itsInfo->sampleScatter(sampler->next2D());
+      } else {
+        bool guided = sampler->next1D() >= mBSDFSamplingFraction;
+        Point2f u = sampler->next2D();
+        if (!guided) {
+          scatterInfo = itsInfo->sampleScatter(u);
+        } else {
+          scatterInfo.wo = dTree->sample(u);
+          scatterInfo.weight = SpectrumRGB{1.f};
+        }
+        if (!scatterInfo.weight.isZero()) {
+          scatterInfo.pdf = pdfScatter(*itsInfo, dTree, scatterInfo.wo);
+          SpectrumRGB f = itsInfo->evaluateScatter(scatterInfo.wo);
+          scatterInfo.weight =
+              scatterInfo.pdf > 0 ? f / scatterInfo.pdf : SpectrumRGB{.0f};
+        }
+      }
+      if (scatterInfo.weight.isZero())
+        break;
+      beta *= scatterInfo.weight;
+
+      if (mTraining && dTree && nVertices < MAX_GUIDING_VERTICES)
+        vertices[nVertices++] = GuidingVertex{
+            dTree, scatterInfo.wo, beta, SpectrumRGB{.0f}, scatterInfo.pdf};
+
+      ray = itsInfo->scatterRay(scene, scatterInfo.wo);
+      prevInfo = itsInfo;
+      pdfDirection = scatterInfo.pdf;
+
+      if (bounces > mRRThreshold) {
+        if (sampler->next1D() > 0.95f)
+          break;
+        beta /= 0.95;
+        for (int i = 0; i < nVertices; ++i)
+          vertices[i].throughput /= 0.95;
+      }
+    }
+
+    //* Splat the radiance / pdf, whose sum over a quadrant is proportional to
+    //* the incident radiance integrated over its solid angle
+    for (int i = 0; i < nVertices; ++i)
+      vertices[i].dTree->record(vertices[i].wo,
+                                vertices[i].radiance.average() /
+                                    vertices[i].pdf);
+    return Li;
+  }
+
+protected:
+  virtual void preprocess(std::shared_ptr<RenderTask> task) const override {
+    mSDTree = STree(task->scene->getBounds());
+    mTraining = true;
+    for (int pass = 0; pass < mTrainingPasses; ++pass) {
+      int spp = 1 << pass;
+      std::cout << tfm::format("\nTraining pass %d with %d spp\n", pass, spp);
+      Film film{task->film_size, task->film->tile_size};
+      renderPass(task, film, spp);
+      mSDTree.refine(mSpatialThreshold * std::sqrt((float)spp),
+                     mDirectionalThreshold, mMaxDirectionalDepth);
+    }
+    mTraining = false;
+    std::cout << "\nRendering with the trained guiding distribution\n";
+  }
+
+  //* The pdf of the one-sample mixture of bsdf and guided sampling
+  float pdfScatter(const SurfaceIntersectionInfo &itsInfo,
+                   const DTreeWrapper *dTree, Vector3f wo) const {
+    float pdfBSDF = itsInfo.pdfScatter(wo);
+    if (!dTree)
+      return pdfBSDF;
+    return mBSDFSamplingFraction * pdfBSDF +
+           (1 - mBSDFSamplingFraction) * dTree->pdf(wo);
+  }
+
+protected:
+  static constexpr int MAX_GUIDING_VERTICES = 64;
+
+  int mMaxDepth;
+  int mRRThreshold;
+  int mTrainingPasses = 5;
+  //* The probability of sampling the bsdf instead of the guiding distribution
+  float mBSDFSamplingFraction = .5f;
+  //* A spatial leaf is split once it records c * sqrt(2^pass) samples
+  float mSpatialThreshold = 12000.f;
+  //* A quadrant is subdivided if it holds more than this fraction of energy
+  float mDirectionalThreshold = .01f;
+  int mMaxDirectionalDepth = 20;
+
+  //* Trained in preprocess, read only during the final pass
+  mutable STree mSDTree;
+  mutable bool mTraining = false;
+};
+
+REGISTER_CLASS(GuidedPathTracer, "guided-path-tracer")
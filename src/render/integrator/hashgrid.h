@@ -0,0 +1,105 @@
+/**
+ * @file hashgrid.h
+ * @brief Hashed uniform grid for fixed radius queries over a point set, used
+ * to merge the light vertices in VCM
+ *
+ */
+#pragma once
+#include <core/geometry/geometry.h>
+#include <tbb/tbb.h>
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+//*   The cell size is twice the query radius, so a query visits the 8 cells
+//* around the point. The table is filled in parallel by counting sort
+class HashGrid {
+public:
+  //* position(i) returns the i-th point
+  template <typename Func>
+  void build(int n_points, Func &&position, float _radius) {
+    radius = _radius;
+    inv_cell_size = 1.f / (2 * radius);
+    hash_size = std::max(1, n_points);
+
+    bounds = AABB3f{};
+    for (int i = 0; i < n_points; ++i)
+      bounds.expands(position(i));
+
+    cell_start.assign(hash_size + 1, 0);
+    indices.resize(n_points);
+    if (cell_count.size() != hash_size)
+      cell_count = std::vector<std::atomic<int>>(hash_size);
+    for (auto &count : cell_count)
+      count.store(0, std::memory_order_relaxed);
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, n_points),
+                      [&](const tbb::blocked_range<int> &r) {
+                        for (int i = r.begin(); i != r.end(); ++i)
+                          cell_count[cell_index(position(i))].fetch_add(
+                              1, std::memory_order_relaxed);
+                      });
+    for (int h = 0; h < hash_size; ++h) {
+      cell_start[h + 1] = cell_start[h] + cell_count[h].load();
+      cell_count[h].store(cell_start[h], std::memory_order_relaxed);
+    }
+    tbb::parallel_for(tbb::blocked_range<int>(0, n_points),
+                      [&](const tbb::blocked_range<int> &r) {
+                        for (int i = r.begin(); i != r.end(); ++i)
+                          indices[cell_count[cell_index(position(i))]
+                                      .fetch_add(1,
+                                                 std::memory_order_relaxed)] =
+                              i;
+                      });
+  }
+
+  //* Visit the candidates around p, the caller checks the distance
+  template <typename Func> void query(Point3f p, Func &&func) const {
+    if (indices.empty())
+      return;
+    Vector3f local = (p - bounds.min) * inv_cell_size;
+    int cell[3], other[3];
+    for (int i = 0; i < 3; ++i) {
+      float floor = std::floor(local[i]);
+      cell[i] = int(floor);
+      other[i] = cell[i] + (local[i] - floor < .5f ? -1 : 1);
+    }
+    //* Different cells may share a bucket, visit each bucket once
+    int visited[8], n_visited = 0;
+    for (int j = 0; j < 8; ++j) {
+      int h = hash(j & 1 ? other[0] : cell[0], j & 2 ? other[1] : cell[1],
+                   j & 4 ? other[2] : cell[2]);
+      bool repeated = false;
+      for (int k = 0; k < n_visited; ++k)
+        repeated |= visited[k] == h;
+      if (repeated)
+        continue;
+      visited[n_visited++] = h;
+      for (int i = cell_start[h]; i < cell_start[h + 1]; ++i)
+        func(indices[i]);
+    }
+  }
+
+  float get_radius() const { return radius; }
+
+private:
+  int cell_index(Point3f p) const {
+    Vector3f local = (p - bounds.min) * inv_cell_size;
+    return hash(int(std::floor(local.x)), int(std::floor(local.y)),
+                int(std::floor(local.z)));
+  }
+
+  int hash(int x, int y, int z) const {
+    return (unsigned)((x * 73856093) ^ (y * 19349663) ^ (z * 83492791)) %
+           (unsigned)hash_size;
+  }
+
+  AABB3f bounds;
+  float radius = 0, inv_cell_size = 0;
+  int hash_size = 1;
+  std::vector<std::atomic<int>> cell_count;
+  std::vector<int> cell_start;
+  //* Point indices sorted by bucket
+  std::vector<int> indices;
+};
@@ -10,13 +10,25 @@
 void PixelIntegrator::render(std::shared_ptr<RenderTask> task) const {
   auto start = std::chrono::high_resolution_clock::now();
 
-  Film &film = *task->film;
+  preprocess(task);
+  renderPass(task, *task->film, task->getSpp());
+
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout << tfm::format(
+      "\nRendering costs : %.2f seconds\n",
+      (float)std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
+              .count() /
+          1000.f);
+  task->film->save_as(task->file_name, 0);
+}
+
+void PixelIntegrator::renderPass(std::shared_ptr<RenderTask> task, Film &film,
+                                 int spp) const {
   auto [x, y] = film.tile_range();
 
   int finished_tiles = 0, tile_size = film.tile_size;
   double total_tiles = x * y;
 
-  auto integrator = task->integrator;
   auto ori_sampler = task->sampler;
   auto camera = task->camera;
   auto scene = task->scene;
@@ -33,11 +45,11 @@ void PixelIntegrator::render(std::shared_ptr<RenderTask> task) const {
               for (int j = 0; j < tile_size; ++j) {
                 Point2i p_pixel = tile->pixel_location({i, j});
                 sampler->startPixel(p_pixel);
-                for (int spp = 0; spp < task->getSpp(); ++spp) {
+                for (int k = 0; k < spp; ++k) {
                   Ray3f ray = camera->sampleRayDifferential(
                       p_pixel, task->film_size, sampler->getCameraSample());
                   ray.medium = scene->getEnvMedium().get();
-                  SpectrumRGB L = integrator->getLi(*scene, ray, sampler.get());
+                  SpectrumRGB L = getLi(*scene, ray, sampler.get());
                   sampler->nextSample();
                   film.add_sample(p_pixel, L, 1);
                 }
@@ -49,13 +61,6 @@ void PixelIntegrator::render(std::shared_ptr<RenderTask> task) const {
           }
       });
   printProgress(1);
-  auto end = std::chrono::high_resolution_clock::now();
-  std::cout << tfm::format(
-      "\nRendering costs : %.2f seconds\n",
-      (float)std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
-              .count() /
-          1000.f);
-  film.save_as(task->file_name, 0);
 }
 
 // TODO abstract this
@@ -6,13 +6,14 @@
 #include <core/task/task.h>
 #include <tbb/tbb.h>
 
+#include <atomic>
 #include <chrono>
-#include <mutex>
 
 class LightTracer : public FilmIntegrator {
 protected:
   int generate_lightpath(const Scene &scene, Sampler *sampler, int max_depth,
-                         std::vector<PathVertex> *lightpath) const {
+                         std::vector<PathVertex> *lightpath,
+                         std::vector<SurfaceIntersectionInfo> *infos) const {
     if (max_depth == 0)
       return 0;
     auto light_info = scene.sampleLightSource(sampler);
@@ -44,7 +45,8 @@ protected:
     float pdf_fwd = pdf_dir, pdf_rev = .0f;
     Ray3f ray{light_info.position, dir_world};
     while (true) {
-      auto sits = scene.intersectWithSurface(ray);
+      SurfaceIntersectionInfo *sits = &(*infos)[bounces + 1];
+      scene.intersectWithSurface(ray, sits);
       if (sits->shape) {
         ++bounces;
         if (bounces >= max_depth)
@@ -66,7 +68,7 @@ protected:
     return bounces + 1;
   }
 
-  SpectrumRGB connect_camera(const Scene &scene, std::shared_ptr<Camera> camera,
+  SpectrumRGB connect_camera(const Scene &scene, const Camera *camera,
                              Point2i resolution, const PathVertex &vertex,
                              Point2i *pixel) const {
     SpectrumRGB result{.0f};
@@ -103,6 +105,10 @@ public:
 
   LightTracer(const rapidjson::Value &_value) {
     max_depth = getInt("maxDepth", _value);
+
+    Params params(_value);
+    light_paths = std::max(0, params.fetch<int>("lightPaths", 0));
+    batch_size = std::max(1, params.fetch<int>("batchSize", 1024));
   }
 
   virtual ~LightTracer() = default;
@@ -120,68 +126,85 @@ public:
     auto start = std::chrono::high_resolution_clock::now();
 
     Film &film = *task->film;
-    auto [x, y] = film.tile_range();
-
-    std::vector<std::shared_ptr<FilmTile>> film_tiles;
-    film_tiles.reserve(x * y);
+    Point2i resolution = task->film_size;
+    int n_pixels = resolution.x * resolution.y, spp = task->getSpp();
 
-    int finished_tiles = 0, tile_size = film.tile_size;
-    double total_tiles = x * y;
-
-    auto integrator = task->integrator;
     auto ori_sampler = task->sampler;
-    auto camera = task->camera;
+    const Camera *camera = task->camera.get();
     auto scene = task->scene;
 
+    //* The emitters seen by the camera directly (s = 0, t = 2)
     tbb::parallel_for(
-        tbb::blocked_range2d<size_t>(0, x, 0, y),
-        [&](const tbb::blocked_range2d<size_t> &r) {
-          for (int row = r.rows().begin(); row != r.rows().end(); ++row)
-            for (int col = r.cols().begin(); col != r.cols().end(); ++col) {
-              auto tile = film.get_tile({row, col});
-              auto sampler = ori_sampler->clone();
-
-              for (int i = 0; i < tile_size; ++i)
-                for (int j = 0; j < tile_size; ++j) {
-                  Point2i p_pixel = tile->pixel_location({i, j});
-                  sampler->startPixel(p_pixel);
-                  for (int spp = 0; spp < task->getSpp(); ++spp) {
-                    Ray3f ray = camera->sampleRayDifferential(
-                        p_pixel, task->film_size, sampler->getCameraSample());
-                    SpectrumRGB t2s0 = getLi(*scene, ray, sampler.get());
-                    film.add_sample(p_pixel, t2s0, 1);
-
-                    std::vector<PathVertex> light_path(max_depth + 1);
-                    //* generate light subpath
-                    int n_lightpath = generate_lightpath(
-                        *scene, sampler.get(), max_depth + 1, &light_path);
-                    //* connect all light subpath vertex to camera
-                    const int t = 1;
-                    for (int s = 0; s <= n_lightpath; ++s) {
-                      int depth = t + s - 2;
-                      //* Ignore the following situations
-                      if ((s == 1 && t == 1) || depth < 0 || depth > max_depth)
-                        continue;
-                      Point2i pixel;
-                      SpectrumRGB L_path =
-                          connect_camera(*scene, camera, task->film_size,
-                                         light_path[s - 1], &pixel);
-                      if ((0 <= pixel.x && pixel.x < task->film_size.x) &&
-                          (0 <= pixel.y && pixel.y < task->film_size.y))
-                        film.add_splat(pixel, L_path, 1.f / task->spp);
-                    }
-                    sampler->nextSample();
-                  }
-                }
-
-              film_tiles.emplace_back(tile);
-              finished_tiles++;
-              if (finished_tiles % 5 == 0) {
-                printProgress((double)finished_tiles / total_tiles);
+        tbb::blocked_range<int>(0, resolution.y),
+        [&](const tbb::blocked_range<int> &r) {
+          auto sampler = ori_sampler->clone();
+          for (int y = r.begin(); y != r.end(); ++y)
+            for (int x = 0; x < resolution.x; ++x) {
+              Point2i p_pixel{x, y};
+              sampler->startPixel(p_pixel);
+              for (int i = 0; i < spp; ++i) {
+                Ray3f ray = camera->sampleRayDifferential(
+                    p_pixel, resolution, sampler->getCameraSample());
+                film.add_sample(p_pixel, getLi(*scene, ray, sampler.get()), 1);
+                sampler->nextSample();
               }
             }
         });
+
+    //* The light paths are traced in batches independent of the film, each
+    //* path splats with the weight of a pixel sample
+    long long n_paths =
+        light_paths > 0 ? light_paths : (long long)n_pixels * spp;
+    int n_batches = (n_paths + batch_size - 1) / batch_size;
+    float splat_weight = (float)n_pixels / n_paths;
+
+    //* Splatting into per-thread buffers avoids the pixel locks of the film
+    tbb::enumerable_thread_specific<std::vector<SpectrumRGB>> splat_buffers(
+        [&]() { return std::vector<SpectrumRGB>(n_pixels, SpectrumRGB{.0f}); });
+    std::atomic<int> finished_batches = 0;
+
+    tbb::parallel_for(
+        tbb::blocked_range<int>(0, n_batches),
+        [&](const tbb::blocked_range<int> &r) {
+          auto &splats = splat_buffers.local();
+          auto sampler = ori_sampler->clone();
+          std::vector<PathVertex> light_path(max_depth + 1);
+          std::vector<SurfaceIntersectionInfo> infos(max_depth + 2);
+
+          for (int batch = r.begin(); batch != r.end(); ++batch) {
+            long long first = (long long)batch * batch_size,
+                      last = std::min(first + batch_size, n_paths);
+            for (long long k = first; k < last; ++k) {
+              //* The pixel samplers hold spp samples a time
+              if ((k - first) % spp == 0)
+                sampler->startPixel(Point2i{batch, int(k - first)});
+              //* generate light subpath
+              int n_lightpath =
+                  generate_lightpath(*scene, sampler.get(), max_depth + 1,
+                                     &light_path, &infos);
+              //* connect all light subpath vertex to camera (t = 1), the
+              //* path depth is s - 1
+              for (int s = 2; s <= n_lightpath && s - 1 <= max_depth; ++s) {
+                Point2i pixel{-1};
+                SpectrumRGB L_path = connect_camera(
+                    *scene, camera, resolution, light_path[s - 1], &pixel);
+                if (!L_path.isZero() &&
+                    (0 <= pixel.x && pixel.x < resolution.x) &&
+                    (0 <= pixel.y && pixel.y < resolution.y))
+                  splats[pixel.x + pixel.y * resolution.x] += L_path;
+              }
+              sampler->nextSample();
+            }
+            if (++finished_batches % 16 == 0) {
+              printProgress((double)finished_batches / n_batches);
+            }
+          }
+        });
     printProgress(1);
+
+    for (const auto &splats : splat_buffers)
+      film.add_splats(splats, splat_weight);
+
     auto end = std::chrono::high_resolution_clock::now();
     std::cout << tfm::format(
         "\nRendering costs : %.2f seconds\n",
@@ -194,6 +217,10 @@ public:
 
 private:
   int max_depth;
+  //* The number of light paths, 0 means one for each pixel sample
+  int light_paths = 0;
+  //* The number of light paths in a work unit
+  int batch_size = 1024;
 };
 
 REGISTER_CLASS(LightTracer, "light-tracer")
@@ -0,0 +1,312 @@
+#include <core/math/discretepdf.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "bidirpathtracer.h"
+
+//*   Primary sample space of "A simple and robust mutation strategy for the
+//* Metropolis light transport algorithm" (Kelemen et al. 2002). The samples
+//* are mutated lazily, a dimension is only brought up to date when it is read
+//* by the current iteration. Large steps resample all dimensions uniformly,
+//* small steps perturb them with a gaussian wrapped into [0, 1)
+class MLTSampler : public Sampler {
+public:
+  MLTSampler(uint64_t seed, float _sigma, float _large_step_probability,
+             int _n_streams)
+      : sigma(_sigma), large_step_probability(_large_step_probability),
+        n_streams(_n_streams) {
+    //* The chain is reproduced by the same seed after bootstrapping
+    rng.seed(seed);
+  }
+
+  void start_iteration() {
+    ++current_iteration;
+    large_step = uniform() < large_step_probability;
+  }
+
+  void accept() {
+    if (large_step)
+      last_large_step_iteration = current_iteration;
+  }
+
+  void reject() {
+    for (auto &x : X)
+      if (x.last_modification_iteration == current_iteration)
+        x.restore();
+    --current_iteration;
+  }
+
+  virtual void startStream(int index) override {
+    stream_index = index;
+    sample_index = 0;
+  }
+
+  virtual float next1D() override {
+    int index = stream_index + n_streams * sample_index++;
+    ensure_ready(index);
+    return X[index].value;
+  }
+
+  virtual Point2f next2D() override { return Point2f(next1D(), next1D()); }
+
+  virtual Point3f next3D() override {
+    return Point3f{next1D(), next1D(), next1D()};
+  }
+
+  virtual void nextSample() override {
+    // do nothing
+  }
+
+  bool is_large_step() const { return large_step; }
+
+private:
+  struct PrimarySample {
+    float value = 0, value_backup = 0;
+    long long last_modification_iteration = 0, modify_backup = 0;
+
+    void backup() {
+      value_backup = value;
+      modify_backup = last_modification_iteration;
+    }
+
+    void restore() {
+      value = value_backup;
+      last_modification_iteration = modify_backup;
+    }
+  };
+
+  float uniform() { return std::min((float)dist(rng), 1 - EPSILON); }
+
+  void ensure_ready(int index) {
+    if (index >= X.size())
+      X.resize(index + 1);
+    PrimarySample &x = X[index];
+    //* Catch up with the last accepted large step
+    if (x.last_modification_iteration < last_large_step_iteration) {
+      x.value = uniform();
+      x.last_modification_iteration = last_large_step_iteration;
+    }
+    x.backup();
+    if (large_step) {
+      x.value = uniform();
+    } else {
+      //* The small steps missed by this dimension are applied at once, the
+      //* sum of n gaussian perturbations is a gaussian of sigma * sqrt(n)
+      long long n_small = current_iteration - x.last_modification_iteration;
+      float u1 = std::max(uniform(), EPSILON), u2 = uniform();
+      float normal = std::sqrt(-2 * std::log(u1)) * std::cos(2 * PI * u2);
+      x.value += normal * sigma * std::sqrt((float)n_small);
+      x.value -= std::floor(x.value);
+    }
+    x.last_modification_iteration = current_iteration;
+  }
+
+  float sigma, large_step_probability;
+  int n_streams;
+  std::vector<PrimarySample> X;
+  long long current_iteration = 0, last_large_step_iteration = 0;
+  //* The first iteration draws every dimension uniformly
+  bool large_step = true;
+  int stream_index = 0, sample_index = 0;
+};
+
+//*   Primary sample space Metropolis light transport driving the sampling of
+//* the bidirectional path tracer. The target function of a state is the sum
+//* of the luminance of all its strategies, which may land on several pixels.
+//*   The normalization is estimated from bootstrap samples, then independent
+//* chains start from states resampled from the bootstrap set, each splatting
+//* into its own buffer which is merged into the film at the end
+class PSSMLTIntegrator : public BidirectionalPathTracer {
+public:
+  PSSMLTIntegrator() = default;
+
+  PSSMLTIntegrator(const rapidjson::Value &_value)
+      : BidirectionalPathTracer(_value) {
+    Params params(_value);
+    bootstrap_samples =
+        std::max(1, params.fetch<int>("bootstrapSamples", 100000));
+    chains = std::max(0, params.fetch<int>("chains", 0));
+    mutations_per_pixel =
+        std::max(0, params.fetch<int>("mutationsPerPixel", 0));
+    sigma = params.fetch<float>("sigma", .01f);
+    large_step_probability =
+        std::clamp(params.fetch<float>("largeStepProbability", .3f), .0f, 1.f);
+  }
+
+  virtual ~PSSMLTIntegrator() = default;
+
+  virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
+                            Sampler *sampler) const override {
+    // no implementation
+    std::cerr << "PSSMLTIntegrator::getLi not implement!\n";
+    std::exit(1);
+  }
+
+  virtual void render(std::shared_ptr<RenderTask> task) const override {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    Film &film = *task->film;
+    Point2i resolution = task->film_size;
+    int n_pixels = resolution.x * resolution.y;
+
+    const Camera *camera = task->camera.get();
+    auto scene = task->scene;
+
+    //* Estimate the normalization b, the integral of the target function
+    std::vector<float> bootstrap_weights(bootstrap_samples);
+    tbb::parallel_for(
+        tbb::blocked_range<int>(0, bootstrap_samples, 256),
+        [&](const tbb::blocked_range<int> &r) {
+          PathBuffer light_buffer(max_depth + 1), camera_buffer(max_depth + 2);
+          std::vector<Contribution> contributions;
+          for (int i = r.begin(); i != r.end(); ++i) {
+            MLTSampler sampler(i, sigma, large_step_probability, N_STREAMS);
+            bootstrap_weights[i] =
+                evaluate(*scene, camera, resolution, &sampler, &light_buffer,
+                         &camera_buffer, &contributions);
+          }
+        });
+    Distribution1D bootstrap(bootstrap_samples);
+    for (float weight : bootstrap_weights)
+      bootstrap.append(weight);
+    float b = bootstrap.normalize() / bootstrap_samples;
+    if (b == 0) {
+      std::cout << "\nNo light path found in bootstrapping\n";
+      film.save_as(task->file_name, 0);
+      return;
+    }
+
+    int n_chains =
+        chains > 0 ? chains : tbb::this_task_arena::max_concurrency();
+    long long n_mutations =
+        (long long)n_pixels *
+        (mutations_per_pixel > 0 ? mutations_per_pixel : task->getSpp());
+    std::atomic<long long> finished_mutations = 0;
+
+    //* One chain per task, so a buffer is only touched by one chain at a time
+    tbb::enumerable_thread_specific<std::vector<SpectrumRGB>> splat_buffers(
+        [&]() { return std::vector<SpectrumRGB>(n_pixels, SpectrumRGB{.0f}); });
+
+    tbb::parallel_for(
+        tbb::blocked_range<int>(0, n_chains, 1),
+        [&](const tbb::blocked_range<int> &r) {
+          auto &splats = splat_buffers.local();
+          PathBuffer light_buffer(max_depth + 1), camera_buffer(max_depth + 2);
+          std::vector<Contribution> current, proposed;
+          auto splat = [&](const std::vector<Contribution> &contributions,
+                           float weight) {
+            for (const auto &[pixel, L] : contributions)
+              splats[pixel.x + pixel.y * resolution.x] += L * weight;
+          };
+
+          for (int chain = r.begin(); chain != r.end(); ++chain) {
+            long long first = n_mutations * chain / n_chains,
+                      last = n_mutations * (chain + 1) / n_chains;
+
+            //* Start from a bootstrap state chosen in proportion to its weight
+            pcg32 chain_rng(bootstrap_samples + (uint64_t)chain);
+            std::uniform_real_distribution<float> uniform(0, 1);
+            int index = bootstrap.sample(uniform(chain_rng));
+            MLTSampler sampler(index, sigma, large_step_probability,
+                               N_STREAMS);
+            float f_current =
+                evaluate(*scene, camera, resolution, &sampler, &light_buffer,
+                         &camera_buffer, &current);
+
+            for (long long k = first; k < last; ++k) {
+              sampler.start_iteration();
+              float f_proposed =
+                  evaluate(*scene, camera, resolution, &sampler, &light_buffer,
+                           &camera_buffer, &proposed);
+              float accept =
+                  f_current > 0 ? std::min(1.f, f_proposed / f_current) : 1.f;
+              //* Expected value splatting of both states
+              if (accept > 0 && f_proposed > 0)
+                splat(proposed, accept / f_proposed);
+              if (accept < 1)
+                splat(current, (1 - accept) / f_current);
+
+              if (uniform(chain_rng) < accept) {
+                sampler.accept();
+                std::swap(current, proposed);
+                f_current = f_proposed;
+              } else {
+                sampler.reject();
+              }
+
+              if ((k - first + 1) % 65536 == 0) {
+                finished_mutations += 65536;
+                printProgress((double)finished_mutations / n_mutations);
+              }
+            }
+          }
+        });
+    printProgress(1);
+
+    //* Each mutation carries b / (mutations per pixel) of the image
+    for (const auto &splats : splat_buffers)
+      film.add_splats(splats, b * n_pixels / n_mutations);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << tfm::format(
+        "\nRendering costs : %.2f seconds\n",
+        (float)std::chrono::duration_cast<std::chrono::milliseconds>(end -
+                                                                     start)
+                .count() /
+            1000.f);
+    film.save_as(task->file_name, 0);
+  }
+
+protected:
+  struct Contribution {
+    Point2i pixel;
+    SpectrumRGB L;
+  };
+
+  //* Evaluate the state of the sampler, collect the contributions of all its
+  //* strategies and return the target function
+  float evaluate(const Scene &scene, const Camera *camera, Point2i resolution,
+                 MLTSampler *sampler, PathBuffer *light_buffer,
+                 PathBuffer *camera_buffer,
+                 std::vector<Contribution> *contributions) const {
+    contributions->clear();
+
+    //* The film position is continuous in the primary samples
+    sampler->startStream(CAMERA_STREAM);
+    Point2f u = sampler->next2D();
+    Point2f p_film{u.x * resolution.x, u.y * resolution.y};
+    Point2i p_pixel{std::min(int(p_film.x), resolution.x - 1),
+                    std::min(int(p_film.y), resolution.y - 1)};
+    CameraSample camera_sample = sampler->getCameraSample();
+    camera_sample.sampleXY =
+        Point2f{p_film.x - p_pixel.x, p_film.y - p_pixel.y};
+    Ray3f ray =
+        camera->sampleRayDifferential(p_pixel, resolution, camera_sample);
+
+    SpectrumRGB L = evaluate_sample(
+        scene, camera, resolution, p_pixel, ray, sampler, light_buffer,
+        camera_buffer, [&](Point2i pixel, SpectrumRGB L_path) {
+          contributions->emplace_back(Contribution{pixel, L_path});
+        });
+    if (!L.isZero())
+      contributions->emplace_back(Contribution{p_pixel, L});
+
+    float f = 0;
+    for (const auto &contribution : *contributions)
+      f += contribution.L.average();
+    return std::isfinite(f) ? std::max(f, .0f) : 0;
+  }
+
+private:
+  int bootstrap_samples = 100000;
+  //* 0 means one chain for each thread
+  int chains = 0;
+  //* 0 means the spp of the task
+  int mutations_per_pixel = 0;
+  //* The standard deviation of the small steps
+  float sigma = .01f;
+  float large_step_probability = .3f;
+};
+
+REGISTER_CLASS(PSSMLTIntegrator, "pssmlt")
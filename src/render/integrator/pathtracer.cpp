@@ -2,6 +2,36 @@
 #include <core/render-core/integrator.h>
 #include <spdlog/spdlog.h>
 
+//* Weighted reservoir for the resampled importance sampling of direct light
+//* Each candidate carries its unshadowed contribution c = f * Le / pdf, the
+//* target function is c.average() * pdf, so the resampling weight is
+//* c.average() and the pdf cancels out for both area and delta lights
+struct LightReservoir {
+  LightSourceInfo sample;
+  //* Unshadowed contribution of the chosen candidate at the owner vertex
+  SpectrumRGB contribution{.0f};
+  float wSum = 0;
+  int M = 0;
+
+  void update(const LightSourceInfo &candidate, SpectrumRGB c, float weight,
+              float u) {
+    wSum += weight;
+    ++M;
+    if (weight > 0 && u * wSum < weight) {
+      sample = candidate;
+      contribution = c;
+    }
+  }
+
+  //* The resampled estimate of direct lighting, up to visibility
+  SpectrumRGB estimate() const {
+    float pHat = contribution.average();
+    if (pHat <= 0 || M == 0)
+      return SpectrumRGB{.0f};
+    return contribution * (wSum / (M * pHat));
+  }
+};
+
 class PathTracer : public PixelIntegrator {
 public:
   PathTracer() : mMaxDepth(5), mRRThreshold(3) {}
@@ -9,6 +39,9 @@ public:
   PathTracer(const rapidjson::Value &_value) {
     mMaxDepth = getInt("maxDepth", _value);
     mRRThreshold = getInt("rrThreshold", _value);
+
+    Params params(_value);
+    mRISCandidates = std::max(1, params.fetch<int>("risCandidates", 1));
   }
 
   virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
@@ -17,6 +50,8 @@ public:
     int bounces = 0;
     PathInfo pathInfo = samplePath(scene, ray, FINF, SpectrumRGB{1});
     const auto &itsInfo = pathInfo.itsInfo;
+    //* The vertex the current one is sampled from
+    std::shared_ptr<IntersectionInfo> prevInfo = nullptr;
     while (true) {
       beta *= pathInfo.weight;
       if (beta.isZero())
@@ -28,6 +63,13 @@ public:
         // when sample direct
         SpectrumRGB Le = itsInfo->evaluateLe();
         float pdf = itsInfo->pdfLe();
+        //* pdfLe excludes the choice of the emitter, which depends on the
+        //* vertex the direct sampling starts from
+        if (prevInfo && pdf != 0) {
+          auto light = static_cast<SurfaceIntersectionInfo *>(itsInfo.get())
+                           ->light;
+          pdf *= scene.pdfEmitter(light, *prevInfo);
+        }
         float misw = powerHeuristic(pathInfo.pdfDirection, pdf);
         Li += beta * Le * misw;
       }
@@ -37,11 +79,11 @@ public:
       if (bounces >= mMaxDepth)
         break;
       //* Sample the direct
-      {
+      if (mRISCandidates == 1) {
         LightSourceInfo lightSourceInfo =
             scene.sampleLightSource(*itsInfo, sampler);
         Ray3f shadowRay = itsInfo->scatterRay(scene, lightSourceInfo.position);
-        if (!scene.occlude(shadowRay)) {
+        if (lightSourceInfo.light && !scene.occlude(shadowRay)) {
           auto light = lightSourceInfo.light;
           auto [LeWeight, pdf] =
               light->evaluate(lightSourceInfo, itsInfo->position);
@@ -51,21 +93,24 @@ public:
             Li += beta * f * LeWeight * misw;
           }
         }
+      } else {
+        Li += beta * sampleDirectRIS(scene, *itsInfo, sampler);
       }
 
       //* Sample the bsdf
       ScatterInfo scatterInfo = itsInfo->sampleScatter(sampler->next2D());
       ray = itsInfo->scatterRay(scene, scatterInfo.wo);
+      prevInfo = itsInfo;
 
       //* Handle bssrdf if sample a transimission and bssrdf exists
       if (scatterInfo.type == ScatterSampleType::SurfaceTransmission) {
         auto sits = static_cast<SurfaceIntersectionInfo *>(itsInfo.get());
         if (auto bssrdf = sits->shape->getBSSRDF(); bssrdf) {
-          SurfaceIntersectionInfo po_info;
+          auto po_info = std::make_shared<SurfaceIntersectionInfo>();
           float pdf_sp = 0;
           SpectrumRGB sp =
               bssrdf->sample_sp(scene, *sits, sampler->next1D(),
-                                sampler->next2D(), &po_info, &pdf_sp);
+                                sampler->next2D(), po_info.get(), &pdf_sp);
           if (sp.isZero() || pdf_sp == 0)
             break;
           beta *= sp / pdf_sp;
@@ -73,24 +118,25 @@ public:
           //* Sample the direct for bssrdf
           {
             LightSourceInfo lightSourceInfo =
-                scene.sampleLightSource(po_info, sampler);
+                scene.sampleLightSource(*po_info, sampler);
             Ray3f shadowRay =
-                po_info.scatterRay(scene, lightSourceInfo.position);
-            if (!scene.occlude(shadowRay)) {
+                po_info->scatterRay(scene, lightSourceInfo.position);
+            if (lightSourceInfo.light && !scene.occlude(shadowRay)) {
               auto light = lightSourceInfo.light;
               auto [LeWeight, pdf] =
-                  light->evaluate(lightSourceInfo, po_info.position);
-              float sw = bssrdf->evaluate_sw(po_info, shadowRay.dir);
+                  light->evaluate(lightSourceInfo, po_info->position);
+              float sw = bssrdf->evaluate_sw(*po_info, shadowRay.dir);
               float misw =
-                  powerHeuristic(pdf, bssrdf->pdf_sw(po_info, shadowRay.dir));
+                  powerHeuristic(pdf, bssrdf->pdf_sw(*po_info, shadowRay.dir));
               if (sw != 0) {
                 Li += beta * sw * LeWeight * misw;
               }
             }
           }
           //* Sample the sw
-          scatterInfo = bssrdf->sample_sw(po_info, sampler->next2D());
-          ray = po_info.scatterRay(scene, scatterInfo.wo);
+          scatterInfo = bssrdf->sample_sw(*po_info, sampler->next2D());
+          ray = po_info->scatterRay(scene, scatterInfo.wo);
+          prevInfo = po_info;
         }
       }
 
@@ -105,6 +151,44 @@ public:
   }
 
 protected:
+  //* Unshadowed, MIS weighted contribution of the light sample at the vertex
+  SpectrumRGB evaluateDirect(const IntersectionInfo &itsInfo,
+                             const LightSourceInfo &lightSourceInfo) const {
+    if (!lightSourceInfo.light)
+      return SpectrumRGB{.0f};
+    Vector3f wo = lightSourceInfo.position - itsInfo.position;
+    if (wo.length2() == 0)
+      return SpectrumRGB{.0f};
+    wo = normalize(wo);
+    SpectrumRGB f = itsInfo.evaluateScatter(wo);
+    if (f.isZero())
+      return SpectrumRGB{.0f};
+    auto [LeWeight, pdf] =
+        lightSourceInfo.light->evaluate(lightSourceInfo, itsInfo.position);
+    float misw = powerHeuristic(pdf, itsInfo.pdfScatter(wo));
+    return f * LeWeight * misw;
+  }
+
+  //* Resample one of mRISCandidates light samples and trace a single shadow
+  //* ray
+  SpectrumRGB sampleDirectRIS(const Scene &scene,
+                              const IntersectionInfo &itsInfo,
+                              Sampler *sampler) const {
+    LightReservoir reservoir;
+    for (int i = 0; i < mRISCandidates; ++i) {
+      LightSourceInfo candidate = scene.sampleLightSource(itsInfo, sampler);
+      SpectrumRGB c = evaluateDirect(itsInfo, candidate);
+      reservoir.update(candidate, c, c.average(), sampler->next1D());
+    }
+
+    if (reservoir.wSum == 0)
+      return SpectrumRGB{.0f};
+    Ray3f shadowRay = itsInfo.scatterRay(scene, reservoir.sample.position);
+    if (scene.occlude(shadowRay))
+      return SpectrumRGB{.0f};
+    return reservoir.estimate();
+  }
+
   PathInfo samplePath(const Scene &scene, Ray3f ray, float pdfDirection,
                       SpectrumRGB weight) const {
     PathInfo pathInfo;
@@ -123,6 +207,8 @@ protected:
 protected:
   int mMaxDepth;
   int mRRThreshold;
+  //* The number of light candidates for the resampled direct lighting
+  int mRISCandidates = 1;
 };
 
 REGISTER_CLASS(PathTracer, "path-tracer")
\ No newline at end of file
@@ -0,0 +1,318 @@
+/**
+ * @file sdtree.h
+ * @brief Spatial-directional tree for the guided path tracer, following
+ * "Practical Path Guiding for Efficient Light-Transport Simulation"
+ * (Müller et al. 2017)
+ *
+ */
+#pragma once
+#include <core/geometry/geometry.h>
+#include <core/math/common.h>
+#include <core/math/math.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <stack>
+#include <vector>
+
+//* A node holds its four quadrants, quadrant i covers
+//* [x, x + 1/2] x [y, y + 1/2] with x = (i & 1) / 2 and y = (i >> 1) / 2
+struct QuadTreeNode {
+  QuadTreeNode() {
+    for (int i = 0; i < 4; ++i)
+      sum[i].store(0, std::memory_order_relaxed);
+    children.fill(0);
+  }
+
+  QuadTreeNode(const QuadTreeNode &other) { *this = other; }
+
+  QuadTreeNode &operator=(const QuadTreeNode &other) {
+    for (int i = 0; i < 4; ++i)
+      sum[i].store(other.sum[i].load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+    children = other.children;
+    return *this;
+  }
+
+  //* Pick the quadrant of p and remap p into it
+  int childIndex(Point2f &p) const {
+    int index = 0;
+    for (int axis = 0; axis < 2; ++axis) {
+      if (p[axis] < .5f) {
+        p[axis] *= 2;
+      } else {
+        p[axis] = (p[axis] - .5f) * 2;
+        index |= 1 << axis;
+      }
+    }
+    return index;
+  }
+
+  float total() const {
+    float result = 0;
+    for (int i = 0; i < 4; ++i)
+      result += sum[i].load(std::memory_order_relaxed);
+    return result;
+  }
+
+  bool isLeaf(int i) const { return children[i] == 0; }
+
+  std::array<std::atomic<float>, 4> sum;
+  //* Index of the child nodes, 0 means the quadrant is a leaf
+  std::array<int, 4> children;
+};
+
+//* Directional quadtree over the cylindrical mapping (cos(theta), phi) of the
+//* unit sphere, which is area preserving so the pdf is 4 * PI times smaller
+//* than the one in the unit square
+class DTree {
+public:
+  DTree() : nodes(1) {}
+
+  DTree(const DTree &other) { *this = other; }
+
+  DTree &operator=(const DTree &other) {
+    nodes = other.nodes;
+    weight.store(other.weight.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+    return *this;
+  }
+
+  static Point2f dirToCanonical(Vector3f d) {
+    float cosTheta = std::clamp(d.z, -1.f, 1.f);
+    float phi = std::atan2(d.y, d.x);
+    if (phi < 0)
+      phi += 2 * PI;
+    return Point2f{(cosTheta + 1) * .5f,
+                   std::min(phi * (.5f * INV_PI), 1 - EPSILON)};
+  }
+
+  static Vector3f canonicalToDir(Point2f p) {
+    float cosTheta = 2 * p.x - 1;
+    float phi = 2 * PI * p.y;
+    float sinTheta = std::sqrt(std::max(.0f, 1 - cosTheta * cosTheta));
+    return Vector3f{sinTheta * std::cos(phi), sinTheta * std::sin(phi),
+                    cosTheta};
+  }
+
+  //* Splat the estimated radiance / pdf of direction d
+  void record(Vector3f d, float value, float statisticalWeight) {
+    if (!std::isfinite(value) || value < 0)
+      return;
+    atomicAdd(weight, statisticalWeight);
+    Point2f p = dirToCanonical(d);
+    int node = 0;
+    while (true) {
+      int i = nodes[node].childIndex(p);
+      atomicAdd(nodes[node].sum[i], value * statisticalWeight);
+      if (nodes[node].isLeaf(i))
+        break;
+      node = nodes[node].children[i];
+    }
+  }
+
+  float pdf(Vector3f d) const {
+    float total = nodes[0].total();
+    if (total <= 0)
+      return (.25f * INV_PI);
+    Point2f p = dirToCanonical(d);
+    float result = 1;
+    int node = 0;
+    while (true) {
+      int i = nodes[node].childIndex(p);
+      float sum = nodes[node].sum[i].load(std::memory_order_relaxed);
+      if (sum <= 0)
+        return 0;
+      result *= 4 * sum / total;
+      if (nodes[node].isLeaf(i))
+        break;
+      total = sum;
+      node = nodes[node].children[i];
+    }
+    return result * (.25f * INV_PI);
+  }
+
+  Vector3f sample(Point2f u) const {
+    if (nodes[0].total() <= 0)
+      return canonicalToDir(u);
+    Point2f origin{0, 0};
+    float size = 1;
+    int node = 0;
+    while (true) {
+      const auto &n = nodes[node];
+      float s[4];
+      for (int i = 0; i < 4; ++i)
+        s[i] = n.sum[i].load(std::memory_order_relaxed);
+      //* Choose the column first, then the row within it
+      int x = 0, y = 0;
+      float pLeft = (s[0] + s[2]) / (s[0] + s[1] + s[2] + s[3]);
+      if (u.x < pLeft) {
+        u.x /= pLeft;
+      } else {
+        u.x = (u.x - pLeft) / (1 - pLeft);
+        x = 1;
+      }
+      float pBottom = s[x] / (s[x] + s[x + 2]);
+      if (u.y < pBottom) {
+        u.y /= pBottom;
+      } else {
+        u.y = (u.y - pBottom) / (1 - pBottom);
+        y = 1;
+      }
+      u.x = std::min(u.x, 1 - EPSILON);
+      u.y = std::min(u.y, 1 - EPSILON);
+      size *= .5f;
+      origin.x += x * size;
+      origin.y += y * size;
+      int i = x + 2 * y;
+      if (n.isLeaf(i))
+        return canonicalToDir(Point2f{origin.x + u.x * size,
+                                      origin.y + u.y * size});
+      node = n.children[i];
+    }
+  }
+
+  float statisticalWeight() const {
+    return weight.load(std::memory_order_relaxed);
+  }
+
+  void setStatisticalWeight(float w) {
+    weight.store(w, std::memory_order_relaxed);
+  }
+
+  //* Rebuild the structure from the energy recorded in previous, the
+  //* quadrants holding more than threshold of the total energy are
+  //* subdivided and the rest are collapsed. All sums are cleared
+  void refine(const DTree &previous, float threshold, int maxDepth) {
+    nodes.assign(1, QuadTreeNode{});
+    weight.store(0, std::memory_order_relaxed);
+    float total = previous.nodes[0].total();
+    if (total <= 0)
+      return;
+
+    struct Entry {
+      int node;
+      //* -1 if the node of previous tree is a leaf
+      int previousNode;
+      float energy;
+      int depth;
+    };
+    std::stack<Entry> stack;
+    stack.push({0, 0, total, 1});
+    while (!stack.empty()) {
+      Entry entry = stack.top();
+      stack.pop();
+      for (int i = 0; i < 4; ++i) {
+        float energy = entry.previousNode < 0
+                           ? entry.energy * .25f
+                           : previous.nodes[entry.previousNode].sum[i].load(
+                                 std::memory_order_relaxed);
+        if (entry.depth >= maxDepth || energy <= total * threshold)
+          continue;
+        int child = nodes.size();
+        nodes.emplace_back();
+        nodes[entry.node].children[i] = child;
+        int previousChild = -1;
+        if (entry.previousNode >= 0 &&
+            !previous.nodes[entry.previousNode].isLeaf(i))
+          previousChild = previous.nodes[entry.previousNode].children[i];
+        stack.push({child, previousChild, energy, entry.depth + 1});
+      }
+    }
+  }
+
+private:
+  std::vector<QuadTreeNode> nodes;
+  std::atomic<float> weight{0};
+};
+
+//* The sampling tree is read only in a pass while the building tree collects
+//* the records of the pass
+struct DTreeWrapper {
+  DTree building;
+  DTree sampling;
+
+  void record(Vector3f d, float value) { building.record(d, value, 1); }
+
+  float pdf(Vector3f d) const { return sampling.pdf(d); }
+
+  Vector3f sample(Point2f u) const { return sampling.sample(u); }
+
+  void build(float threshold, int maxDepth) {
+    sampling = building;
+    building.refine(sampling, threshold, maxDepth);
+  }
+};
+
+//* Spatial binary tree, the split axis alternates with the depth
+class STree {
+public:
+  struct Node {
+    bool isLeaf = true;
+    int axis = 0;
+    std::array<int, 2> children{0, 0};
+    DTreeWrapper dTree;
+  };
+
+  STree() = default;
+
+  STree(const AABB3f &sceneBounds) : nodes(1) {
+    //* Cubic bounds keep the subdivided cells cubic
+    Vector3f extent = sceneBounds.max - sceneBounds.min;
+    float size = std::max({extent.x, extent.y, extent.z});
+    bounds = AABB3f{sceneBounds.min, sceneBounds.min + Vector3f{size}};
+  }
+
+  DTreeWrapper *lookup(Point3f p) {
+    Vector3f extent = bounds.max - bounds.min;
+    Point3f local;
+    for (int axis = 0; axis < 3; ++axis)
+      local[axis] = std::clamp((p[axis] - bounds.min[axis]) / extent[axis],
+                               .0f, 1 - EPSILON);
+    int node = 0;
+    while (!nodes[node].isLeaf) {
+      int axis = nodes[node].axis;
+      int child = local[axis] < .5f ? 0 : 1;
+      local[axis] = local[axis] * 2 - child;
+      node = nodes[node].children[child];
+    }
+    return &nodes[node].dTree;
+  }
+
+  //* Split the leaves which collected more than threshold records, then
+  //* rebuild all directional trees. Not thread safe, call between passes
+  void refine(float threshold, float dTreeThreshold, int maxDepth) {
+    std::stack<std::pair<int, int>> stack;
+    stack.push({0, 0});
+    while (!stack.empty()) {
+      auto [node, depth] = stack.top();
+      stack.pop();
+      if (nodes[node].isLeaf &&
+          nodes[node].dTree.building.statisticalWeight() > threshold) {
+        int axis = depth % 3;
+        for (int i = 0; i < 2; ++i) {
+          Node child;
+          child.dTree = nodes[node].dTree;
+          //* Each half is expected to receive half of the records
+          child.dTree.building.setStatisticalWeight(
+              nodes[node].dTree.building.statisticalWeight() * .5f);
+          nodes[node].children[i] = nodes.size();
+          nodes.emplace_back(std::move(child));
+        }
+        nodes[node].isLeaf = false;
+        nodes[node].axis = axis;
+      }
+      if (!nodes[node].isLeaf)
+        for (int i = 0; i < 2; ++i)
+          stack.push({nodes[node].children[i], depth + 1});
+    }
+    for (auto &node : nodes)
+      if (node.isLeaf)
+        node.dTree.build(dTreeThreshold, maxDepth);
+  }
+
+private:
+  AABB3f bounds;
+  std::vector<Node> nodes;
+};
@@ -0,0 +1,408 @@
+#include <core/math/common.h>
+#include <core/math/warp.h>
+#include <core/render-core/camera.h>
+#include <core/render-core/film.h>
+#include <core/render-core/info.h>
+#include <core/render-core/integrator.h>
+#include <core/task/task.h>
+#include <tbb/tbb.h>
+
+#include <atomic>
+#include <chrono>
+
+//* The state of a pixel carried across the iterations
+struct SPPMPixel {
+  SPPMPixel() {
+    for (int i = 0; i < 3; ++i)
+      phi[i].store(0, std::memory_order_relaxed);
+  }
+
+  float radius = 0;
+  //* Emission and direct lighting gathered by the camera pass
+  SpectrumRGB Ld{.0f};
+  //* The diffuse hitpoint of the camera path in current iteration
+  struct VisiblePoint {
+    SurfaceIntersectionInfo info;
+    SpectrumRGB beta{.0f};
+  } vp;
+  //* Photon flux and count gathered in current iteration
+  std::atomic<float> phi[3];
+  std::atomic<int> M{0};
+  //* Accumulated photon count and flux of the previous iterations
+  float N = 0;
+  SpectrumRGB tau{.0f};
+};
+
+//*   Uniform grid over the visible points, whose cells are hashed into a
+//* table. A visible point is inserted into all cells its search sphere
+//* overlaps, the table is filled in parallel by counting sort
+class SPPMGrid {
+public:
+  void build(const std::vector<SPPMPixel> &pixels) {
+    int n_pixels = pixels.size();
+    float max_radius = 0;
+    bounds = AABB3f{};
+    for (const auto &pixel : pixels) {
+      if (pixel.vp.beta.isZero())
+        continue;
+      Vector3f r{pixel.radius};
+      bounds.expands(AABB3f{pixel.vp.info.position - r,
+                            pixel.vp.info.position + r});
+      max_radius = std::max(max_radius, pixel.radius);
+    }
+
+    hash_size = n_pixels;
+    cell_start.assign(hash_size + 1, 0);
+    entries.clear();
+    if (!bounds.isValid())
+      return;
+
+    Vector3f diag = bounds.max - bounds.min;
+    float max_diag = std::max({diag.x, diag.y, diag.z});
+    int base_res = std::max(1, int(max_diag / max_radius));
+    for (int i = 0; i < 3; ++i)
+      resolution[i] = std::max(1, int(base_res * diag[i] / max_diag));
+
+    if (cell_count.size() != hash_size)
+      cell_count = std::vector<std::atomic<int>>(hash_size);
+    for (auto &count : cell_count)
+      count.store(0, std::memory_order_relaxed);
+
+    //* Count the entries of each cell, then scatter them into place
+    auto for_each_cell = [&](const SPPMPixel &pixel, auto &&func) {
+      Vector3f r{pixel.radius};
+      Point3i p_min = to_grid(pixel.vp.info.position - r),
+              p_max = to_grid(pixel.vp.info.position + r);
+      for (int z = p_min.z; z <= p_max.z; ++z)
+        for (int y = p_min.y; y <= p_max.y; ++y)
+          for (int x = p_min.x; x <= p_max.x; ++x)
+            func(hash(Point3i{x, y, z}));
+    };
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, n_pixels),
+                      [&](const tbb::blocked_range<int> &r) {
+                        for (int i = r.begin(); i != r.end(); ++i) {
+                          if (pixels[i].vp.beta.isZero())
+                            continue;
+                          for_each_cell(pixels[i], [&](int h) {
+                            cell_count[h].fetch_add(1,
+                                                    std::memory_order_relaxed);
+                          });
+                        }
+                      });
+    for (int h = 0; h < hash_size; ++h) {
+      cell_start[h + 1] = cell_start[h] + cell_count[h].load();
+      cell_count[h].store(cell_start[h], std::memory_order_relaxed);
+    }
+    entries.resize(cell_start[hash_size]);
+    tbb::parallel_for(tbb::blocked_range<int>(0, n_pixels),
+                      [&](const tbb::blocked_range<int> &r) {
+                        for (int i = r.begin(); i != r.end(); ++i) {
+                          if (pixels[i].vp.beta.isZero())
+                            continue;
+                          for_each_cell(pixels[i], [&](int h) {
+                            entries[cell_count[h].fetch_add(
+                                1, std::memory_order_relaxed)] = i;
+                          });
+                        }
+                      });
+  }
+
+  //* Visit the pixels whose visible point may be within reach of p
+  template <typename Func> void lookup(Point3f p, Func &&func) const {
+    if (entries.empty() || !bounds.contains(p))
+      return;
+    int h = hash(to_grid(p));
+    for (int i = cell_start[h]; i < cell_start[h + 1]; ++i)
+      func(entries[i]);
+  }
+
+private:
+  Point3i to_grid(Point3f p) const {
+    Point3i result;
+    for (int i = 0; i < 3; ++i) {
+      int v = int(resolution[i] * (p[i] - bounds.min[i]) /
+                  (bounds.max[i] - bounds.min[i]));
+      result[i] = std::clamp(v, 0, resolution[i] - 1);
+    }
+    return result;
+  }
+
+  int hash(Point3i p) const {
+    return (unsigned)((p.x * 73856093) ^ (p.y * 19349663) ^
+                      (p.z * 83492791)) %
+           (unsigned)hash_size;
+  }
+
+  AABB3f bounds;
+  int resolution[3] = {1, 1, 1};
+  int hash_size = 0;
+  std::vector<std::atomic<int>> cell_count;
+  std::vector<int> cell_start;
+  //* Pixel indices sorted by cell
+  std::vector<int> entries;
+};
+
+//*   Stochastic progressive photon mapping. Each iteration traces a camera
+//* path per pixel through the specular surfaces to a diffuse visible point,
+//* then traces photons from Scene::sampleLightSource and gathers them at the
+//* visible points within the pixel radius, which shrinks over iterations.
+//* The direct lighting is estimated by the camera pass, so photons are only
+//* gathered after their first bounce
+class SPPMIntegrator : public Integrator {
+public:
+  SPPMIntegrator() : max_depth(5) {}
+
+  SPPMIntegrator(const rapidjson::Value &_value) {
+    max_depth = getInt("maxDepth", _value);
+
+    Params params(_value);
+    iterations = params.fetch<int>("iterations", 0);
+    photons_per_iteration = params.fetch<int>("photonsPerIteration", 0);
+    initial_radius = params.fetch<float>("initialRadius", 0);
+    alpha = params.fetch<float>("alpha", 2.f / 3.f);
+  }
+
+  virtual ~SPPMIntegrator() = default;
+
+  virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
+                            Sampler *sampler) const override {
+    // no implementation
+    std::cerr << "SPPMIntegrator::getLi not implement!\n";
+    std::exit(1);
+  }
+
+  virtual void render(std::shared_ptr<RenderTask> task) const override {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    Film &film = *task->film;
+    Point2i resolution = task->film_size;
+    int n_pixels = resolution.x * resolution.y, spp = task->getSpp();
+
+    auto ori_sampler = task->sampler;
+    const Camera *camera = task->camera.get();
+    auto scene = task->scene;
+
+    //* Iterations default to spp and photons to one per pixel each iteration
+    int n_iterations = iterations > 0 ? iterations : spp;
+    int n_photons =
+        photons_per_iteration > 0 ? photons_per_iteration : n_pixels;
+    float radius = initial_radius;
+    if (radius <= 0) {
+      AABB3f bounds = scene->getBounds();
+      radius = (bounds.max - bounds.min).length() * .005f;
+    }
+
+    std::vector<SPPMPixel> pixels(n_pixels);
+    for (auto &pixel : pixels)
+      pixel.radius = radius;
+    SPPMGrid grid;
+
+    for (int iteration = 0; iteration < n_iterations; ++iteration) {
+      //* Camera pass
+      tbb::parallel_for(
+          tbb::blocked_range<int>(0, resolution.y),
+          [&](const tbb::blocked_range<int> &r) {
+            auto sampler = ori_sampler->clone();
+            for (int y = r.begin(); y != r.end(); ++y)
+              for (int x = 0; x < resolution.x; ++x) {
+                Point2i p_pixel{x, y};
+                sampler->startPixel(p_pixel);
+                trace_visible_point(*scene, camera, p_pixel, resolution,
+                                    sampler.get(),
+                                    &pixels[x + y * resolution.x]);
+              }
+          });
+
+      grid.build(pixels);
+
+      //* Photon pass
+      tbb::parallel_for(
+          tbb::blocked_range<int>(0, n_photons, 1024),
+          [&](const tbb::blocked_range<int> &r) {
+            auto sampler = ori_sampler->clone();
+            for (int i = r.begin(); i != r.end(); ++i) {
+              //* The pixel samplers hold spp samples a time
+              if ((i - r.begin()) % spp == 0)
+                sampler->startPixel(Point2i{i, iteration});
+              trace_photon(*scene, grid, sampler.get(), &pixels);
+              sampler->nextSample();
+            }
+          });
+
+      //* Progressive radius reduction
+      tbb::parallel_for(tbb::blocked_range<int>(0, n_pixels),
+                        [&](const tbb::blocked_range<int> &r) {
+                          for (int i = r.begin(); i != r.end(); ++i)
+                            update_pixel(&pixels[i]);
+                        });
+
+      printProgress((double)(iteration + 1) / n_iterations);
+    }
+
+    //* Resolve the estimate into the film
+    float total_photons = (float)n_iterations * n_photons;
+    for (int y = 0; y < resolution.y; ++y)
+      for (int x = 0; x < resolution.x; ++x) {
+        const SPPMPixel &pixel = pixels[x + y * resolution.x];
+        SpectrumRGB L = pixel.Ld / n_iterations +
+                        pixel.tau / (total_photons * PI * pixel.radius *
+                                     pixel.radius);
+        film.add_sample(Point2i{x, y}, L, 1);
+      }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << tfm::format(
+        "\nRendering costs : %.2f seconds\n",
+        (float)std::chrono::duration_cast<std::chrono::milliseconds>(end -
+                                                                     start)
+                .count() /
+            1000.f);
+    film.save_as(task->file_name, 0);
+  }
+
+protected:
+  void trace_visible_point(const Scene &scene, const Camera *camera,
+                           Point2i p_pixel, Point2i resolution,
+                           Sampler *sampler, SPPMPixel *pixel) const {
+    Ray3f ray = camera->sampleRayDifferential(p_pixel, resolution,
+                                              sampler->getCameraSample());
+    SpectrumRGB beta{1.f};
+    SurfaceIntersectionInfo &info = pixel->vp.info;
+    pixel->vp.beta = SpectrumRGB{.0f};
+
+    for (int depth = 0; depth < max_depth; ++depth) {
+      scene.intersectWithSurface(ray, &info);
+      //* No light sampling happens before the visible point, so the
+      //* emission hit by the camera path is always counted
+      pixel->Ld += beta * info.evaluateLe();
+      if (!info.shape)
+        break;
+
+      if (info.shape->getBSDF()->isDiffuse()) {
+        LightSourceInfo light_info = scene.sampleLightSource(info, sampler);
+        Ray3f shadow_ray = info.scatterRay(scene, light_info.position);
+        if (light_info.light && !scene.occlude(shadow_ray)) {
+          auto [le_weight, pdf] =
+              light_info.light->evaluate(light_info, info.position);
+          pixel->Ld += beta * info.evaluateScatter(shadow_ray.dir) * le_weight;
+        }
+        pixel->vp.beta = beta;
+        break;
+      }
+
+      ScatterInfo scatter_info = info.sampleScatter(sampler->next2D());
+      if (scatter_info.weight.isZero())
+        break;
+      beta *= scatter_info.weight;
+      ray = info.scatterRay(scene, scatter_info.wo);
+    }
+  }
+
+  //* Sample a photon leaving the light, beta is its flux
+  bool emit_photon(const Scene &scene, Sampler *sampler, Ray3f *ray,
+                   SpectrumRGB *beta) const {
+    auto light_info = scene.sampleLightSource(sampler);
+    if (light_info.lightType == LightSourceInfo::LightType::Environment)
+      return false;
+
+    if (light_info.lightType == LightSourceInfo::LightType::Spot) {
+      //* Isotropic point emitter, Le is the intensity
+      Vector3f dir = Warp::squareToUniformSphere(sampler->next2D());
+      *beta = light_info.Le * (4 * PI) / light_info.pdfChoice;
+      *ray = Ray3f{light_info.position, dir};
+      return true;
+    }
+
+    Frame light_local{light_info.normal};
+    Vector3f dir_local = Warp::squareToCosineHemisphere(sampler->next2D()),
+             dir_world = light_local.toWorld(dir_local);
+    float pdf_pos = light_info.pdf,
+          pdf_dir = Warp::squareToCosineHemispherePdf(dir_local);
+    if (pdf_pos == 0 || pdf_dir == 0)
+      return false;
+    *beta = light_info.Le * std::abs(dot(light_info.normal, dir_world)) /
+            (pdf_pos * pdf_dir);
+    *ray = Ray3f{light_info.position, dir_world};
+    return true;
+  }
+
+  void trace_photon(const Scene &scene, const SPPMGrid &grid, Sampler *sampler,
+                    std::vector<SPPMPixel> *pixels) const {
+    Ray3f ray;
+    SpectrumRGB beta;
+    if (!emit_photon(scene, sampler, &ray, &beta))
+      return;
+
+    SurfaceIntersectionInfo info;
+    for (int depth = 0; depth < max_depth; ++depth) {
+      scene.intersectWithSurface(ray, &info);
+      if (!info.shape)
+        break;
+
+      //* The first hit is the direct lighting
+      if (depth > 0) {
+        Point3f p = info.position;
+        Vector3f wi = -ray.dir;
+        grid.lookup(p, [&](int index) {
+          SPPMPixel &pixel = (*pixels)[index];
+          const auto &vp = pixel.vp;
+          if ((vp.info.position - p).length2() > pixel.radius * pixel.radius)
+            return;
+          //* evaluateScatter carries the cosine of wi, which is already
+          //* accounted by the photon density
+          float cos_theta = std::abs(vp.info.toLocal(wi).y);
+          if (cos_theta < 1e-4f)
+            return;
+          SpectrumRGB phi =
+              beta * vp.info.evaluateScatter(wi) / cos_theta;
+          for (int i = 0; i < 3; ++i)
+            atomicAdd(pixel.phi[i], phi[i]);
+          pixel.M.fetch_add(1, std::memory_order_relaxed);
+        });
+      }
+
+      ScatterInfo scatter_info = info.sampleScatter(sampler->next2D());
+      if (scatter_info.weight.isZero())
+        break;
+      SpectrumRGB beta_new = beta * scatter_info.weight;
+      //* Russian roulette by the change of the throughput
+      float q = std::max(.0f, 1 - beta_new.average() / beta.average());
+      if (sampler->next1D() < q)
+        break;
+      beta = beta_new / (1 - q);
+      ray = info.scatterRay(scene, scatter_info.wo);
+    }
+  }
+
+  void update_pixel(SPPMPixel *pixel) const {
+    int M = pixel->M.load(std::memory_order_relaxed);
+    if (M > 0) {
+      float N_new = pixel->N + alpha * M,
+            radius_new = pixel->radius * std::sqrt(N_new / (pixel->N + M));
+      SpectrumRGB phi{pixel->phi[0].load(), pixel->phi[1].load(),
+                      pixel->phi[2].load()};
+      pixel->tau = (pixel->tau + pixel->vp.beta * phi) *
+                   (radius_new * radius_new) / (pixel->radius * pixel->radius);
+      pixel->N = N_new;
+      pixel->radius = radius_new;
+      pixel->M.store(0, std::memory_order_relaxed);
+      for (int i = 0; i < 3; ++i)
+        pixel->phi[i].store(0, std::memory_order_relaxed);
+    }
+    pixel->vp.beta = SpectrumRGB{.0f};
+  }
+
+private:
+  int max_depth;
+  //* 0 means the spp of the task
+  int iterations = 0;
+  //* 0 means the number of pixels
+  int photons_per_iteration = 0;
+  //* 0 means a fraction of the scene size
+  float initial_radius = 0;
+  //* The fraction of photons kept by each iteration
+  float alpha = 2.f / 3.f;
+};
+
+REGISTER_CLASS(SPPMIntegrator, "sppm")
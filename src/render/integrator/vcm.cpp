@@ -0,0 +1,536 @@
+#include <core/math/warp.h>
+#include <core/render-core/camera.h>
+#include <core/render-core/film.h>
+#include <core/render-core/info.h>
+#include <core/render-core/integrator.h>
+#include <core/task/task.h>
+#include <tbb/tbb.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "hashgrid.h"
+
+//* A vertex of a subpath, together with the recursive MIS quantities of
+//* "Light Transport Simulation with Vertex Connection and Merging"
+//* (Georgiev et al. 2012), beta of the vertex is the subpath throughput
+struct VCMVertex {
+  PathVertex vertex;
+  //* The number of segments from the origin of the subpath
+  int path_length = 0;
+  float dVCM = 0, dVC = 0, dVM = 0;
+};
+
+//*   Vertex connection and merging. Each iteration traces one light subpath
+//* per pixel, splats their connections to the camera, and stores their
+//* vertices in a hash grid. Then the camera subpath of each pixel is
+//* connected to the light sources, to the vertices of the light subpath with
+//* the same index, and merged with the light vertices within the radius,
+//* which shrinks over iterations. All strategies share a balance heuristic
+class VCMIntegrator : public Integrator {
+public:
+  VCMIntegrator() : max_depth(5) {}
+
+  VCMIntegrator(const rapidjson::Value &_value) {
+    max_depth = getInt("maxDepth", _value);
+
+    Params params(_value);
+    iterations = params.fetch<int>("iterations", 0);
+    initial_radius = params.fetch<float>("initialRadius", 0);
+    alpha = params.fetch<float>("alpha", .75f);
+  }
+
+  virtual ~VCMIntegrator() = default;
+
+  virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
+                            Sampler *sampler) const override {
+    // no implementation
+    std::cerr << "VCMIntegrator::getLi not implement!\n";
+    std::exit(1);
+  }
+
+  virtual void render(std::shared_ptr<RenderTask> task) const override {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    Film &film = *task->film;
+    Point2i resolution = task->film_size;
+    int n_pixels = resolution.x * resolution.y, spp = task->getSpp();
+    //* A subpath has at most max_length segments
+    int max_length = max_depth + 1;
+
+    auto ori_sampler = task->sampler;
+    const Camera *camera = task->camera.get();
+    auto scene = task->scene;
+
+    int n_iterations = iterations > 0 ? iterations : spp;
+    float radius = initial_radius;
+    if (radius <= 0) {
+      AABB3f bounds = scene->getBounds();
+      radius = (bounds.max - bounds.min).length() * .0015f;
+    }
+
+    //* The light vertices of an iteration, path i owns the slots
+    //* [i * max_length, i * max_length + n_vertices[i])
+    std::vector<VCMVertex> light_vertices((size_t)n_pixels * max_length);
+    std::vector<SurfaceIntersectionInfo> light_infos(light_vertices.size());
+    std::vector<int> n_vertices(n_pixels), stored;
+    HashGrid grid;
+
+    tbb::enumerable_thread_specific<std::vector<SpectrumRGB>> splat_buffers(
+        [&]() { return std::vector<SpectrumRGB>(n_pixels, SpectrumRGB{.0f}); });
+
+    for (int iteration = 0; iteration < n_iterations; ++iteration) {
+      MISFactors mis;
+      mis.radius =
+          radius / std::pow(float(iteration + 1), .5f * (1 - alpha));
+      //* eta = pi * r^2 * n_light_paths
+      float eta = PI * mis.radius * mis.radius * n_pixels;
+      mis.vm_weight = eta;
+      mis.vc_weight = 1.f / eta;
+      mis.vm_normalization = 1.f / eta;
+      mis.n_pixels = n_pixels;
+
+      //* Light pass
+      tbb::parallel_for(
+          tbb::blocked_range<int>(0, n_pixels, 256),
+          [&](const tbb::blocked_range<int> &r) {
+            auto &splats = splat_buffers.local();
+            auto sampler = ori_sampler->clone();
+            for (int i = r.begin(); i != r.end(); ++i) {
+              //* The pixel samplers hold spp samples a time
+              if ((i - r.begin()) % spp == 0)
+                sampler->startPixel(Point2i{i, iteration});
+              n_vertices[i] = trace_light_path(
+                  *scene, camera, resolution, sampler.get(), mis, max_length,
+                  &light_vertices[(size_t)i * max_length],
+                  &light_infos[(size_t)i * max_length], &splats);
+              sampler->nextSample();
+            }
+          });
+
+      stored.clear();
+      for (int i = 0; i < n_pixels; ++i)
+        for (int k = 0; k < n_vertices[i]; ++k)
+          stored.emplace_back(i * max_length + k);
+      grid.build(
+          stored.size(),
+          [&](int i) { return light_vertices[stored[i]].vertex.position; },
+          mis.radius);
+
+      //* Camera pass
+      tbb::parallel_for(
+          tbb::blocked_range<int>(0, resolution.y),
+          [&](const tbb::blocked_range<int> &r) {
+            auto sampler = ori_sampler->clone();
+            SurfaceIntersectionInfo info;
+            for (int y = r.begin(); y != r.end(); ++y)
+              for (int x = 0; x < resolution.x; ++x) {
+                Point2i p_pixel{x, y};
+                int index = x + y * resolution.x;
+                sampler->startPixel(p_pixel);
+                const VCMVertex *light_path =
+                    &light_vertices[(size_t)index * max_length];
+                SpectrumRGB L = trace_camera_path(
+                    *scene, camera, p_pixel, resolution, sampler.get(), mis,
+                    max_length, light_path, n_vertices[index], stored,
+                    light_vertices, grid, &info);
+                film.add_sample(p_pixel, L, 1);
+              }
+          });
+
+      printProgress((double)(iteration + 1) / n_iterations);
+    }
+
+    for (const auto &splats : splat_buffers)
+      film.add_splats(splats, 1.f / n_iterations);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << tfm::format(
+        "\nRendering costs : %.2f seconds\n",
+        (float)std::chrono::duration_cast<std::chrono::milliseconds>(end -
+                                                                     start)
+                .count() /
+            1000.f);
+    film.save_as(task->file_name, 0);
+  }
+
+protected:
+  struct MISFactors {
+    float radius;
+    //* The ratios between merging and connection strategies
+    float vm_weight, vc_weight;
+    //* 1 / (pi * r^2 * n_light_paths)
+    float vm_normalization;
+    //* Both the numbers of light paths and camera samples
+    int n_pixels;
+  };
+
+  static float cos_geometry(const SurfaceIntersectionInfo &info, Vector3f w) {
+    return std::abs(dot(info.geometryNormal, w));
+  }
+
+  static bool connectable(const SurfaceIntersectionInfo &info) {
+    return info.shape && !info.shape->getBSDF()->isDelta();
+  }
+
+  //* The pdf of the light origin when it is traced, in area measure
+  static float pdf_traced_origin(const Scene &scene, const Emitter *light) {
+    auto shape_ptr = light->shape.lock();
+    return scene.pdfEmitter(light) /
+           (shape_ptr ? shape_ptr->getSurfaceArea() : 1.f);
+  }
+
+  //* The pdf of the emitted direction, cosine weighted for the area lights
+  //* and uniform for the point lights
+  static float pdf_emit_dir(const Emitter *light, float cos_light) {
+    return light->shape.expired() ? .25f * INV_PI : cos_light * INV_PI;
+  }
+
+  //* Update the MIS quantities when the subpath reaches a new vertex
+  static void update_on_hit(VCMVertex *state, float dist2, float cos_in) {
+    state->dVCM *= dist2;
+    state->dVCM /= cos_in;
+    state->dVC /= cos_in;
+    state->dVM /= cos_in;
+  }
+
+  //* Sample the next direction of the subpath, update the throughput and MIS
+  //* quantities of the state
+  bool sample_scattering(const Scene &scene,
+                         const SurfaceIntersectionInfo &info, Sampler *sampler,
+                         const MISFactors &mis, VCMVertex *state,
+                         Ray3f *ray) const {
+    ScatterInfo scatter_info = info.sampleScatter(sampler->next2D());
+    if (scatter_info.weight.isZero() || scatter_info.pdf == 0)
+      return false;
+    float cos_out = cos_geometry(info, scatter_info.wo);
+    if (scatter_info.pdf == FINF) {
+      //* The pdfs of the delta lobe cancel out
+      state->dVCM = 0;
+      state->dVC *= cos_out;
+      state->dVM *= cos_out;
+    } else {
+      float pdf_fwd = scatter_info.pdf,
+            pdf_rev = info.pdfScatter(scatter_info.wo, info.wi);
+      state->dVC = cos_out / pdf_fwd *
+                   (state->dVC * pdf_rev + state->dVCM + mis.vm_weight);
+      state->dVM = cos_out / pdf_fwd *
+                   (state->dVM * pdf_rev + state->dVCM * mis.vc_weight + 1);
+      state->dVCM = 1.f / pdf_fwd;
+    }
+    state->vertex.beta *= scatter_info.weight;
+    *ray = info.scatterRay(scene, scatter_info.wo);
+    return true;
+  }
+
+  //* Trace a light subpath, splat its connections to the camera and return
+  //* the number of stored vertices
+  int trace_light_path(const Scene &scene, const Camera *camera,
+                       Point2i resolution, Sampler *sampler,
+                       const MISFactors &mis, int max_length,
+                       VCMVertex *vertices, SurfaceIntersectionInfo *infos,
+                       std::vector<SpectrumRGB> *splats) const {
+    auto light_info = scene.sampleLightSource(sampler);
+    if (light_info.lightType == LightSourceInfo::LightType::Environment)
+      return 0;
+    PathVertex origin = PathVertex::create_light(light_info);
+    bool delta_light = origin.is_delta_light();
+
+    Vector3f dir;
+    float cos_light = 1;
+    if (delta_light) {
+      dir = Warp::squareToUniformSphere(sampler->next2D());
+    } else {
+      Frame light_local{light_info.normal};
+      dir = light_local.toWorld(
+          Warp::squareToCosineHemisphere(sampler->next2D()));
+      cos_light = std::abs(dot(light_info.normal, dir));
+    }
+    float pdf_emit = pdf_traced_origin(scene, origin.light) *
+                     pdf_emit_dir(origin.light, cos_light);
+    if (pdf_emit == 0)
+      return 0;
+
+    VCMVertex state;
+    state.vertex.beta = light_info.Le * cos_light / pdf_emit;
+    //* The pdf of sampling the origin directly depends on the first hit
+    //* (light BVH), it is multiplied once the hit is known
+    state.dVCM = 1.f / pdf_emit;
+    state.dVC = delta_light ? 0 : cos_light / pdf_emit;
+    state.dVM = state.dVC * mis.vc_weight;
+
+    Ray3f ray{light_info.position, dir};
+    int n_stored = 0;
+    for (state.path_length = 1;; ++state.path_length) {
+      SurfaceIntersectionInfo &info = infos[n_stored];
+      scene.intersectWithSurface(ray, &info);
+      if (!info.shape)
+        break;
+
+      float dist2 = info.distance * info.distance,
+            cos_in = cos_geometry(info, info.wi);
+      if (cos_in == 0)
+        break;
+      if (state.path_length == 1) {
+        PathVertex hit;
+        hit.position = info.position;
+        hit.normal = info.geometryNormal;
+        state.dVCM *= origin.pdf_light_origin(scene, &hit);
+      }
+      update_on_hit(&state, dist2, cos_in);
+
+      if (connectable(info)) {
+        state.vertex.info = &info;
+        state.vertex.position = info.position;
+        state.vertex.normal = info.geometryNormal;
+        vertices[n_stored++] = state;
+        if (state.path_length + 1 <= max_length)
+          connect_to_camera(scene, camera, resolution, mis, state, splats);
+      }
+
+      if (state.path_length + 2 > max_length)
+        break;
+      //* The info slot is overwritten by the next hit unless it is stored
+      if (!sample_scattering(scene, info, sampler, mis, &state, &ray))
+        break;
+    }
+    return n_stored;
+  }
+
+  void connect_to_camera(const Scene &scene, const Camera *camera,
+                         Point2i resolution, const MISFactors &mis,
+                         const VCMVertex &state,
+                         std::vector<SpectrumRGB> *splats) const {
+    const SurfaceIntersectionInfo &info = *state.vertex.info;
+    Vector3f wi;
+    float pdf;
+    Point2f p_raster;
+    SpectrumRGB importance =
+        camera->sampleWi(info.position, Point2f(), &wi, &pdf, &p_raster);
+    if (pdf <= 0 || importance.isZero())
+      return;
+    if (!(0 <= p_raster.x && p_raster.x < 1 && 0 <= p_raster.y &&
+          p_raster.y < 1))
+      return;
+    SpectrumRGB f = info.evaluateScatter(wi);
+    if (f.isZero())
+      return;
+
+    Vector3f to_camera = camera->get_position() - info.position;
+    float dist2 = to_camera.length2(), pdf_pos, pdf_dir;
+    camera->pdfWe(Ray3f{camera->get_position(), -wi}, &pdf_pos, &pdf_dir);
+    float pdf_camera = pdf_dir * cos_geometry(info, wi) / dist2,
+          pdf_rev = info.pdfScatter(wi, info.wi);
+    float w_light =
+        pdf_camera * (mis.vm_weight + state.dVCM + state.dVC * pdf_rev);
+
+    Ray3f vis_ray{camera->get_position(), info.position};
+    if (scene.occlude(vis_ray))
+      return;
+    Point2i pixel{int(resolution.x * p_raster.x),
+                  int(resolution.y * p_raster.y)};
+    (*splats)[pixel.x + pixel.y * resolution.x] +=
+        state.vertex.beta * f * (importance / pdf) / (w_light + 1);
+  }
+
+  SpectrumRGB trace_camera_path(
+      const Scene &scene, const Camera *camera, Point2i p_pixel,
+      Point2i resolution, Sampler *sampler, const MISFactors &mis,
+      int max_length, const VCMVertex *light_path, int n_light_vertices,
+      const std::vector<int> &stored,
+      const std::vector<VCMVertex> &light_vertices, const HashGrid &grid,
+      SurfaceIntersectionInfo *info_ptr) const {
+    SpectrumRGB L{.0f};
+    Ray3f ray = camera->sampleRayDifferential(p_pixel, resolution,
+                                              sampler->getCameraSample());
+    float pdf_pos, pdf_dir;
+    camera->pdfWe(ray, &pdf_pos, &pdf_dir);
+    if (pdf_dir == 0)
+      return L;
+
+    VCMVertex state;
+    state.vertex.beta = SpectrumRGB{1.f};
+    //* n_light_paths / (n_pixels * pdf_dir)
+    state.dVCM = 1.f / pdf_dir;
+    state.dVC = state.dVM = 0;
+
+    SurfaceIntersectionInfo &info = *info_ptr;
+    PathVertex prev = PathVertex::create_camera(camera, ray, SpectrumRGB{1});
+    for (state.path_length = 1;; ++state.path_length) {
+      scene.intersectWithSurface(ray, &info);
+      if (!info.shape)
+        break;
+      float dist2 = info.distance * info.distance,
+            cos_in = cos_geometry(info, info.wi);
+      if (cos_in == 0)
+        break;
+      update_on_hit(&state, dist2, cos_in);
+      const SpectrumRGB &beta = state.vertex.beta;
+
+      //* Hit an emitter
+      if (info.light) {
+        SpectrumRGB Le = info.evaluateLe();
+        if (!Le.isZero())
+          L += beta * Le * emission_weight(scene, info, prev, state);
+      }
+      if (state.path_length >= max_length)
+        break;
+
+      if (connectable(info)) {
+        //* Connect to a light source
+        L += beta * direct_illumination(scene, info, sampler, mis, state);
+
+        //* Connect to the light vertices
+        for (int k = 0; k < n_light_vertices; ++k) {
+          const VCMVertex &light_vertex = light_path[k];
+          if (light_vertex.path_length + 1 + state.path_length > max_length)
+            break;
+          L += beta * light_vertex.vertex.beta *
+               connect_vertices(scene, info, state, light_vertex, mis);
+        }
+
+        //* Merge the light vertices nearby
+        SpectrumRGB merged{.0f};
+        float r2 = mis.radius * mis.radius;
+        grid.query(info.position, [&](int index) {
+          const VCMVertex &light_vertex = light_vertices[stored[index]];
+          if (light_vertex.path_length + state.path_length > max_length)
+            return;
+          if ((light_vertex.vertex.position - info.position).length2() > r2)
+            return;
+          //* The direction where the photon comes from
+          Vector3f light_dir = light_vertex.vertex.info->wi;
+          float cos_theta = std::abs(info.toLocal(light_dir).y);
+          if (cos_theta < 1e-4f)
+            return;
+          SpectrumRGB f = info.evaluateScatter(light_dir) / cos_theta;
+          if (f.isZero())
+            return;
+          float pdf_fwd = info.pdfScatter(light_dir),
+                pdf_rev = info.pdfScatter(light_dir, info.wi);
+          float w_light = light_vertex.dVCM * mis.vc_weight +
+                          light_vertex.dVM * pdf_fwd,
+                w_camera = state.dVCM * mis.vc_weight + state.dVM * pdf_rev;
+          merged += f * light_vertex.vertex.beta / (w_light + 1 + w_camera);
+        });
+        L += beta * merged * mis.vm_normalization;
+      }
+
+      prev.position = info.position;
+      prev.normal = info.geometryNormal;
+      if (!sample_scattering(scene, info, sampler, mis, &state, &ray))
+        break;
+    }
+    return L;
+  }
+
+  //* The MIS weight of the emission hit by the camera subpath
+  float emission_weight(const Scene &scene, const SurfaceIntersectionInfo &info,
+                        const PathVertex &prev, const VCMVertex &state) const {
+    if (state.path_length == 1)
+      return 1;
+    PathVertex origin;
+    origin.type = VertexType::LightVertex;
+    origin.light = info.light.get();
+    origin.position = info.position;
+    origin.normal = info.geometryNormal;
+    origin.primID = info.primID;
+    float pdf_direct = origin.pdf_light_origin(scene, &prev),
+          pdf_emit = pdf_traced_origin(scene, origin.light) *
+                     pdf_emit_dir(origin.light, cos_geometry(info, info.wi));
+    float w_camera = pdf_direct * state.dVCM + pdf_emit * state.dVC;
+    return 1.f / (1 + w_camera);
+  }
+
+  SpectrumRGB direct_illumination(const Scene &scene,
+                                  const SurfaceIntersectionInfo &info,
+                                  Sampler *sampler, const MISFactors &mis,
+                                  const VCMVertex &state) const {
+    LightSourceInfo light_info = scene.sampleLightSource(info, sampler);
+    if (!light_info.light)
+      return SpectrumRGB{.0f};
+    Vector3f to_light = light_info.position - info.position;
+    float dist2 = to_light.length2();
+    if (dist2 == 0)
+      return SpectrumRGB{.0f};
+    Vector3f dir = normalize(to_light);
+    SpectrumRGB f = info.evaluateScatter(dir);
+    if (f.isZero())
+      return SpectrumRGB{.0f};
+    Ray3f shadow_ray = info.scatterRay(scene, light_info.position);
+    if (scene.occlude(shadow_ray))
+      return SpectrumRGB{.0f};
+    auto [le_weight, unused] =
+        light_info.light->evaluate(light_info, info.position);
+
+    PathVertex light_vertex = PathVertex::create_light(light_info), ref;
+    ref.position = info.position;
+    ref.normal = info.geometryNormal;
+    bool delta_light = light_vertex.is_delta_light();
+    float cos_light =
+        delta_light ? 1.f : std::abs(dot(light_info.normal, dir));
+    if (cos_light == 0)
+      return SpectrumRGB{.0f};
+    //* The pdf of this strategy, in solid angle at the vertex
+    float pdf_direct =
+        light_vertex.pdf_light_origin(scene, &ref) * dist2 / cos_light;
+    if (pdf_direct == 0)
+      return SpectrumRGB{.0f};
+    float pdf_emit = pdf_traced_origin(scene, light_vertex.light) *
+                     pdf_emit_dir(light_vertex.light, cos_light);
+    float pdf_fwd = delta_light ? 0 : info.pdfScatter(dir),
+          pdf_rev = info.pdfScatter(dir, info.wi);
+
+    float w_light = pdf_fwd / pdf_direct,
+          w_camera = pdf_emit * cos_geometry(info, dir) /
+                     (pdf_direct * cos_light) *
+                     (mis.vm_weight + state.dVCM + state.dVC * pdf_rev);
+    return f * le_weight / (w_light + 1 + w_camera);
+  }
+
+  SpectrumRGB connect_vertices(const Scene &scene,
+                               const SurfaceIntersectionInfo &info,
+                               const VCMVertex &state,
+                               const VCMVertex &light_vertex,
+                               const MISFactors &mis) const {
+    const SurfaceIntersectionInfo &light_info = *light_vertex.vertex.info;
+    Vector3f d = light_info.position - info.position;
+    float dist2 = d.length2();
+    if (dist2 == 0)
+      return SpectrumRGB{.0f};
+    d = normalize(d);
+    SpectrumRGB f_camera = info.evaluateScatter(d),
+                f_light = light_info.evaluateScatter(-d);
+    if (f_camera.isZero() || f_light.isZero())
+      return SpectrumRGB{.0f};
+
+    float camera_pdf_fwd = info.pdfScatter(d),
+          camera_pdf_rev = info.pdfScatter(d, info.wi),
+          light_pdf_fwd = light_info.pdfScatter(-d),
+          light_pdf_rev = light_info.pdfScatter(-d, light_info.wi);
+    //* Convert to the area measure at the other end
+    float camera_pdf_a = camera_pdf_fwd * cos_geometry(light_info, d) / dist2,
+          light_pdf_a = light_pdf_fwd * cos_geometry(info, d) / dist2;
+
+    float w_light = camera_pdf_a * (mis.vm_weight + light_vertex.dVCM +
+                                    light_vertex.dVC * light_pdf_rev),
+          w_camera = light_pdf_a *
+                     (mis.vm_weight + state.dVCM + state.dVC * camera_pdf_rev);
+
+    Ray3f vis_ray{light_info.position, info.position};
+    if (scene.occlude(vis_ray))
+      return SpectrumRGB{.0f};
+    return f_camera * f_light / dist2 / (w_light + 1 + w_camera);
+  }
+
+private:
+  int max_depth;
+  //* 0 means the spp of the task
+  int iterations = 0;
+  //* 0 means a fraction of the scene size
+  float initial_radius = 0;
+  //* The radius shrinks as r_i = r_0 * i ^ ((alpha - 1) / 2)
+  float alpha = .75f;
+};
+
+REGISTER_CLASS(VCMIntegrator, "vcm")
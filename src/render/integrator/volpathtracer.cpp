@@ -1,411 +1,292 @@
+#include <core/math/common.h>
 #include <core/render-core/integrator.h>
 
+//*   Volumetric path tracer with multiple scattering. The free flights are
+//* sampled by the media along each segment between null interfaces, and both
+//* surface and medium vertices estimate the direct light through the
+//* transmittance of the shadow ray, combined with the emission hit by the
+//* scattered ray through MIS.
+//*   In the media with a closed form distance pdf, the direct light is also
+//* estimated at distances sampled equiangularly towards a light point, which
+//* catches the single scattering near small lights. The three strategies are
+//* combined by the power heuristic in the distance x solid angle measure
 class VolPathTracer : public PixelIntegrator {
- public:
+public:
   VolPathTracer() : mMaxDepth(5), mRRThreshold(3) {}
 
   VolPathTracer(const rapidjson::Value &_value) {
     mMaxDepth = getInt("maxDepth", _value);
     mRRThreshold = getInt("rrThreshold", _value);
+    Params params(_value);
+    mEquiAngular = params.fetch<bool>("equiAngular", true);
   }
 
-  // *Single scattering
   virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
                             Sampler *sampler) const override {
+    static thread_local std::vector<MediumSegment> segments;
+
     SpectrumRGB Li{.0f}, beta{1.f};
-    int bounces = 0;
-    PathInfo pathInfo = samplePath(scene, ray, sampler);
-    const auto &itsInfo = pathInfo.itsInfo;
-    while (bounces <= mMaxDepth) {
-      beta *= pathInfo.weight;
-      if (beta.isZero()) break;
-      //* Evaluate the Le
-      {
-        SpectrumRGB Le = itsInfo->evaluateLe();
-        float pdf = itsInfo->pdfLe();
-        float misw = powerHeuristic(pathInfo.pdfDirection, pdf);
-        Li += beta * Le * misw;
-      }
-      if (itsInfo->terminate()) break;
-      //* Sample direct
-      {
-        LightSourceInfo lightSourceInfo =
-            scene.sampleLightSource(*itsInfo, sampler);
-        Ray3f shadowRay = itsInfo->scatterRay(scene, lightSourceInfo.position);
-        SpectrumRGB Tr = tr(scene, shadowRay);
-        auto light = lightSourceInfo.light;
-        auto [LeWeight, pdf] =
-            light->evaluate(lightSourceInfo, itsInfo->position);
-        SpectrumRGB f = itsInfo->evaluateScatter(shadowRay.dir);
-        float misw = powerHeuristic(pdf, itsInfo->pdfScatter(shadowRay.dir));
-        Li += beta * f * LeWeight * Tr * misw;
-      }
-      //* Sample the scatter
-      ScatterInfo scatterInfo = itsInfo->sampleScatter(sampler->next2D());
-      ray = itsInfo->scatterRay(scene, scatterInfo.wo);
-      pathInfo = samplePath(scene, ray, sampler, &scatterInfo);
-      if (bounces++ > mRRThreshold) {
-        if (sampler->next1D() > 0.95f) break;
-        beta /= 0.95;
-      }
-    }
-    return Li;
-  }
+    SurfaceIntersectionInfo surfaceInfo;
+    std::shared_ptr<MediumIntersectionInfo> mediumInfo;
+    //* The vertex the current ray starts from, for the emitter choice pdf
+    bool hasPrev = false;
+    Point3f prevPosition;
+    Vector3f prevNormal;
+    VertexSegment prevSegment;
+    float pdfDirection = FINF;
 
- protected:
-  int mMaxDepth;
-  int mRRThreshold;
+    for (int bounces = 0;; ++bounces) {
+      scene.intersectThroughNull(ray, &surfaceInfo, &segments);
 
-  //* This method samples a intersection (surface or medium) along the ray in
-  // scene,
-  //* The empty surface will be skipped
-  //*     1. If the scatter is medium, next scatter event will be surface
-  // intersection
-  //*     2. If the scatter is surface, next scatter will be surface / medium
-  // intersection
-  PathInfo samplePath(const Scene &scene, Ray3f ray, Sampler *sampler,
-                      const ScatterInfo *info = nullptr) const {
-    //* If no scatter info is provided, pdfDirection if FINF
-    PathInfo pathInfo;
-    pathInfo.pdfDirection = info ? info->pdf : FINF;
-    pathInfo.length = 0;
-    pathInfo.weight = info ? info->weight : SpectrumRGB{1};
-    //* Single scattering, so no medium intersection in this situation
-    if (info && info->scatterType == ScatterInfo::ScatterType::Medium) {
-      std::shared_ptr<SurfaceIntersectionInfo> sIts;
-      do {
-        sIts = scene.intersectWithSurface(ray);
-        if (auto medium = ray.medium; medium) {
-          pathInfo.weight *= medium->evaluateTr(ray.ori, sIts->position);
-        }
-        pathInfo.length += sIts->distance;
-        if (sIts->terminate()) break;
-        ray = sIts->scatterRay(scene, ray.dir);
-      } while (sIts->shape &&
-               sIts->shape->getBSDF()->m_type == BSDF::EBSDFType::EEmpty);
-      pathInfo.itsInfo = sIts;
-      pathInfo.vertex = sIts->position;
-    }
-    //* Sample a medium intersection or surface intersection along the ray
-    else {
-      std::shared_ptr<SurfaceIntersectionInfo> sIts;
-      do {
-        sIts = scene.intersectWithSurface(ray);
-        if (auto medium = ray.medium; medium) {
-          auto mIts = medium->sampleIntersection(ray, sIts->distance,
-                                                 sampler->next2D());
-          pathInfo.weight *= mIts->weight;
-          if (mIts->medium) {
-            //* Successfully sample a medium intersection
-            pathInfo.itsInfo = mIts;
-            pathInfo.vertex = mIts->position;
-            pathInfo.length += mIts->distance;
-            break;
-          }
-        }
-        //* No, hit the surface
-        pathInfo.itsInfo = sIts;
-        pathInfo.vertex = sIts->position;
-        pathInfo.length += sIts->distance;
-        if (sIts->terminate()) break;
-        ray = sIts->scatterRay(scene, ray.dir);
-      } while (sIts->shape &&
-               sIts->shape->getBSDF()->m_type == BSDF::EBSDFType::EEmpty);
-    }
-    return pathInfo;
-  }
+      if (mEquiAngular && bounces < mMaxDepth)
+        Li += beta * equiAngularDirect(scene, ray, segments, sampler);
 
-  SpectrumRGB tr(const Scene &scene, Ray3f ray) const {
-    SpectrumRGB Tr{1.f};
-    Point3f destination = ray.at(ray.tmax - 0.001);
-    auto info = scene.intersectWithSurface(ray);
-    while (true) {
-      if (info->shape &&
-          info->shape->getBSDF()->m_type != BSDF::EBSDFType::EEmpty) {
-        Tr = SpectrumRGB{.0f};
-        break;
-      } else if (!info->shape) {
-        if (auto medium = ray.medium; medium) {
-          Tr *= medium->evaluateTr(ray.ori, destination);
-        }
-        break;
-      } else if (info->shape->getBSDF()->m_type == BSDF::EBSDFType::EEmpty) {
-        if (auto medium = ray.medium; medium) {
-          Tr *= medium->evaluateTr(ray.ori, info->position);
+      //* Sample a medium interaction segment by segment, the weight of a
+      //* flight passing a segment is its transmittance / pdf
+      mediumInfo = nullptr;
+      VertexSegment vertexSegment;
+      for (const auto &segment : segments) {
+        if (!segment.medium)
+          continue;
+        Ray3f segmentRay{ray.at(segment.tmin), ray.dir};
+        segmentRay.medium = segment.medium;
+        float length = segment.tmax - segment.tmin;
+        auto mIts = segment.medium->sampleIntersection(segmentRay, length,
+                                                       sampler->next2D());
+        beta *= mIts->weight;
+        if (mIts->medium) {
+          mediumInfo = mIts;
+          float pdfDistance = segment.medium->pdfDistance(mIts->distance);
+          if (mEquiAngular && pdfDistance >= 0)
+            vertexSegment = VertexSegment{true, segmentRay, length,
+                                          mIts->distance, pdfDistance};
+          break;
         }
-        ray = info->scatterRay(scene, ray.dir);
-        info = scene.intersectWithSurface(ray);
       }
-    }
-    return Tr;
-  }
-};
-REGISTER_CLASS(VolPathTracer, "volpath-tracer")
-
-class VolPathTracerPlus : public PixelIntegrator {
- public:
-  VolPathTracerPlus() : mMaxDepth(5), mRRThreshold(3) {}
-
-  VolPathTracerPlus(const rapidjson::Value &_value) {
-    mMaxDepth = getInt("maxDepth", _value);
-    mRRThreshold = getInt("rrThreshold", _value);
-  }
+      if (beta.isZero())
+        break;
 
-  virtual SpectrumRGB getLi(const Scene &scene, Ray3f ray,
-                            Sampler *sampler) const override {
-    return equi_angular(scene, ray, sampler);
-    SpectrumRGB Li{.0f}, beta{1.f};
-    int bounces = 0;
-    auto paths = samplePath(scene, ray, sampler);
-    const auto &surfacePath = paths.first, &mediumPath = paths.second;
-    while (bounces <= mMaxDepth) {
-      //* Evaluate Le
-      // medium no emission now
-      // ...
-      //* Surface emission
-      {
-        SpectrumRGB Le = surfacePath.itsInfo->evaluateLe();
-        float pdf = surfacePath.itsInfo->pdfLe();
-        float misw = powerHeuristic(surfacePath.pdfDirection, pdf);
-        if (!surfacePath.weight.isZero())
-          Li += beta * surfacePath.weight * Le * misw;
+      if (!mediumInfo) {
+        //* Evaluate the Le using mis
+        SpectrumRGB Le = surfaceInfo.evaluateLe();
+        float pdf = surfaceInfo.pdfLe();
+        if (hasPrev && pdf != 0)
+          pdf *= scene.pdfEmitter(surfaceInfo.light, prevPosition, prevNormal);
+        //* Only the emitters on surfaces are sampled equiangularly
+        float pdfDistance = prevSegment.pdfDistance, pdfEquiAngular = 0;
+        if (surfaceInfo.shape && surfaceInfo.light)
+          pdfEquiAngular = prevSegment.pdfEquiAngular(surfaceInfo.position);
+        if (pdfEquiAngular > 0)
+          pdfEquiAngular *= pdfEquiAngularLight(
+              scene, surfaceInfo.light, surfaceInfo.position,
+              surfaceInfo.geometryNormal, prevPosition);
+        float misw = powerHeuristic(pdfDistance * pdfDirection,
+                                    pdfDistance * pdf, pdfEquiAngular);
+        if (!Le.isZero())
+          Li += beta * Le * misw;
+        if (surfaceInfo.terminate())
+          break;
       }
+      if (bounces >= mMaxDepth)
+        break;
+
+      const IntersectionInfo &itsInfo =
+          mediumInfo ? (const IntersectionInfo &)*mediumInfo : surfaceInfo;
 
-      //* Evaluate direct
+      //* Sample the direct through the media
       {
-        //* Evaluate medium direct
-        if (mediumPath.itsInfo) {
-          const auto &itsInfo = mediumPath.itsInfo;
-          LightSourceInfo lightSourceInfo =
-              scene.sampleLightSource(*itsInfo, sampler);
-          Ray3f shadowRay =
-              itsInfo->scatterRay(scene, lightSourceInfo.position);
-          SpectrumRGB Tr = tr(scene, shadowRay);
-          auto light = lightSourceInfo.light;
-          auto [LeWeight, pdf] =
-              light->evaluate(lightSourceInfo, itsInfo->position);
-          SpectrumRGB f = itsInfo->evaluateScatter(shadowRay.dir);
-          float misw = powerHeuristic(pdf, itsInfo->pdfScatter(shadowRay.dir));
-          if (!mediumPath.weight.isZero())
-            Li += beta * mediumPath.weight * f * LeWeight * Tr * misw;
-        }
-        //* Evaluate surface direct
-        if (!surfacePath.itsInfo->terminate()) {
-          const auto &itsInfo = surfacePath.itsInfo;
-          LightSourceInfo lightSourceInfo =
-              scene.sampleLightSource(*itsInfo, sampler);
-          Ray3f shadowRay =
-              itsInfo->scatterRay(scene, lightSourceInfo.position);
-          SpectrumRGB Tr = tr(scene, shadowRay);
+        LightSourceInfo lightSourceInfo =
+            scene.sampleLightSource(itsInfo, sampler);
+        Ray3f shadowRay = itsInfo.scatterRay(scene, lightSourceInfo.position);
+        SpectrumRGB Tr = lightSourceInfo.light
+                             ? transmittance(scene, shadowRay)
+                             : SpectrumRGB{.0f};
+        if (!Tr.isZero()) {
           auto light = lightSourceInfo.light;
           auto [LeWeight, pdf] =
-              light->evaluate(lightSourceInfo, itsInfo->position);
-          SpectrumRGB f = itsInfo->evaluateScatter(shadowRay.dir);
-          float misw = powerHeuristic(pdf, itsInfo->pdfScatter(shadowRay.dir));
-          if (!surfacePath.weight.isZero())
-            Li += beta * surfacePath.weight * f * LeWeight * Tr * misw;
+              light->evaluate(lightSourceInfo, itsInfo.position);
+          SpectrumRGB f = itsInfo.evaluateScatter(shadowRay.dir);
+          //* The delta lights can't be hit, only the two light sampling
+          //* strategies compete for them with the probabilities of choosing
+          //* the light
+          bool delta = pdf == FINF;
+          float pdfLight = delta ? lightSourceInfo.pdfChoice : pdf,
+                pdfScatter = delta ? 0 : itsInfo.pdfScatter(shadowRay.dir),
+                pdfEquiAngular = 0;
+          if (isEquiAngularLight(lightSourceInfo))
+            pdfEquiAngular =
+                vertexSegment.pdfEquiAngular(lightSourceInfo.position);
+          if (pdfEquiAngular > 0)
+            pdfEquiAngular *=
+                delta ? scene.pdfEmitter(light)
+                      : pdfEquiAngularLight(scene, light,
+                                            lightSourceInfo.position,
+                                            lightSourceInfo.normal,
+                                            itsInfo.position);
+          float misw = powerHeuristic(vertexSegment.pdfDistance * pdfLight,
+                                      vertexSegment.pdfDistance * pdfScatter,
+                                      pdfEquiAngular);
+          if (!f.isZero())
+            Li += beta * f * LeWeight * Tr * misw;
         }
       }
-      //* If no mediumIntersection and surfaceIntersection terminate
-      if (!mediumPath.itsInfo && surfacePath.itsInfo->terminate()) break;
 
-      //* Choose one path to continue
-      PathInfo pathInfo;
-      if (surfacePath.itsInfo->terminate()) {
-        pathInfo = mediumPath;
-      } else if (!mediumPath.itsInfo) {
-        pathInfo = surfacePath;
-      } else {
-        float xi = sampler->next1D(),
-              ratio =
-                  mediumPath.weight.average() + surfacePath.weight.average(),
-              sample = xi * ratio;
-        //                if (ratio == 0) break;
-        if (sample < mediumPath.weight.average()) {
-          //* Choose medium scatter
-          pathInfo = mediumPath;
-          pathInfo.weight /= (mediumPath.weight.average() / ratio);
-        } else {
-          //* Choose surface scatter
-          pathInfo = surfacePath;
-          pathInfo.weight /= (surfacePath.weight.average() / ratio);
-        }
-      }
-      beta *= pathInfo.weight;
-      //* Sample scatter
-      ScatterInfo scatterInfo =
-          pathInfo.itsInfo->sampleScatter(sampler->next2D());
-      ray = pathInfo.itsInfo->scatterRay(scene, scatterInfo.wo);
-      paths = samplePath(scene, ray, sampler, &scatterInfo);
-      //* rr
-      if (bounces++ > mRRThreshold) {
-        if (sampler->next1D() > 0.95f) break;
+      //* Sample the bsdf or the phase function
+      ScatterInfo scatterInfo = itsInfo.sampleScatter(sampler->next2D());
+      if (scatterInfo.weight.isZero())
+        break;
+      beta *= scatterInfo.weight;
+      ray = itsInfo.scatterRay(scene, scatterInfo.wo);
+      hasPrev = true;
+      prevPosition = itsInfo.position;
+      prevNormal = mediumInfo ? Vector3f{0} : surfaceInfo.geometryNormal;
+      prevSegment = vertexSegment;
+      pdfDirection = scatterInfo.pdf;
+
+      if (bounces > mRRThreshold) {
+        if (sampler->next1D() > 0.95f)
+          break;
         beta /= 0.95;
       }
     }
     return Li;
   }
 
-  SpectrumRGB equi_angular(const Scene &scene, Ray3f ray,
-                           Sampler *sampler) const {
-    SpectrumRGB Li{.0f}, beta{1.f};
-    int bounces = 0;
-    LightSourceInfo lightInfo = scene.sampleLightSource(sampler);
-    auto paths = samplePath(scene, ray, sampler, nullptr, &lightInfo);
-    const auto &surfacePath = paths.first, &mediumPath = paths.second;
+protected:
+  int mMaxDepth;
+  int mRRThreshold;
+  bool mEquiAngular = true;
 
-    while (bounces <= mMaxDepth) {
-      //* Evaluate Le
-      // medium no emission now
-      // ...
-      //* Surface emission
-      {
-        SpectrumRGB Le = surfacePath.itsInfo->evaluateLe();
-        float pdf = surfacePath.itsInfo->pdfLe();
-        float misw = powerHeuristic(surfacePath.pdfDirection, pdf);
-        if (!surfacePath.weight.isZero())
-          Li += beta * surfacePath.weight * Le * misw;
-      }
+  //*   The segment a medium vertex was distance sampled in, when equiangular
+  //* sampling could have chosen the same vertex. Outside such segments the
+  //* distance pdf is left out of the MIS weights
+  struct VertexSegment {
+    bool equiAngular = false;
+    Ray3f ray;
+    float length = 0, distance = 0, pdfDistance = 1;
 
-      //* Evaluate direct
-      {
-        //* Evaluate medium direct
-        if (mediumPath.itsInfo) {
-          const auto &itsInfo = mediumPath.itsInfo;
-          Ray3f shadowRay = itsInfo->scatterRay(scene, lightInfo.position);
-          SpectrumRGB Tr = tr(scene, shadowRay);
-          auto light = lightInfo.light;
-          auto [LeWeight, pdf] = light->evaluate(lightInfo, itsInfo->position);
-          SpectrumRGB f = itsInfo->evaluateScatter(shadowRay.dir);
-          float misw = powerHeuristic(pdf, itsInfo->pdfScatter(shadowRay.dir));
-          if (!mediumPath.weight.isZero())
-            Li += beta * mediumPath.weight * f * LeWeight * Tr * misw;
-        }
-        //* Evaluate surface direct
-        if (!surfacePath.itsInfo->terminate()) {
-          const auto &itsInfo = surfacePath.itsInfo;
-          Ray3f shadowRay = itsInfo->scatterRay(scene, lightInfo.position);
-          SpectrumRGB Tr = tr(scene, shadowRay);
-          auto light = lightInfo.light;
-          auto [LeWeight, pdf] = light->evaluate(lightInfo, itsInfo->position);
-          SpectrumRGB f = itsInfo->evaluateScatter(shadowRay.dir);
-          float misw = powerHeuristic(pdf, itsInfo->pdfScatter(shadowRay.dir));
-          if (!surfacePath.weight.isZero())
-            Li += beta * surfacePath.weight * f * LeWeight * Tr * misw;
-        }
-      }
-      if (!mediumPath.itsInfo && surfacePath.itsInfo->terminate()) break;
+    float pdfEquiAngular(Point3f lightPosition) const {
+      return equiAngular ? Medium::pdfEquiAngular(ray, length, distance,
+                                                  lightPosition)
+                         : .0f;
+    }
+  };
 
-      //* Choose one path to continue
-      PathInfo pathInfo;
-      if (surfacePath.itsInfo->terminate()) {
-        pathInfo = mediumPath;
-      } else if (!mediumPath.itsInfo) {
-        pathInfo = surfacePath;
-      } else {
-        float xi = Sampler::sample1D(),
-              ratio =
-                  mediumPath.weight.average() + surfacePath.weight.average(),
-              sample = xi * ratio;
-        if (ratio == 0) break;
-        if (sample < mediumPath.weight.average()) {
-          //* Choose medium scatter
-          pathInfo = mediumPath;
-          pathInfo.weight /= (mediumPath.weight.average() / ratio);
-        } else {
-          //* Choose surface scatter
-          pathInfo = surfacePath;
-          pathInfo.weight /= (surfacePath.weight.average()) / ratio;
-        }
-      }
+  static bool isEquiAngularLight(const LightSourceInfo &info) {
+    return info.lightType == LightSourceInfo::LightType::Area ||
+           info.lightType == LightSourceInfo::LightType::Spot;
+  }
 
-      beta *= pathInfo.weight;
-      ScatterInfo scatterInfo =
-          pathInfo.itsInfo->sampleScatter(sampler->next2D());
-      ray = pathInfo.itsInfo->scatterRay(scene, scatterInfo.wo);
-      lightInfo = scene.sampleLightSource(sampler);
-      paths = samplePath(scene, ray, sampler, &scatterInfo, &lightInfo);
-      //* rr
-      if (bounces++ > mRRThreshold) {
-        if (sampler->next1D() > 0.95f) break;
-        beta /= 0.95;
+  //*   The direct light scattered along the segments of the ray from the
+  //* distances sampled equiangularly. As the distance isn't known yet, the
+  //* segments are lit from the points of scene.sampleLightSource(sampler),
+  //* on an emitter chosen uniformly
+  SpectrumRGB equiAngularDirect(const Scene &scene, const Ray3f &ray,
+                                const std::vector<MediumSegment> &segments,
+                                Sampler *sampler) const {
+    int last = -1;
+    for (int i = 0; i < segments.size(); ++i)
+      if (segments[i].medium && segments[i].medium->pdfDistance(0) >= 0)
+        last = i;
+
+    SpectrumRGB L{.0f}, Tr{1.f};
+    for (int i = 0; i <= last && !Tr.isZero(); ++i) {
+      const auto &segment = segments[i];
+      if (!segment.medium)
+        continue;
+      const Medium *medium = segment.medium;
+      Ray3f segmentRay{ray.at(segment.tmin), ray.dir};
+      segmentRay.medium = medium;
+      float length = segment.tmax - segment.tmin;
+
+      LightSourceInfo lightSourceInfo;
+      std::shared_ptr<MediumIntersectionInfo> mIts;
+      if (medium->pdfDistance(0) >= 0) {
+        lightSourceInfo = scene.sampleLightSource(sampler);
+        if (isEquiAngularLight(lightSourceInfo))
+          mIts = medium->sampleIntersectionEquiAngular(
+              segmentRay, length, sampler->next2D(), lightSourceInfo);
+      }
+      if (mIts) {
+        Ray3f shadowRay = mIts->scatterRay(scene, lightSourceInfo.position);
+        SpectrumRGB TrShadow = transmittance(scene, shadowRay);
+        auto light = lightSourceInfo.light;
+        auto [LeWeight, pdf] = light->evaluate(lightSourceInfo, mIts->position);
+        SpectrumRGB f = mIts->evaluateScatter(shadowRay.dir);
+        if (!TrShadow.isZero() && !LeWeight.isZero() && !f.isZero()) {
+          //*   The light point was chosen with the pdf returned by evaluate,
+          //* while the weights take the pdfs of the strategies at the
+          //* distance sampled vertex, whose emitter choice depends on the
+          //* position
+          bool delta = pdf == FINF;
+          Point3f p = mIts->position;
+          float pdfChosen = delta ? lightSourceInfo.pdfChoice : pdf,
+                pdfLight = delta ? scene.pdfEmitter(light, p, Vector3f{0})
+                                 : pdfLightSource(scene, lightSourceInfo, p),
+                pdfScatter = delta ? 0 : mIts->pdfScatter(shadowRay.dir),
+                pdfDistance = medium->pdfDistance(mIts->distance);
+          float misw = powerHeuristic(mIts->pdf * pdfChosen,
+                                      pdfDistance * pdfLight,
+                                      pdfDistance * pdfScatter);
+          L += Tr * mIts->weight * f * LeWeight * TrShadow * misw;
+        }
       }
+      //* The transmittance to the start of the next segment
+      if (i < last)
+        Tr *= medium->evaluateTr(segmentRay.ori, ray.at(segment.tmax));
     }
-    return Li;
+    return L;
   }
 
- protected:
-  int mMaxDepth;
-  int mRRThreshold;
+  //*   The solid angle pdf of scene.sampleLightSource choosing the light point
+  //* from the medium vertex at p, the same as the pdf of hitting it
+  static float pdfLightSource(const Scene &scene, const LightSourceInfo &info,
+                              Point3f p) {
+    SurfaceIntersectionInfo lightInfo;
+    Vector3f light2point = p - info.position;
+    lightInfo.position = info.position;
+    lightInfo.geometryNormal = info.normal;
+    lightInfo.primID = info.primID;
+    lightInfo.distance = light2point.length();
+    lightInfo.wi = light2point / lightInfo.distance;
+    return info.light->pdf(lightInfo) *
+           scene.pdfEmitter(info.light, p, Vector3f{0});
+  }
 
-  //* This method samples a pair intersection (surface and medium)
-  //* The empty will be skipped
-  //*     1. If the scatter is medium, only surfaceIts is valid
-  //*     2. If the scatter is surface, return two
-  std::pair<PathInfo, PathInfo> samplePath(
-      const Scene &scene, Ray3f ray, Sampler *sampler,
-      const ScatterInfo *info = nullptr,
-      const LightSourceInfo *lightInfo = nullptr) const {
-    PathInfo surfacePath, mediumPath;
-    surfacePath.pdfDirection = mediumPath.pdfDirection =
-        info ? info->pdf : FINF;
-    surfacePath.length = mediumPath.length = 0;
-    surfacePath.weight = mediumPath.weight =
-        info ? info->weight : SpectrumRGB{1};
-    std::shared_ptr<SurfaceIntersectionInfo> sIts;
-    do {
-      sIts = scene.intersectWithSurface(ray);
-      if (auto medium = ray.medium; medium && !mediumPath.itsInfo) {
-        surfacePath.weight *= medium->evaluateTr(ray.ori, sIts->position);
-        if (!mediumPath.itsInfo &&
-            (!info ||
-             info && info->scatterType == ScatterInfo::ScatterType::Surface)) {
-          auto mIts = lightInfo ? medium->sampleIntersectionEquiAngular(
-                                      ray, sIts->distance, sampler->next2D(),
-                                      *lightInfo)
-                                : medium->sampleIntersectionDeterministic(
-                                      ray, sIts->distance, sampler->next2D());
-          if (mIts) {
-            mediumPath.weight *= mIts->weight;
-            mediumPath.vertex = mIts->position;
-            mediumPath.length += mIts->distance;
-            mediumPath.itsInfo = mIts;
-          }
-        }
-      }
-      surfacePath.itsInfo = sIts;
-      surfacePath.vertex = sIts->position;
-      surfacePath.length += sIts->distance;
-      if (sIts->terminate()) break;
-      ray = sIts->scatterRay(scene, ray.dir);
-    } while (sIts->shape &&
-             sIts->shape->getBSDF()->m_type == BSDF::EBSDFType::EEmpty);
-    return {surfacePath, mediumPath};
+  //*   The solid angle pdf at p of the equiangular strategy choosing the
+  //* light point at position, on an emitter chosen uniformly and uniformly
+  //* on its area
+  static float pdfEquiAngularLight(const Scene &scene,
+                                   std::shared_ptr<Emitter> light,
+                                   Point3f position, Normal3f normal,
+                                   Point3f p) {
+    EmitterHitInfo hitInfo;
+    Vector3f point2light = position - p;
+    hitInfo.dist = point2light.length();
+    hitInfo.hitpoint = position;
+    hitInfo.normal = normal;
+    hitInfo.dir = point2light / hitInfo.dist;
+    return light->pdf(hitInfo) * scene.pdfEmitter(light);
   }
 
-  SpectrumRGB tr(const Scene &scene, Ray3f ray) const {
+  //* The transmittance of the shadow ray, zero if an opaque surface blocks it
+  SpectrumRGB transmittance(const Scene &scene, const Ray3f &ray) const {
+    static thread_local std::vector<MediumSegment> segments;
+    SurfaceIntersectionInfo info;
+    scene.intersectThroughNull(ray, &info, &segments);
+    if (info.shape)
+      return SpectrumRGB{.0f};
     SpectrumRGB Tr{1.f};
-    Point3f destination = ray.at(ray.tmax);
-    auto info = scene.intersectWithSurface(ray);
-    while (true) {
-      if (info->shape &&
-          info->shape->getBSDF()->m_type != BSDF::EBSDFType::EEmpty) {
-        Tr = SpectrumRGB{.0f};
-        break;
-      } else if (!info->shape) {
-        if (auto medium = ray.medium; medium) {
-          Tr *= medium->evaluateTr(ray.ori, destination);
-        }
+    for (const auto &segment : segments) {
+      if (!segment.medium)
+        continue;
+      Tr *= segment.medium->evaluateTr(ray.at(segment.tmin),
+                                       ray.at(segment.tmax));
+      if (Tr.isZero())
         break;
-      } else if (info->shape->getBSDF()->m_type == BSDF::EBSDFType::EEmpty) {
-        if (auto medium = ray.medium; medium) {
-          Tr *= medium->evaluateTr(ray.ori, info->position);
-        }
-        ray = info->scatterRay(scene, ray.dir);
-        info = scene.intersectWithSurface(ray);
-      }
     }
     return Tr;
   }
 };
-REGISTER_CLASS(VolPathTracerPlus, "volpath-tracer-plus")
\ No newline at end of file
+
+REGISTER_CLASS(VolPathTracer, "volpath-tracer")
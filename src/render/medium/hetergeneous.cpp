@@ -1,78 +1,277 @@
 #include "core/render-core/hetergeneous.h"
 
 #include <core/render-core/info.h>
-#include <openvdb/tools/Interpolation.h>
 #include <openvdb/tools/ValueTransformer.h>
+#include <tbb/parallel_for.h>
 
-Hetergeneous::Hetergeneous(openvdb::FloatGrid::Ptr _density, float scale) {
-  density = _density;
+#include <unordered_map>
+
+Hetergeneous::Hetergeneous(openvdb::FloatGrid::Ptr _density, float scale,
+                           bool _trilinear)
+    : trilinear(_trilinear) {
   float tmax = .0f;
-  openvdb::tools::foreach (density->beginValueOn(),
+  openvdb::tools::foreach (_density->beginValueOn(),
                            [&](const openvdb::FloatGrid::ValueOnIter &itr) {
                              itr.setValue(*itr * scale);
                              tmax = tmax > *itr ? tmax : *itr;
                            });
   sigmaTMax = SpectrumRGB{tmax};
+  //* Only the flattened copy is used while rendering, the tree is released
+  //* with the last reference to the grid
+  volume = BrickVolume(*_density);
+  majorants = MajorantGrid(*_density, volume);
+  transform = _density->transform().copy();
 }
 
-SpectrumRGB Hetergeneous::evaluateTr(Point3f start, Point3f end) const {
-  static auto constAccessor = density->getConstAccessor();
-  static openvdb::tools::GridSampler<openvdb::FloatGrid::ConstAccessor,
-                                     openvdb::tools::PointSampler>
-      sampler(constAccessor, density->constTransform());
+BrickVolume::BrickVolume(const openvdb::FloatGrid &grid) {
+  background = grid.background();
+  auto bbox = grid.evalActiveVoxelBoundingBox();
+  if (bbox.empty()) return;
+  for (int axis = 0; axis < 3; ++axis) {
+    lower[axis] = bbox.min()[axis] & ~(BRICK_SIZE - 1);
+    n_bricks[axis] = ((bbox.max()[axis] - lower[axis]) >> BRICK_LOG2) + 1;
+  }
+  std::vector<int> table(n_bricks[0] * n_bricks[1] * n_bricks[2], -1);
+  std::vector<float> pool;
 
-  float sigma_t_max = sigmaTMax.average(), inv_sigma_t_max = 1.0 / sigma_t_max;
-  float distance = (end - start).length(), t = 0;
-  Vector3f dir = normalize(end - start);
-  SpectrumRGB Tr{1};
-
-  while (true) {
-    t -= std::log(1 - Sampler::sample1D()) * inv_sigma_t_max;
-    if (t >= distance) break;
-    Point3f p = start + t * dir;
-    float density = sampler.wsSample(openvdb::Vec3R(p.x, p.y, p.z));
-    Tr *= SpectrumRGB{1 - std::max(.0f, density * inv_sigma_t_max)};
+  //* The bricks inside a constant tile share one copy
+  std::unordered_map<float, int> tiles;
+  auto accessor = grid.getConstAccessor();
+  for (int bz = 0; bz < n_bricks[2]; ++bz)
+    for (int by = 0; by < n_bricks[1]; ++by)
+      for (int bx = 0; bx < n_bricks[0]; ++bx) {
+        int &offset = table[bx + n_bricks[0] * (by + n_bricks[1] * bz)];
+        openvdb::Coord origin(lower[0] + bx * BRICK_SIZE,
+                              lower[1] + by * BRICK_SIZE,
+                              lower[2] + bz * BRICK_SIZE);
+        if (const auto *leaf = accessor.probeConstLeaf(origin)) {
+          offset = pool.size();
+          pool.resize(pool.size() + BRICK_VOXELS);
+          for (int i = 0; i < BRICK_VOXELS; ++i)
+            pool[offset + i] = leaf->getValue(i);
+          continue;
+        }
+        float value = accessor.getValue(origin);
+        if (value == background) continue;
+        auto tile = tiles.find(value);
+        if (tile == tiles.end()) {
+          tile = tiles.emplace(value, (int)pool.size()).first;
+          pool.resize(pool.size() + BRICK_VOXELS, value);
+        }
+        offset = tile->second;
+      }
+  this->table = std::move(table);
+  this->pool = std::move(pool);
+}
+
+MajorantGrid::MajorantGrid(const openvdb::FloatGrid &grid,
+                           const BrickVolume &volume) {
+  auto bbox = grid.evalActiveVoxelBoundingBox();
+  if (bbox.empty()) return;
+  //* A lookup at a voxel reads its neighbours when interpolating
+  bbox.expand(1);
+  for (int axis = 0; axis < 3; ++axis) {
+    lower[axis] = bbox.min()[axis] - .5f;
+    resolution[axis] = (bbox.dim()[axis] + CELL_SIZE - 1) / CELL_SIZE;
+  }
+  //* The background is the density outside the active voxels
+  std::vector<float> values(resolution[0] * resolution[1] * resolution[2],
+                            std::max(.0f, grid.background()));
+  for (auto itr = grid.cbeginValueOn(); itr; ++itr) {
+    openvdb::CoordBBox voxels;
+    itr.getBoundingBox(voxels);
+    voxels.expand(1);
+    int from[3], to[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      from[axis] = std::max(
+          0, int(std::floor((voxels.min()[axis] - .5f - lower[axis]) /
+                            CELL_SIZE)));
+      to[axis] = std::min(
+          resolution[axis] - 1,
+          int(std::floor((voxels.max()[axis] + .5f - lower[axis]) /
+                         CELL_SIZE)));
+    }
+    float value = *itr;
+    for (int z = from[2]; z <= to[2]; ++z)
+      for (int y = from[1]; y <= to[1]; ++y)
+        for (int x = from[0]; x <= to[0]; ++x) {
+          float &majorant = values[x + resolution[0] * (y + resolution[1] * z)];
+          majorant = std::max(majorant, value);
+        }
   }
 
-  return Tr;
+  //*   A lookup in a cell reads the voxels from the floor of its lower bound
+  //* to the floor of its upper bound plus one. Most cells of a sparse volume
+  //* touch the empty space and stop at the first zero
+  std::vector<float> minimums(values.size(), .0f);
+  tbb::parallel_for(0, resolution[2], [&](int z) {
+    auto cellMinimum = [&](int x, int y) {
+      int cell[3] = {x, y, z}, from[3], to[3];
+      for (int axis = 0; axis < 3; ++axis) {
+        float lo = lower[axis] + cell[axis] * CELL_SIZE;
+        from[axis] = int(std::floor(lo));
+        to[axis] = int(std::floor(lo + CELL_SIZE)) + 1;
+      }
+      float minimum = FINF;
+      for (int vz = from[2]; vz <= to[2]; ++vz)
+        for (int vy = from[1]; vy <= to[1]; ++vy)
+          for (int vx = from[0]; vx <= to[0]; ++vx) {
+            minimum = std::min(minimum, volume.at(vx, vy, vz));
+            if (minimum <= 0) return .0f;
+          }
+      return minimum;
+    };
+    for (int y = 0; y < resolution[1]; ++y)
+      for (int x = 0; x < resolution[0]; ++x)
+        minimums[x + resolution[0] * (y + resolution[1] * z)] =
+            cellMinimum(x, y);
+  });
+  this->values = std::move(values);
+  this->minimums = std::move(minimums);
+}
+
+void BrickVolume::write(SnapshotWriter &out) const {
+  out.value(lower);
+  out.value(n_bricks);
+  out.value(background);
+  out.array(table.data(), table.size());
+  out.array(pool.data(), pool.size());
+}
+
+bool BrickVolume::read(SnapshotReader &in) {
+  if (!in.value(&lower) || !in.value(&n_bricks) || !in.value(&background) ||
+      !in.array(&table) || !in.array(&pool))
+    return false;
+  //* A corrupted snapshot must not read out of the pool
+  for (int axis = 0; axis < 3; ++axis)
+    if (n_bricks[axis] < 0) return false;
+  if (table.size() != (size_t)n_bricks[0] * n_bricks[1] * n_bricks[2])
+    return false;
+  for (int offset : table)
+    if (offset >= 0 && (size_t)offset + BRICK_VOXELS > pool.size())
+      return false;
+  return true;
+}
+
+void MajorantGrid::write(SnapshotWriter &out) const {
+  out.value(lower);
+  out.value(resolution);
+  out.array(values.data(), values.size());
+  out.array(minimums.data(), minimums.size());
+}
+
+bool MajorantGrid::read(SnapshotReader &in) {
+  if (!in.value(&lower) || !in.value(&resolution) || !in.array(&values) ||
+      !in.array(&minimums))
+    return false;
+  for (int axis = 0; axis < 3; ++axis)
+    if (resolution[axis] < 0) return false;
+  size_t cells = (size_t)resolution[0] * resolution[1] * resolution[2];
+  return values.size() == cells && minimums.size() == cells;
+}
+
+void Hetergeneous::write(SnapshotWriter &out) const {
+  openvdb::Mat4R m = transform->baseMap()->getAffineMap()->getMat4();
+  double matrix[16];
+  for (int i = 0; i < 16; ++i) matrix[i] = m(i / 4, i % 4);
+  out.value(matrix);
+  out.value(sigmaTMax[0]);
+  volume.write(out);
+  majorants.write(out);
+}
+
+std::shared_ptr<Hetergeneous> Hetergeneous::read(SnapshotReader &in,
+                                                 bool trilinear) {
+  auto medium = std::make_shared<Hetergeneous>();
+  double matrix[16];
+  float tmax;
+  if (!in.value(&matrix) || !in.value(&tmax) || !medium->volume.read(in) ||
+      !medium->majorants.read(in))
+    return nullptr;
+  openvdb::Mat4R m;
+  for (int i = 0; i < 16; ++i) m(i / 4, i % 4) = matrix[i];
+  medium->transform = openvdb::math::Transform::createLinearTransform(m);
+  medium->sigmaTMax = SpectrumRGB{tmax};
+  medium->trilinear = trilinear;
+  return medium;
+}
+
+std::pair<Point3f, Vector3f> Hetergeneous::toIndexSpace(Point3f o,
+                                                        Vector3f d) const {
+  auto io = transform->worldToIndex(openvdb::Vec3d(o.x, o.y, o.z)),
+       ie = transform->worldToIndex(
+           openvdb::Vec3d(o.x + d.x, o.y + d.y, o.z + d.z));
+  return {Point3f(io.x(), io.y(), io.z()),
+          Vector3f(ie.x() - io.x(), ie.y() - io.y(), ie.z() - io.z())};
+}
+
+SpectrumRGB Hetergeneous::evaluateTr(Point3f start, Point3f end) const {
+  float distance = (end - start).length();
+  if (distance == 0) return SpectrumRGB{1};
+  Vector3f dir = normalize(end - start);
+  auto [o, d] = toIndexSpace(start, dir);
+  float Tr = 1;
+
+  //* Track each cell with its own majorant, the empty cells are skipped
+  majorants.traverse(o, d, 0, distance, [&](float t0, float t1,
+                                             float sigma_t_max,
+                                             float sigma_t_min) {
+    //* The control part of the cell is integrated analytically, only the
+    //* residual density is left to the free flights
+    float sigma_c =
+        mTrEstimator == TrEstimator::ResidualRatio ? sigma_t_min : .0f;
+    Tr *= std::exp(-sigma_c * (t1 - t0));
+    float sigma_r_max = sigma_t_max - sigma_c;
+    if (sigma_r_max <= 0) return true;
+    float inv_sigma_r_max = 1.f / sigma_r_max, t = t0;
+    while (true) {
+      t -= std::log(1 - Sampler::sample1D()) * inv_sigma_r_max;
+      if (t >= t1) return true;
+      float sigma_r = lookup(o + t * d) - sigma_c;
+      float p_real = std::clamp(sigma_r * inv_sigma_r_max, .0f, 1.f);
+      if (mTrEstimator == TrEstimator::Delta) {
+        //* The first real collision blocks the ray
+        if (Sampler::sample1D() < p_real) Tr = 0;
+      } else {
+        Tr *= 1 - p_real;
+      }
+      if (Tr == 0) return false;
+    }
+  });
+
+  return SpectrumRGB{Tr};
 }
 
 std::shared_ptr<MediumIntersectionInfo> Hetergeneous::sampleIntersection(
     Ray3f ray, float tBounds, Point2f sample) const {
   auto mIts = std::make_shared<MediumIntersectionInfo>();
 
-  static auto constAccessor = density->getConstAccessor();
-  static openvdb::tools::GridSampler<openvdb::FloatGrid::ConstAccessor,
-                                     openvdb::tools::PointSampler>
-      mediumQuery(constAccessor, density->constTransform());
+  mIts->medium = nullptr;
+  mIts->position = ray.at(tBounds);
+  mIts->distance = tBounds;
+  mIts->weight = SpectrumRGB{1};
 
-  auto [x, y] = sample;
-  int channel = std::min(int(y * 3), 2);
-  float sigma_t_max = sigmaTMax[channel], inv_sigma_t_max = 1.0 / sigma_t_max,
-        distance = 0;
-
-  //* Delta tracking
-  while (true) {
-    distance += -std::log(1 - Sampler::sample1D()) * inv_sigma_t_max;
-    if (distance >= tBounds) {
-      mIts->medium = nullptr;
-      mIts->position = ray.at(tBounds);
-      mIts->distance = tBounds;
-      mIts->weight = SpectrumRGB{1};
-      break;
+  //* Delta tracking, each cell of the majorant grid with its own majorant
+  auto [o, d] = toIndexSpace(ray.ori, ray.dir);
+  majorants.traverse(o, d, 0, tBounds, [&](float t0, float t1,
+                                            float sigma_t_max, float) {
+    if (sigma_t_max <= 0) return true;
+    float inv_sigma_t_max = 1.f / sigma_t_max, distance = t0;
+    while (true) {
+      distance -= std::log(1 - Sampler::sample1D()) * inv_sigma_t_max;
+      if (distance >= t1) return true;
+      float sigma_t = lookup(o + distance * d);
+      if (Sampler::sample1D() < sigma_t * inv_sigma_t_max) {
+        //* Yes, scatter
+        mIts->medium = this;
+        mIts->position = ray.at(distance);
+        mIts->distance = distance;
+        mIts->wi = ray.dir;
+        mIts->shadingFrame = Frame{mIts->wi};
+        return false;
+      }
     }
-    Point3f p = ray.at(distance);
-    float sigma_t = mediumQuery.wsSample(openvdb::Vec3R(p.x, p.y, p.z));
-    if (Sampler::sample1D() < sigma_t * inv_sigma_t_max) {
-      //* Yes, scatter
-      mIts->medium = this;
-      mIts->position = ray.at(distance);
-      mIts->wi = ray.dir;
-      mIts->shadingFrame = Frame{mIts->wi};
-      mIts->weight = SpectrumRGB{1};
-      break;
-    }
-  }
+  });
   return mIts;
 }
 
@@ -93,11 +292,7 @@ Hetergeneous::sampleIntersectionDeterministic(Ray3f ray, float tBounds,
 
 // todo fixme
 SpectrumRGB Hetergeneous::sigmaS(Point3f p) const {
-  static auto constAccessor = density->getConstAccessor();
-  static openvdb::tools::GridSampler<openvdb::FloatGrid::ConstAccessor,
-                                     openvdb::tools::PointSampler>
-      mediumQuery(constAccessor, density->constTransform());
-
-  float sigma_t = mediumQuery.wsSample(openvdb::Vec3R(p.x, p.y, p.z));
+  auto ip = transform->worldToIndex(openvdb::Vec3d(p.x, p.y, p.z));
+  float sigma_t = lookup(Point3f(ip.x(), ip.y(), ip.z()));
   return SpectrumRGB{sigma_t};
-}
\ No newline at end of file
+}
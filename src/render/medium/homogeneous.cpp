@@ -1,7 +1,6 @@
 #include <core/render-core/info.h>
 
 #include "core/render-core/medium.h"
-#include "pathsampler.h"
 
 class Homogeneous : public Medium {
  public:
@@ -89,6 +88,14 @@ class Homogeneous : public Medium {
     return mIts;
   }
 
+  //* One of the channels is chosen uniformly by sampleIntersection
+  virtual float pdfDistance(float t) const override {
+    float pdf = .0f;
+    for (int i = 0; i < 3; ++i)
+      pdf += mDensity[i] * std::exp(-mDensity[i] * t) / 3;
+    return pdf;
+  }
+
   virtual SpectrumRGB sigmaS(Point3f p) const override {
     return mDensity * mAlbedo;
   }
@@ -97,8 +104,6 @@ class Homogeneous : public Medium {
   SpectrumRGB mDensity;
   SpectrumRGB mAlbedo;
   SpectrumRGB mEmission;
-
-  std::shared_ptr<PathSampler> pathSampler = std::make_shared<EquiAngular>();
 };
 
 REGISTER_CLASS(Homogeneous, "homogeneous")
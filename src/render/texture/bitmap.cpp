@@ -1,90 +1,92 @@
 #include "core/math/common.h"
+#include "core/render-core/assetcache.h"
 #include "core/render-core/texture.h"
+#include "core/render-core/texturecache.h"
 
 class Bitmap : public Texture {
-  SpectrumRGB **mData;
-  int mWidth, mHeight, mChannels;
+  //* The decoded image, shared by the bitmaps of the same image
+  struct Image {
+    //* The texels in memory, empty when they are in the texture cache
+    TexelBuffer texels;
+    //* The handle in the texture cache, -1 when the texels are in memory
+    int file = -1;
+    int width = 0, height = 0;
+    SpectrumRGB average{.0f};
+
+    SpectrumRGB texel(int x, int y) const {
+      if (file >= 0) return TextureCache::instance().texel(file, 0, x, y);
+      return texels.texel(x, y);
+    }
+  };
+
+  std::shared_ptr<const Image> mImage;
+  bool mBilinear = true;
+
+  static Image loadImage(const std::string &filepath, bool srgb, bool half) {
+    Image image;
+    auto &cache = TextureCache::instance();
+    if (cache.enabled()) {
+      //* The average comes from the header, no tile is read before the
+      //* first lookup
+      image.file = cache.openImage(filepath, srgb, half);
+      const TileLayout &layout = cache.layout(image.file, 0);
+      image.width = layout.width;
+      image.height = layout.height;
+      image.average = cache.average(image.file);
+      return image;
+    }
+    image.texels = TextureLoader::load(filepath, srgb, half);
+    image.width = image.texels.width();
+    image.height = image.texels.height();
+    image.average = image.texels.average();
+    return image;
+  }
 
  public:
   Bitmap() = default;
   Bitmap(const rapidjson::Value &_value) {
     // load the texture
     std::string filepath = _value["filepath"].GetString();
-    mData = TextureLoader::toRGB(filepath, mWidth, mHeight, mChannels);
+    Params params(_value);
+    //* The 8 bits images are taken as linear unless srgb is set, the normal
+    //* maps must stay linear
+    bool srgb = params.fetch<bool>("srgb", false),
+         half = params.fetch<bool>("half", false);
+    mBilinear = params.fetch<bool>("bilinear", true);
+    std::string options =
+        std::string(srgb ? "srgb" : "linear") + (half ? "-half" : "");
+    mImage = AssetCache::instance().get<Image>(
+        filepath, options, [&] { return loadImage(filepath, srgb, half); });
   }
   Bitmap(const Bitmap &rhs) = delete;
   Bitmap &operator()(const Bitmap &rhs) = delete;
-  virtual ~Bitmap() {
-    for (int i = 0; i < mWidth; ++i) delete[] mData[i];
-    delete[] mData;
-  }
+  virtual ~Bitmap() = default;
 
   virtual SpectrumRGB evaluate(const Point2f &uv, float du,
                                float dv) const override {
-    int x = std::min(static_cast<int>(std::abs(uv.x) * mWidth), mWidth - 1);
-    int y = std::min(static_cast<int>(std::abs(uv.y) * mHeight), mHeight - 1);
-
-    int x_ =
-        std::min(static_cast<int>(std::abs(uv.x + du) * mWidth), mWidth - 1);
-    int y_ =
-        std::min(static_cast<int>(std::abs(uv.y + dv) * mHeight), mHeight - 1);
-
-    return (mData[x][y] + mData[x][y_] + mData[x_][y]) / 3;
+    const Image &image = *mImage;
+    auto fetch = [&image](int x, int y) { return image.texel(x, y); };
+    return mBilinear ? bilinearLookup(image.width, image.height, uv, fetch)
+                     : nearestLookup(image.width, image.height, uv, fetch);
   }
 
-  virtual SpectrumRGB average() const override {
-    // TODO no implement
-    return SpectrumRGB{.5f};
-  }
+  virtual SpectrumRGB average() const override { return mImage->average; }
 
   virtual Vector2i getResolution() const override {
-    return Vector2i{mWidth, mHeight};
+    return Vector2i{mImage->width, mImage->height};
   }
 
+  //* Forward differences over one texel, per unit of uv
   virtual SpectrumRGB dfdu(Point2f uv, float du = 0,
                            float dv = 0) const override {
-    int x = std::min(static_cast<int>(std::abs(uv.x) * mWidth), mWidth - 1);
-    int y = std::min(static_cast<int>(std::abs(uv.y) * mHeight), mHeight - 1);
-
-    int x_ =
-        std::min(static_cast<int>(std::abs(uv.x + du) * mWidth), mWidth - 1);
-    int y_ =
-        std::min(static_cast<int>(std::abs(uv.y + dv) * mHeight), mHeight - 1);
-
-    SpectrumRGB f =
-        (mData[x][y] + mData[x_][y] + mData[x][y_] + mData[x_][y_]) * 0.25f;
-
-    x = std::min(static_cast<int>(std::abs(uv.x + 1) * mWidth), mWidth - 1);
-    x_ = std::min(static_cast<int>(std::abs(uv.x + 1 + du) * mWidth),
-                  mWidth - 1);
-
-    SpectrumRGB f_ =
-        (mData[x][y] + mData[x_][y] + mData[x][y_] + mData[x_][y_]) * 0.25f;
-
-    return f_ - f;
+    float h = 1.f / mImage->width;
+    return (evaluate(Point2f{uv.x + h, uv.y}, 0, 0) - evaluate(uv, 0, 0)) / h;
   }
 
   virtual SpectrumRGB dfdv(Point2f uv, float du = 0,
                            float dv = 0) const override {
-    int x = std::min(static_cast<int>(std::abs(uv.x) * mWidth), mWidth - 1);
-    int y = std::min(static_cast<int>(std::abs(uv.y) * mHeight), mHeight - 1);
-
-    int x_ =
-        std::min(static_cast<int>(std::abs(uv.x + du) * mWidth), mWidth - 1);
-    int y_ =
-        std::min(static_cast<int>(std::abs(uv.y + dv) * mHeight), mHeight - 1);
-
-    SpectrumRGB f =
-        (mData[x][y] + mData[x_][y] + mData[x][y_] + mData[x_][y_]) * 0.25f;
-
-    y = std::min(static_cast<int>(std::abs(uv.y + 1) * mHeight), mHeight - 1);
-    y_ = std::min(static_cast<int>(std::abs(uv.y + 1 + dv) * mHeight),
-                  mHeight - 1);
-
-    SpectrumRGB f_ =
-        (mData[x][y] + mData[x_][y] + mData[x][y_] + mData[x_][y_]) * 0.25f;
-
-    return f_ - f;
+    float h = 1.f / mImage->height;
+    return (evaluate(Point2f{uv.x, uv.y + h}, 0, 0) - evaluate(uv, 0, 0)) / h;
   }
 };
 
@@ -1,17 +1,231 @@
 #include "mipmap.h"
 
+#include <core/render-core/assetcache.h>
+#include <core/render-core/texturecache.h>
+#include <tbb/parallel_for.h>
+
+//*   The pyramid down to a single texel. Each level is box filtered from the
+//* float texels of the previous one, so the quantization doesn't accumulate.
+//* The last row and column of an odd level fold in the texel left over
+static std::vector<TexelBuffer> buildPyramid(TexelBuffer base) {
+  int width = base.width(), height = base.height();
+  TexelFormat format = base.format();
+  std::vector<float> texels((size_t)width * height * 3);
+  tbb::parallel_for(0, height, [&](int y) {
+    for (int x = 0; x < width; ++x) {
+      SpectrumRGB value = base.texel(x, y);
+      for (int c = 0; c < 3; ++c)
+        texels[3 * ((size_t)y * width + x) + c] = value[c];
+    }
+  });
+
+  std::vector<TexelBuffer> pyramid;
+  pyramid.emplace_back(std::move(base));
+  while (width > 1 || height > 1) {
+    int w = std::max(1, width / 2), h = std::max(1, height / 2);
+    std::vector<float> next((size_t)w * h * 3);
+    tbb::parallel_for(0, h, [&](int y) {
+      int y0 = 2 * y, y1 = y == h - 1 ? height : 2 * y + 2;
+      for (int x = 0; x < w; ++x) {
+        int x0 = 2 * x, x1 = x == w - 1 ? width : 2 * x + 2;
+        float sum[3] = {0, 0, 0};
+        for (int sy = y0; sy < y1; ++sy)
+          for (int sx = x0; sx < x1; ++sx)
+            for (int c = 0; c < 3; ++c)
+              sum[c] += texels[3 * ((size_t)sy * width + sx) + c];
+        float invCount = 1.f / ((y1 - y0) * (x1 - x0));
+        for (int c = 0; c < 3; ++c)
+          next[3 * ((size_t)y * w + x) + c] = sum[c] * invCount;
+      }
+    });
+    pyramid.emplace_back(w, h, format, next.data());
+    texels = std::move(next);
+    width = w;
+    height = h;
+  }
+  return pyramid;
+}
+
+MipMap::MipMap(const rapidjson::Value &_value) {
+  std::string filepath = _value["filepath"].GetString();
+  Params params(_value);
+  bool srgb = params.fetch<bool>("srgb", false),
+       half = params.fetch<bool>("half", false),
+       cache = params.fetch<bool>("cache", true);
+  mMaxAnisotropy = std::max(1.f, params.fetch<float>("maxAnisotropy", 8.f));
+  if (_value.HasMember("filter")) {
+    std::string filter = _value["filter"].GetString();
+    if (filter == "ewa") {
+      mEWA = true;
+    } else if (filter == "trilinear") {
+      mEWA = false;
+    } else {
+      std::cerr << "Unknown mipmap filter : " << filter << std::endl;
+      std::exit(1);
+    }
+  }
+
+  std::string options =
+      std::string(srgb ? "srgb" : "linear") + (half ? "-half" : "") +
+      (cache ? "" : "-uncached");
+  mPyramid = AssetCache::instance().get<Pyramid>(filepath, options, [&] {
+    return loadPyramid(filepath, srgb, half, cache);
+  });
+}
+
+MipMap::Pyramid MipMap::loadPyramid(const std::string &filepath, bool srgb,
+                                    bool half, bool cache) {
+  auto &textureCache = TextureCache::instance();
+  std::string variant =
+      std::string(srgb ? "srgb" : "linear") + (half ? "-half" : "") + "-mip";
+  std::string tiledPath = textureCache.tiledFile(filepath, variant);
+  std::vector<TexelBuffer> levels;
+  bool cached = cache && TextureCache::upToDate(tiledPath, filepath);
+  if (!cached) {
+    std::cout << "Constructing mipmap of " << filepath << "\n";
+    levels = buildPyramid(TextureLoader::load(filepath, srgb, half));
+    if (cache) {
+      cached = TextureCache::writeTiled(tiledPath,
+                                        FileIdentity::of(filepath), levels);
+      if (!cached)
+        std::cout << "Can't write the mipmap cache " << tiledPath << "\n";
+    }
+  }
+
+  Pyramid pyramid;
+  if (cached && textureCache.enabled()) {
+    pyramid.file = textureCache.open(tiledPath);
+    for (int i = 0; i < textureCache.levels(pyramid.file); ++i) {
+      const TileLayout &layout = textureCache.layout(pyramid.file, i);
+      pyramid.resolutions.emplace_back(layout.width, layout.height);
+    }
+  } else {
+    if (levels.empty())
+      levels = TextureCache::readTiled(tiledPath);
+    pyramid.levels = std::move(levels);
+    for (const auto &level : pyramid.levels)
+      pyramid.resolutions.emplace_back(level.width(), level.height());
+  }
+  //* The coarsest level is the single texel average
+  pyramid.average = pyramid.texel(pyramid.resolutions.size() - 1, 0, 0);
+  return pyramid;
+}
+
+SpectrumRGB MipMap::Pyramid::texel(int level, int x, int y) const {
+  if (file >= 0)
+    return TextureCache::instance().texel(file, level, x, y);
+  return levels[level].texel(x, y);
+}
+
+SpectrumRGB MipMap::bilinear(int level, Point2f uv) const {
+  Vector2i resolution = mPyramid->resolutions[level];
+  return bilinearLookup(resolution.x, resolution.y, uv,
+                        [&](int x, int y) { return texel(level, x, y); });
+}
+
+SpectrumRGB MipMap::trilinear(Point2f uv, float width) const {
+  float level = levelOf(width);
+  if (level <= 0)
+    return bilinear(0, uv);
+  if (level >= levels() - 1)
+    return texel(levels() - 1, 0, 0);
+  int lower = level;
+  float delta = level - lower;
+  return bilinear(lower, uv) * (1 - delta) + bilinear(lower + 1, uv) * delta;
+}
+
 SpectrumRGB MipMap::evaluate(const Point2f &uv, float du, float dv) const {
-  float width = std::max(du, dv);
-  float level = maps.size() - 1 + std::log2(std::max(width, 1e-8f));
+  return trilinear(uv, std::max(du, dv));
+}
+
+SpectrumRGB MipMap::evaluate(const Point2f &uv, const Vector2f &duvdx,
+                             const Vector2f &duvdy) const {
+  if (!mEWA)
+    return Texture::evaluate(uv, duvdx, duvdy);
+
+  Vector2f major = duvdx, minor = duvdy;
+  if (major.length2() < minor.length2())
+    std::swap(major, minor);
+  float majorLength = major.length(), minorLength = minor.length();
+  //* Without a footprint, e.g. the rays without differentials
+  if (minorLength == 0)
+    return bilinear(0, uv);
+  //* Widen the too thin ellipses, trading blur for a bounded filter width
+  if (minorLength * mMaxAnisotropy < majorLength) {
+    float scale = majorLength / (minorLength * mMaxAnisotropy);
+    minor *= scale;
+    minorLength *= scale;
+  }
+
+  float level = std::max(.0f, levelOf(minorLength));
+  int lower = level;
+  if (lower >= levels() - 1)
+    return texel(levels() - 1, 0, 0);
+  float delta = level - lower;
+  return ewa(lower, uv, major, minor) * (1 - delta) +
+         ewa(lower + 1, uv, major, minor) * delta;
+}
 
-  if (level < 0) return maps[0]->evaluate(uv);
-  if (level >= maps.size() - 1) return maps.back()->evaluate(uv);
+SpectrumRGB MipMap::ewa(int level, Point2f uv, Vector2f duvdx,
+                        Vector2f duvdy) const {
+  Vector2i resolution = mPyramid->resolutions[level];
+  //* To the texel space of the level, texel centers at integers
+  float s = std::abs(uv.x) * resolution.x - .5f,
+        t = std::abs(uv.y) * resolution.y - .5f;
+  Vector2f d0{duvdx.x * resolution.x, duvdx.y * resolution.y},
+      d1{duvdy.x * resolution.x, duvdy.y * resolution.y};
+
+  //* The implicit ellipse A s^2 + B s t + C t^2 = 1, the ones keep it at
+  //* least a texel wide
+  float A = d0.y * d0.y + d1.y * d1.y + 1,
+        B = -2 * (d0.x * d0.y + d1.x * d1.y),
+        C = d0.x * d0.x + d1.x * d1.x + 1;
+  float invF = 1 / (A * C - B * B * .25f);
+  A *= invF;
+  B *= invF;
+  C *= invF;
+
+  //* The bounding box of the ellipse
+  float det = -B * B + 4 * A * C, invDet = 1 / det;
+  float uSqrt = std::sqrt(det * C), vSqrt = std::sqrt(A * det);
+  int s0 = std::ceil(s - 2 * invDet * uSqrt),
+      s1 = std::floor(s + 2 * invDet * uSqrt),
+      t0 = std::ceil(t - 2 * invDet * vSqrt),
+      t1 = std::floor(t + 2 * invDet * vSqrt);
+
+  //* Gaussian weights falling to zero at the border of the ellipse
+  static const float alpha = 2, border = std::exp(-alpha);
+  SpectrumRGB sum{.0f};
+  float sumWeights = 0;
+  for (int it = t0; it <= t1; ++it) {
+    float tt = it - t;
+    int y = std::clamp(it, 0, resolution.y - 1);
+    for (int is = s0; is <= s1; ++is) {
+      float ss = is - s;
+      float r2 = A * ss * ss + B * ss * tt + C * tt * tt;
+      if (r2 >= 1)
+        continue;
+      float weight = std::exp(-alpha * r2) - border;
+      sum += texel(level, std::clamp(is, 0, resolution.x - 1), y) * weight;
+      sumWeights += weight;
+    }
+  }
+  if (sumWeights <= 0)
+    return bilinear(level, uv);
+  return sum / sumWeights;
+}
+
+//* Forward differences over the footprint, at least a texel, per unit of uv
+SpectrumRGB MipMap::dfdu(Point2f uv, float du, float dv) const {
+  float h = std::max(1.f / getResolution().x, du);
+  return (evaluate(Point2f{uv.x + h, uv.y}, du, dv) - evaluate(uv, du, dv)) /
+         h;
+}
 
-  //* do interpolation
-  int lowLevel = level, highLevel = lowLevel + 1;
-  SpectrumRGB lerpl = maps[lowLevel]->evaluate(uv, true),
-              lerph = maps[highLevel]->evaluate(uv, true);
-  return lerpl * (level - lowLevel) + lerph * (highLevel - level);
+SpectrumRGB MipMap::dfdv(Point2f uv, float du, float dv) const {
+  float h = std::max(1.f / getResolution().y, dv);
+  return (evaluate(Point2f{uv.x, uv.y + h}, du, dv) - evaluate(uv, du, dv)) /
+         h;
 }
 
-REGISTER_CLASS(MipMap, "mipmap")
\ No newline at end of file
+REGISTER_CLASS(MipMap, "mipmap")
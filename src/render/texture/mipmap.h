@@ -1,56 +1,80 @@
 #pragma once
-#include <core/file/figure.h>
 #include <core/math/common.h>
 #include <core/render-core/texture.h>
-#include <fmt/format.h>
 
+//*   Mip-mapped image texture. The pyramid is built by box filtering down to
+//* a single texel, in parallel over the rows of each level, and is kept in a
+//* tiled file next to the image (or in the directory of the texture cache)
+//* so it's only built again when the image changes. With the texture cache
+//* enabled the levels are read through it tile by tile. The mipmaps of the
+//* same image share the pyramid through the asset cache.
+//*   The lookups pick the level from the footprint of the pixel, either
+//* trilinearly from its larger extent, or with the EWA filter of "Creating
+//* raster omnimax images from multiple perspective views using the elliptical
+//* weighted average filter" (Greene and Heckbert 1986) over the ellipse of
+//* the footprint, whose eccentricity is clamped by maxAnisotropy
 class MipMap : public Texture {
  public:
   MipMap() = delete;
 
-  MipMap(const rapidjson::Value &_value) {
-    std::string filepath = _value["filepath"].GetString();
-    auto originMap = std::make_shared<Figure>(_value["filepath"].GetString());
-    std::cout << "Constructing mipmap\n";
-
-    int levels =
-        std::min(std::log2(originMap->width), std::log2(originMap->height));
-
-    maps.reserve(levels);
-    maps.emplace_back(originMap);
-    for (int i = 1; i < levels; ++i) {
-      maps.emplace_back(maps[i - 1]->shrinkHalfBox());
-    }
-  }
-
-  //* Delete this, replace with json
-  MipMap(std::shared_ptr<Figure> originMap) {
-    std::cout << "Constructing mipmap\n";
-    int levels =
-        std::min(std::log2(originMap->width), std::log2(originMap->height));
-
-    maps.reserve(levels);
-    maps.emplace_back(originMap);
-    for (int i = 1; i < levels; ++i) {
-      maps.emplace_back(maps[i - 1]->shrinkHalfBox());
-    }
-  }
+  MipMap(const rapidjson::Value &_value);
 
   virtual ~MipMap() = default;
 
   virtual SpectrumRGB evaluate(const Point2f &uv, float du = 0,
                                float dv = 0) const override;
 
-  virtual SpectrumRGB average() const override {}
+  virtual SpectrumRGB evaluate(const Point2f &uv, const Vector2f &duvdx,
+                               const Vector2f &duvdy) const override;
 
-  virtual Vector2i getResolution() const override {}
+  virtual SpectrumRGB average() const override { return mPyramid->average; }
+
+  virtual Vector2i getResolution() const override {
+    return mPyramid->resolutions[0];
+  }
 
   virtual SpectrumRGB dfdu(Point2f uv, float du = 0,
-                           float dv = 0) const override {}
+                           float dv = 0) const override;
 
   virtual SpectrumRGB dfdv(Point2f uv, float du = 0,
-                           float dv = 0) const override {}
+                           float dv = 0) const override;
 
  private:
-  std::vector<std::shared_ptr<Figure>> maps;
+  struct Pyramid {
+    //* The levels in memory, empty when they are in the texture cache
+    std::vector<TexelBuffer> levels;
+    //* The handle in the texture cache, -1 when the levels are in memory
+    int file = -1;
+    std::vector<Vector2i> resolutions;
+    SpectrumRGB average{.0f};
+
+    SpectrumRGB texel(int level, int x, int y) const;
+  };
+
+  static Pyramid loadPyramid(const std::string &filepath, bool srgb,
+                             bool half, bool cache);
+
+  SpectrumRGB texel(int level, int x, int y) const {
+    return mPyramid->texel(level, x, y);
+  }
+
+  SpectrumRGB bilinear(int level, Point2f uv) const;
+
+  //* Blend the two levels around the footprint of width (in uv)
+  SpectrumRGB trilinear(Point2f uv, float width) const;
+
+  SpectrumRGB ewa(int level, Point2f uv, Vector2f duvdx, Vector2f duvdy) const;
+
+  int levels() const { return mPyramid->resolutions.size(); }
+
+  //* The continuous level whose texels are width wide
+  float levelOf(float width) const {
+    Vector2i finest = mPyramid->resolutions[0];
+    int resolution = std::max(finest.x, finest.y);
+    return std::log2(std::max(width * resolution, 1e-8f));
+  }
+
+  std::shared_ptr<const Pyramid> mPyramid;
+  bool mEWA = true;
+  float mMaxAnisotropy = 8.f;
 };
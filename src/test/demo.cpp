@@ -1,3 +1,4 @@
+#include <core/render-core/texturecache.h>
 #include <core/scene/scene.h>
 #include <core/shape/mesh.h>
 #include <core/shape/shape.h>
@@ -13,4 +14,5 @@ int main(int argc, char **argv) {
   auto task = createTask(argv[1]);
   auto integrator = task->integrator;
   integrator->render(task);
+  TextureCache::instance().printStatistics();
 }
\ No newline at end of file